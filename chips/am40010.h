@@ -41,7 +41,13 @@
     **************************************
 
     ## Notes
-    (TODO)
+
+    The video output goes either as RGBA8 pixels into rgba8_buffer, or as
+    8-bit color indices into index8_buffer. The indices 0..31 are the
+    hardware colors, and index 32 is black (see am40010_palette()).
+    Pixels are only written when they differ from the framebuffer content,
+    and display lines with changed pixels are flagged in a dirty-row
+    bitmap (see am40010_dirty_rows()).
 
     ## Links
     
@@ -76,6 +82,8 @@ extern "C" {
 #define AM40010_DISPLAY_HEIGHT (272)
 #define AM40010_DBG_DISPLAY_WIDTH (1024)
 #define AM40010_DBG_DISPLAY_HEIGHT (312)
+#define AM40010_NUM_COLORS (33)     /* 32 hardware colors plus black */
+#define AM40010_DIRTY_WORDS ((AM40010_DBG_DISPLAY_HEIGHT+31)/32)
 
 /* Z80-compatible pins */
 #define AM40010_A13     (1ULL<<13)
@@ -163,6 +171,8 @@ typedef struct am40010_desc_t {
     uint32_t ram_size;                  /* must be >= 64 KBytes */
     uint32_t* rgba8_buffer;             /* pointer the RGBA8 output framebuffer */
     uint32_t rgba8_buffer_size;         /* must be at least 1024*312*4 bytes */
+    uint8_t* index8_buffer;             /* or alternatively an 8-bit color index framebuffer */
+    uint32_t index8_buffer_size;        /* must be at least 1024*312 bytes */
     void* user_data;                    /* optional userdata for callbacks */
 } am40010_desc_t;
 
@@ -177,9 +187,11 @@ typedef struct am40010_registers_t {
 /* decoded RGBA8 colors */
 typedef struct am40010_colors_t {
     bool dirty;
-    uint32_t ink_rgba8[16];         /* the current ink colors as RGBA8 */
-    uint32_t border_rgba8;          /* the current border color as RGBA8 */
+    uint32_t ink_rgba8[16];         /* the current ink colors as RGBA8 (or color index) */
+    uint32_t border_rgba8;          /* the current border color as RGBA8 (or color index) */
+    uint32_t black;                 /* black as RGBA8 (or color index) */
     uint32_t hw_rgba8[32];          /* the hardware color RGBA8 values */
+    uint8_t pen_lut[4][256][8];     /* per video mode: pixel byte => ink index of its 8 output pixels */
 } am40010_colors_t;
 
 /* vsync/video/irq generation */
@@ -222,6 +234,9 @@ typedef struct am40010_t {
     am40010_cclk_t cclk_cb;
     const uint8_t* ram;
     uint32_t* rgba8_buffer;
+    uint8_t* index8_buffer;
+    bool indexed;               /* true if initialized with index8_buffer (the buffer pointers may be cleared temporarily) */
+    uint32_t dirty_rows[AM40010_DIRTY_WORDS];   /* one bit per changed display line */
     void* user_data;
     uint64_t pins;              /* only for debug inspection */
 } am40010_t;
@@ -247,6 +262,10 @@ void am40010_iorq(am40010_t* ga, uint64_t cpu_pins);
         Z80_INT         - interrupt request from the gate array was triggered
 */
 uint64_t am40010_tick(am40010_t* ga, int num_ticks, uint64_t cpu_pins);
+/* copy the RGBA8 colors for the index8_buffer color indices, returns number of colors */
+int am40010_palette(am40010_t* ga, uint32_t* rgba8, int max_colors);
+/* copy and clear the dirty-row bitmap (bit y&31 of word y>>5 for display line y), returns number of lines */
+int am40010_dirty_rows(am40010_t* ga, uint32_t* bits, int max_rows);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -255,6 +274,7 @@ uint64_t am40010_tick(am40010_t* ga, int num_ticks, uint64_t cpu_pins);
 /*--- IMPLEMENTATION ---------------------------------------------------------*/
 #ifdef CHIPS_IMPL
 #include <string.h>
+#include "mem.h" /* dirty-row helpers */
 #ifndef CHIPS_ASSERT
     #include <assert.h>
     #define CHIPS_ASSERT(c) assert(c)
@@ -266,7 +286,7 @@ uint64_t am40010_tick(am40010_t* ga, int num_ticks, uint64_t cpu_pins);
 #define _AM40010_GET_DATA(p) ((uint8_t)((p&0xFF0000ULL)>>16))
 
 /* the first 32 bytes of the KC Compact color ROM */
-static uint8_t _am40010_kcc_color_rom[32] = {
+static const uint8_t _am40010_kcc_color_rom[32] = {
     0x15, 0x15, 0x31, 0x3d, 0x01, 0x0d, 0x11, 0x1d,
     0x0d, 0x3d, 0x3c, 0x3f, 0x0c, 0x0f, 0x1c, 0x1f,
     0x01, 0x31, 0x30, 0x33, 0x00, 0x03, 0x10, 0x13,
@@ -279,7 +299,7 @@ static uint8_t _am40010_kcc_color_rom[32] = {
   http://www.cpcwiki.eu/index.php/CPC_Palette
   http://www.grimware.org/doku.php/documentations/devices/gatearray
 */
-static uint32_t _am40010_cpc_colors[32] = {
+static const uint32_t _am40010_cpc_colors[32] = {
     0xff6B7D6E,         // #40 white
     0xff6D7D6E,         // #41 white
     0xff6BF300,         // #42 sea green
@@ -329,8 +349,49 @@ static void _am40010_init_crt(am40010_t* ga, const am40010_desc_t* desc) {
     memset(&ga->crt, 0, sizeof(ga->crt));
 }
 
+/* initialize the per-mode byte-to-ink lookup tables */
+static void _am40010_init_pen_lut(am40010_t* ga) {
+    for (int c = 0; c < 256; c++) {
+        /*
+            mode 0: 160x200 @ 16 colors (2 pixels per byte)
+            pixel    bit mask
+            0:       |1|5|3|7|
+            1:       |0|4|2|6|
+
+            undocumented mode 3 (not on KC Compact) has the same layout,
+            but only uses the lower 2 bits of the ink index
+        */
+        const uint8_t p0 = ((c>>7)&0x1)|((c>>2)&0x2)|((c>>3)&0x4)|((c<<2)&0x8);
+        const uint8_t p1 = ((c>>6)&0x1)|((c>>1)&0x2)|((c>>2)&0x4)|((c<<3)&0x8);
+        for (int i = 0; i < 4; i++) {
+            ga->colors.pen_lut[0][c][i] = p0;
+            ga->colors.pen_lut[0][c][4+i] = p1;
+            ga->colors.pen_lut[3][c][i] = p0 & 3;
+            ga->colors.pen_lut[3][c][4+i] = p1 & 3;
+        }
+        /*
+            mode 1: 320x200 @ 4 colors (4 pixels per byte)
+            pixel    bit mask
+            0:       |3|7|
+            1:       |2|6|
+            2:       |1|5|
+            3:       |0|4|
+        */
+        for (int i = 0; i < 4; i++) {
+            const uint8_t p = (((c>>(3-i))&1)<<1) | ((c>>(7-i))&1);
+            ga->colors.pen_lut[1][c][i*2] = p;
+            ga->colors.pen_lut[1][c][i*2+1] = p;
+        }
+        /* mode 2: 640x200 @ 2 colors (8 pixels per byte) */
+        for (int i = 0; i < 8; i++) {
+            ga->colors.pen_lut[2][c][i] = (c>>(7-i)) & 1;
+        }
+    }
+}
+
 /* initialize the RGBA8 color caches, assumes already zero-initialized */
 static void _am40010_init_colors(am40010_t* ga) {
+    _am40010_init_pen_lut(ga);
     if (ga->cpc_type != AM40010_CPC_TYPE_KCCOMPACT) {
         /* Amstrad CPC colors */
         for (int i = 0; i < 32; i++) {
@@ -355,20 +416,38 @@ static void _am40010_init_colors(am40010_t* ga) {
             ga->colors.hw_rgba8[i] = c;
         }
     }
+    if (ga->indexed) {
+        /* color index 0 isn't black, start with black until the colors are set */
+        ga->colors.black = 32;
+        ga->colors.border_rgba8 = ga->colors.black;
+        for (int i = 0; i < 16; i++) {
+            ga->colors.ink_rgba8[i] = ga->colors.black;
+        }
+    }
+    else {
+        ga->colors.black = 0xFF000000;
+    }
 }
 
 /* initialize am40010_t instance */
 void am40010_init(am40010_t* ga, const am40010_desc_t* desc) {
     CHIPS_ASSERT(ga && desc);
     CHIPS_ASSERT(desc->bankswitch_cb && desc->cclk_cb);
-    CHIPS_ASSERT(desc->rgba8_buffer && (desc->rgba8_buffer_size >= _AM40010_MAX_FB_SIZE));
+    if (desc->index8_buffer) {
+        CHIPS_ASSERT(desc->index8_buffer_size >= (_AM40010_MAX_FB_SIZE/4));
+    }
+    else {
+        CHIPS_ASSERT(desc->rgba8_buffer && (desc->rgba8_buffer_size >= _AM40010_MAX_FB_SIZE));
+    }
     CHIPS_ASSERT(desc->ram && (desc->ram_size >= (64*1024)));
     memset(ga, 0, sizeof(am40010_t));
     ga->cpc_type = desc->cpc_type;
     ga->bankswitch_cb = desc->bankswitch_cb;
     ga->cclk_cb = desc->cclk_cb;
     ga->ram = desc->ram;
-    ga->rgba8_buffer = desc->rgba8_buffer;
+    ga->rgba8_buffer = desc->index8_buffer ? 0 : desc->rgba8_buffer;
+    ga->index8_buffer = desc->index8_buffer;
+    ga->indexed = 0 != desc->index8_buffer;
     ga->user_data = desc->user_data;
     _am40010_init_regs(ga);
     _am40010_init_video(ga);
@@ -654,66 +733,65 @@ static void _am40010_decode_pixels(am40010_t* ga, uint32_t* dst, uint64_t crtc_p
                           ((crtc_pins & 0x3FF) << 1) |      /* MA9..MA0 */
                           (((crtc_pins>>48) & 7) << 11);    /* RA0..RA2 */
     const uint8_t* src = &(ga->ram[addr]);
-    uint8_t c;
-    uint32_t p;
+    /* the pen table of the current video mode maps each byte to the ink of its 8 pixels */
+    const uint8_t (*pens)[8] = ga->colors.pen_lut[ga->video.mode];
     const uint32_t* ink = ga->colors.ink_rgba8;
-    switch (ga->video.mode) {
-        case 0:
-            /*
-                160x200 @ 16 colors (2 pixels per byte)
-                pixel    bit mask
-                0:       |1|5|3|7|
-                1:       |0|4|2|6|
-            */
-            for (int i = 0; i < 2; i++) {
-                c = *src++;
-                p = ink[((c>>7)&0x1)|((c>>2)&0x2)|((c>>3)&0x4)|((c<<2)&0x8)];
-                *dst++ = p; *dst++ = p; *dst++ = p; *dst++ = p;
-                p = ink[((c>>6)&0x1)|((c>>1)&0x2)|((c>>2)&0x4)|((c<<3)&0x8)];
-                *dst++ = p; *dst++ = p; *dst++ = p; *dst++ = p;
-            }
-            break;
-        case 1:
-            /*
-                320x200 @ 4 colors (4 pixels per byte)
-                pixel    bit mask
-                0:       |3|7|
-                1:       |2|6|
-                2:       |1|5|
-                3:       |0|4|
-            */
-            for (int i = 0; i < 2; i++) {
-                c = *src++;
-                p = ink[((c>>2)&2)|((c>>7)&1)];
-                *dst++ = p; *dst++ = p;
-                p = ink[((c>>1)&2)|((c>>6)&1)];
-                *dst++ = p; *dst++ = p;
-                p = ink[((c>>0)&2)|((c>>5)&1)];
-                *dst++ = p; *dst++ = p;
-                p = ink[((c<<1)&2)|((c>>4)&1)];
-                *dst++ = p; *dst++ = p;
-            }
-            break;
-        case 2:
-            /* 640x200 @ 2 colors (8 pixels per byte) */
-            for (int i = 0; i < 2; i++) {
-                c = *src++;
-                for (int j = 7; j >= 0; j--) {
-                    *dst++ = ink[(c>>j)&1];
-                }
-            }
-            break;
-        /* FIXME: undocumented mode 3 (not on KC Compact) */
+    for (int i = 0; i < 2; i++) {
+        const uint8_t* p = pens[src[i]];
+        for (int j = 0; j < 8; j++) {
+            *dst++ = ink[p[j]];
+        }
+    }
+}
+
+/* write 16 decoded pixels to the framebuffer, and flag the line as dirty if any changed */
+static inline void _am40010_store_pixels(am40010_t* ga, const uint32_t* src, int x, int y, int width) {
+    uint32_t diff = 0;
+    if (ga->indexed) {
+        uint8_t* dst = &ga->index8_buffer[x + y * width];
+        for (int i = 0; i < 16; i++) {
+            diff |= dst[i] ^ (uint8_t)src[i];
+            dst[i] = (uint8_t) src[i];
+        }
+    }
+    else {
+        uint32_t* dst = &ga->rgba8_buffer[x + y * width];
+        for (int i = 0; i < 16; i++) {
+            diff |= dst[i] ^ src[i];
+            dst[i] = src[i];
+        }
+    }
+    if (diff) {
+        mem_dirty_row(ga->dirty_rows, y);
     }
 }
 
 /* video signal generator, call this at 1 MHz frequency */
 static void _am40010_decode_video(am40010_t* ga, uint64_t crtc_pins) {
+    /* video decoding may be switched off temporarily by clearing rgba8_buffer and index8_buffer */
+    if ((0 == ga->rgba8_buffer) && (0 == ga->index8_buffer)) {
+        return;
+    }
+    /* decode into a temporary buffer, which is then compared with the framebuffer */
+    uint32_t tmp[16];
     if (ga->dbg_vis) {
         int dst_x = ga->crt.h_pos * 16;
         int dst_y = ga->crt.v_pos;
         if ((dst_x <= (AM40010_DBG_DISPLAY_WIDTH-16)) && (dst_y < AM40010_DBG_DISPLAY_HEIGHT)) {
-            uint32_t* dst = &(ga->rgba8_buffer[dst_x + dst_y * AM40010_DBG_DISPLAY_WIDTH]);
+            if (ga->indexed) {
+                /* no debug colors in indexed mode, just the pixels */
+                if (crtc_pins & AM40010_DE) {
+                    _am40010_decode_pixels(ga, tmp, crtc_pins);
+                }
+                else {
+                    for (int i = 0; i < 16; i++) {
+                        tmp[i] = ga->colors.black;
+                    }
+                }
+                _am40010_store_pixels(ga, tmp, dst_x, dst_y, AM40010_DBG_DISPLAY_WIDTH);
+                return;
+            }
+            uint32_t* dst = tmp;
             uint8_t r = 0x22, g = 0x22, b = 0x22;
             if (crtc_pins & AM40010_HS) {
                 r = 0x55;
@@ -739,27 +817,24 @@ static void _am40010_decode_video(am40010_t* ga, uint64_t crtc_pins) {
                     *dst++ = (i == 0) ? 0xFF000000 : c;
                 }
             }
+            _am40010_store_pixels(ga, tmp, dst_x, dst_y, AM40010_DBG_DISPLAY_WIDTH);
         }
     }
     else if (ga->crt.visible) {
         int dst_x = ga->crt.pos_x * 16;
         int dst_y = ga->crt.pos_y;
         bool black = ga->video.sync;
-        uint32_t* dst = &ga->rgba8_buffer[dst_x + dst_y * AM40010_DISPLAY_WIDTH];
+        uint32_t* dst = tmp;
         if (crtc_pins & AM40010_DE) {
             _am40010_decode_pixels(ga, dst, crtc_pins);
         }
-        else if (black) {
-            for (int i = 0; i < 16; i++) {
-                *dst++ = 0xFF000000;
-            }
-        }
         else {
-            uint32_t brd = ga->colors.border_rgba8;
+            uint32_t c = black ? ga->colors.black : ga->colors.border_rgba8;
             for (int i = 0; i < 16; i++) {
-                *dst++ = brd;
+                dst[i] = c;
             }
         }
+        _am40010_store_pixels(ga, tmp, dst_x, dst_y, AM40010_DISPLAY_WIDTH);
     }
 }
 
@@ -767,9 +842,17 @@ static void _am40010_decode_video(am40010_t* ga, uint64_t crtc_pins) {
 static inline void _am40010_update_colors(am40010_t* ga) {
     if (ga->colors.dirty) {
         ga->colors.dirty = false;
-        ga->colors.border_rgba8 = ga->colors.hw_rgba8[ga->regs.border];
-        for (int i = 0; i < 16; i++) {
-            ga->colors.ink_rgba8[i] = ga->colors.hw_rgba8[ga->regs.ink[i]];
+        if (ga->indexed) {
+            ga->colors.border_rgba8 = ga->regs.border;
+            for (int i = 0; i < 16; i++) {
+                ga->colors.ink_rgba8[i] = ga->regs.ink[i];
+            }
+        }
+        else {
+            ga->colors.border_rgba8 = ga->colors.hw_rgba8[ga->regs.border];
+            for (int i = 0; i < 16; i++) {
+                ga->colors.ink_rgba8[i] = ga->colors.hw_rgba8[ga->regs.ink[i]];
+            }
         }
     }
 }
@@ -863,4 +946,19 @@ uint64_t am40010_tick(am40010_t* ga, int num_ticks, uint64_t pins) {
     ga->pins = pins | ((AM40010_DE|AM40010_HS|AM40010_VS) & ga->crtc_pins);
     return pins;
 }
+
+int am40010_palette(am40010_t* ga, uint32_t* rgba8, int max_colors) {
+    CHIPS_ASSERT(ga && rgba8);
+    int num = (max_colors < AM40010_NUM_COLORS) ? max_colors : AM40010_NUM_COLORS;
+    for (int i = 0; i < num; i++) {
+        rgba8[i] = (i < 32) ? ga->colors.hw_rgba8[i] : 0xFF000000;
+    }
+    return num;
+}
+
+int am40010_dirty_rows(am40010_t* ga, uint32_t* bits, int max_rows) {
+    CHIPS_ASSERT(ga && bits);
+    int h = ga->dbg_vis ? AM40010_DBG_DISPLAY_HEIGHT : AM40010_DISPLAY_HEIGHT;
+    return mem_take_dirty_rows(ga->dirty_rows, h, bits, max_rows);
+}
 #endif /* CHIPS_IMPL */
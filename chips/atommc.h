@@ -21,10 +21,46 @@
     ## Emulated Pins
     ## TODO
 
+    ## File System Backends
+
+    By default the SD card is a directory on the host file system (given
+    by atommc_desc_t.root_dir). Alternatively the card can be an in-memory
+    file system built from a packed archive (atommc_desc_t.archive), or
+    any other storage provided through an atommc_fs_t backend (a table of
+    file system callbacks, see below).
+
+    The in-memory file system doesn't copy the archive, so any number of
+    atommc instances can share the same (read-only) archive data. Files are
+    copied into instance-private memory when they are first written to
+    (copy-on-write), and new, deleted or modified files are only visible
+    to the atommc instance which made the change.
+
+    The packed archive format is:
+
+    ~~~
+    "AMFS"          4 bytes magic
+    for each entry:
+        uint8_t     type (0: file, 1: directory)
+        uint8_t     path length
+        char[]      path relative to the card root, '/' separated
+        uint32_t    data length (little endian, 0 for directories)
+        uint8_t[]   file data
+    ~~~
+
+    Parent directories of a path don't need their own entries.
+
     ## NOT EMULATED
 
-    - This is a functional emulation only, i.e. commands execute instantaneously
-    - The SDDOS disk images commands are currently not implemented
+    - Commands execute instantaneously, unless a latency profile is given
+      (atommc_desc_t.latency, see atommc_default_latency()), then the
+      slow commands (those the firmware polls for completion) read as
+      STATUS_BUSY for the given number of ticks, or with async_io enabled,
+      until the host I/O worker thread has completed them (whichever is
+      longer). The latencies are estimates, not a model of the PIC firmware
+      or the SD card.
+    - SDDOS disk images are memory-mapped read-only, sector writes are
+      collected in a small LRU sector cache and written back to the image
+      file when evicted, on SER_IMG_INFO, IMG_UNMOUNT, reset and discard
 
     ## zlib/libpng license
 
@@ -55,6 +91,8 @@
 #include <stdbool.h>
 
 #include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -169,37 +207,143 @@ extern "C" {
 
 typedef void (*atommc_out_t)(int port_id, uint8_t data, void* user_data);
 
+// AtoMMC supports three types of file open
+enum {
+   ATOMMC_MODE_READ,       /* existing file, read only */
+   ATOMMC_MODE_WRITE,      /* new or truncated file, write only */
+   ATOMMC_MODE_RAF         /* existing or new file, read/write */
+};
+
+/* File or directory information returned by a file system backend */
+typedef struct {
+    bool dir;
+    uint32_t size;
+    int64_t mtime;          /* directories: changes when entries are added or removed */
+} atommc_stat_t;
+
+/* Called by a file system backend for each directory entry */
+typedef void (*atommc_list_cb_t)(const char* name, const atommc_stat_t* st, void* cb_data);
+
+/* AtoMMC file system backend
+
+   Paths are relative to the SD card root, use '/' as separator and never
+   contain '.' or '..' components, the root directory is "". File handles
+   are opaque pointers (NULL means failure). map/unmap are optional, if
+   provided map returns a pointer to the file contents which must stay
+   valid (and reflect writes to the file) until unmap is called.
+*/
+typedef struct {
+    bool (*stat)(void* ctx, const char* path, atommc_stat_t* st);
+    bool (*list)(void* ctx, const char* path, atommc_list_cb_t cb, void* cb_data);
+    bool (*mkdir)(void* ctx, const char* path);
+    bool (*rmdir)(void* ctx, const char* path);
+    bool (*remove)(void* ctx, const char* path);
+    void* (*open)(void* ctx, const char* path, int mode);
+    bool (*close)(void* ctx, void* file);
+    uint32_t (*read)(void* ctx, void* file, void* buf, uint32_t len);
+    uint32_t (*write)(void* ctx, void* file, const void* buf, uint32_t len);
+    bool (*seek)(void* ctx, void* file, uint32_t pos);
+    uint32_t (*tell)(void* ctx, void* file);
+    uint32_t (*size)(void* ctx, void* file);
+    const uint8_t* (*map)(void* ctx, void* file, uint32_t size);
+    void (*unmap)(void* ctx, void* file, const uint8_t* ptr, uint32_t size);
+} atommc_fs_t;
+
+/* AtoMMC command latencies in ticks, all zero means commands complete instantly */
+typedef struct {
+    uint32_t command;       /* any slow command (firmware command dispatch) */
+    uint32_t dir_open;      /* DIR_OPEN, DIR_CWD (directory lookup) */
+    uint32_t dir_read;      /* DIR_READ (per directory entry) */
+    uint32_t file;          /* open, close, delete, getinfo, seek, mkdir, rmdir, image mount */
+    uint32_t sector;        /* READ_BYTES, WRITE_BYTES and SDDOS sector commands (SD card access) */
+    uint32_t byte;          /* per byte transferred by READ_BYTES and WRITE_BYTES */
+} atommc_latency_t;
+
 /* AtoMMC initialization parameters */
 typedef struct {
     atommc_in_t in_cb;
     atommc_out_t out_cb;
     void* user_data;
     bool autoboot;
+    const char* root_dir;   /* host directory of the SD card root (default: "mmc") */
+    bool async_io;          /* execute file system commands on a host I/O worker thread */
+    const void* archive;    /* optional packed archive for an in-memory SD card (not copied) */
+    int archive_size;
+    const atommc_fs_t* fs;  /* optional custom file system backend (overrides root_dir/archive) */
+    void* fs_ctx;           /* context pointer passed to the backend callbacks */
+    atommc_latency_t latency; /* optional command latencies (default: all zero) */
 } atommc_desc_t;
 
 /* Limits on file/directory lengths */
-#define MAX_FILENAME                         (20)
 #define MAX_FILEPATH                        (200)
-#define MAX_DIRSIZE                         (100)
 #define MAX_FD                                (4)
 #define MAX_GLOBAL                        (0x100)
 #define WILD_LEN                             (16)
+#define MAX_IMG                               (4)
+#define IMG_SECTOR_SIZE                     (256)
+#define IMG_CACHE_SIZE                        (8)
 
 
 /* AtoMMC File Attributes */
 #define ATOMMC_ATTR_HIDDEN                 (0x02)
 #define ATOMMC_ATTR_DIR                    (0x10)
 
-// AtoMMC supports three types of file open
-enum {
-   ATOMMC_MODE_READ,
-   ATOMMC_MODE_WRITE,
-   ATOMMC_MODE_RAF
-};
+/* SDDOS image attributes (returned by GET_IMG_STATUS) */
+#define ATOMMC_IMG_READ_ONLY               (0x01)
+#define ATOMMC_IMG_NOT_MOUNTED             (0xFF)
+
+/* SDDOS mounted disk image */
+typedef struct {
+   void* file;              /* backend file handle, NULL if not mounted */
+   const uint8_t* map;      /* read-only mapping of the image file (optional) */
+   uint32_t num_sectors;
+   uint8_t attr;
+   char name[MAX_FILEPATH]; /* image name as given to OPEN_IMG */
+   char path[MAX_FILEPATH]; /* path of the image file on the card */
+} atommc_img_t;
+
+/* SDDOS sector cache entry */
+typedef struct {
+   int drive;               /* -1 if the entry is unused */
+   uint32_t sector;
+   uint32_t last_use;
+   bool dirty;
+   uint8_t data[IMG_SECTOR_SIZE];
+} atommc_sector_t;
+
+/* In-memory file system node */
+typedef struct {
+   char* path;              /* NULL if the node is unused */
+   bool dir;
+   const uint8_t* data;     /* file contents, in the shared archive or in own */
+   uint8_t* own;            /* instance-private copy after the first write */
+   uint32_t size;
+   uint32_t cap;
+   int open_count;
+   int map_count;           /* own must not be reallocated while mapped */
+} atommc_memfs_node_t;
+
+/* In-memory file system open file */
+typedef struct {
+   bool used;
+   bool writable;
+   int node;
+   uint32_t pos;
+} atommc_memfs_file_t;
 
-/* AtoMMC Directory Entry */
+/* In-memory file system state */
 typedef struct {
-   char name[MAX_FILENAME];
+   atommc_memfs_node_t* nodes;
+   int num_nodes;
+   int max_nodes;
+   int64_t mtime;           /* bumped whenever a node is added or removed */
+   atommc_memfs_file_t files[MAX_FD + MAX_IMG];
+} atommc_memfs_t;
+
+/* AtoMMC Directory Entry, names are stored in the directory cache arena */
+typedef struct {
+   uint32_t name;           /* arena offset of the display name ("<name>" for directories) */
+   uint32_t raw;            /* arena offset of the plain name (for wildcard matching) */
    uint8_t attr;
    uint32_t len;
 } atommc_dirent_t;
@@ -222,17 +366,50 @@ typedef struct {
    /* Global Data */
    uint8_t global_data[MAX_GLOBAL];
    uint8_t global_index;
-   /* Pool of file descriptors */
-   FILE *fd[MAX_FD];
-   /* Relative pah of current working directory */
+   /* Pool of file handles */
+   void *fd[MAX_FD];
+   /* File system backend */
+   const atommc_fs_t* fs;
+   void* fs_ctx;
+   atommc_memfs_t memfs;
+   /* Host directory of the SD card root */
+   char root[MAX_FILEPATH];
+   /* Path of current working directory, relative to the root */
    char cwd[MAX_FILEPATH];
-   /* Currently loaded directory */
+   /* Scratch buffers for constructing card and host file paths */
+   char filename[MAX_FILEPATH];
+   char host_path[MAX_FILEPATH];
+   /* Directory cache, reused while the directory modification time is unchanged */
+   bool dir_valid;
+   char dir_path[MAX_FILEPATH];
+   int64_t dir_mtime;
    int dir_size;
+   int dir_cap;
    int dir_index;
-   atommc_dirent_t *dirsorted[MAX_DIRSIZE];
-   atommc_dirent_t dirlist[MAX_DIRSIZE];
+   atommc_dirent_t *dir_entries;
+   char *dir_arena;         /* entry names */
+   uint32_t dir_arena_size;
+   uint32_t dir_arena_cap;
    /* Current wildcard */
    char wildPattern[WILD_LEN + 1];
+   /* SDDOS disk images, parameters and sector cache */
+   atommc_img_t img[MAX_IMG];
+   uint8_t img_drive;
+   uint32_t img_sector;
+   uint32_t img_clock;
+   atommc_sector_t img_cache[IMG_CACHE_SIZE];
+   /* Command latency, the response reads as BUSY until countdown is zero */
+   atommc_latency_t latency;
+   uint32_t countdown;
+   /* Host I/O worker thread (only if async_io is enabled) */
+   bool async_io;
+   bool busy;              /* worker thread is executing pending_cmd */
+   bool quit;
+   uint8_t pending_cmd;
+   int pending_filenum;
+   pthread_t worker;
+   pthread_mutex_t mutex;  /* protects busy, quit and pending_cmd/filenum */
+   pthread_cond_t cond;
    /* Standard emulator callbacks, etc */
    atommc_in_t in_cb;
    atommc_out_t out_cb;
@@ -249,6 +426,9 @@ typedef struct {
 /* initialize a new atommc instance */
 void atommc_init(atommc_t* atommc, const atommc_desc_t* desc);
 
+/* discard an atommc instance (stops the worker thread and closes files) */
+void atommc_discard(atommc_t* atommc);
+
 /* reset an existing atommc instance */
 void atommc_reset(atommc_t* atommc);
 
@@ -258,6 +438,13 @@ uint64_t atommc_iorq(atommc_t* atommc, uint64_t pins);
 /* tick the atommc */
 void atommc_tick(atommc_t* atommc);
 
+/* get an estimated latency profile of real hardware, in 1 MHz ticks */
+atommc_latency_t atommc_default_latency(void);
+
+/* bulk read from the data register, same result as num_bytes register reads,
+   returns 0 if the atommc isn't in data read mode (after INIT_READ) */
+int atommc_read_data(atommc_t* atommc, uint8_t* dst, int num_bytes);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -270,64 +457,651 @@ void atommc_tick(atommc_t* atommc);
 #define CHIPS_ASSERT(c) assert(c)
 #endif
 
+static void* _atommc_worker(void* arg);
+static void _atommc_img_flush(atommc_t* atommc);
+static void _atommc_img_unmount(atommc_t* atommc, int drive);
+
+// Normalize a '/' separated path, removing empty, '.' and '..' components
+// (this also stops paths from escaping the SD card root), returns false
+// if the result doesn't fit in MAX_FILEPATH
+static bool _atommc_normalize(char* out, const char* in) {
+   int len = 0;
+   while (*in) {
+      const char* end = in;
+      while (*end && *end != '/') {
+         end++;
+      }
+      int n = (int)(end - in);
+      if (n == 2 && in[0] == '.' && in[1] == '.') {
+         // Drop the last component
+         while (len > 0 && out[len - 1] != '/') {
+            len--;
+         }
+         if (len > 0) {
+            len--;
+         }
+      } else if (n > 0 && !(n == 1 && in[0] == '.')) {
+         if ((len + n + 2) > MAX_FILEPATH) {
+            return false;
+         }
+         if (len > 0) {
+            out[len++] = '/';
+         }
+         memcpy(out + len, in, n);
+         len += n;
+      }
+      in = *end ? end + 1 : end;
+   }
+   out[len] = 0;
+   return true;
+}
+
+// Construct a complete file path from the string in the global data area,
+// returns NULL if the path is too long
+static char *getFilename(atommc_t* atommc) {
+   char *buffer = atommc->filename;
+   const char *name = (const char *)atommc->global_data;
+   char path[2 * MAX_FILEPATH];
+   int n;
+   if (*name == '/') {
+      // Path is absolute
+      n = snprintf(path, sizeof(path), "%s", name);
+   } else {
+      // Path is relative to cwd
+      n = snprintf(path, sizeof(path), "%s/%s", atommc->cwd, name);
+   }
+   if (n < 0 || n >= (int) sizeof(path) || !_atommc_normalize(buffer, path)) {
+      return NULL;
+   }
+#ifdef ATOMMC_DEBUG
+   printf("%s\n", buffer);
+#endif
+   return buffer;
+}
+
+// Host file system backend, paths are relative to atommc->root
+
+// returns NULL if root plus path doesn't fit in MAX_FILEPATH
+static const char* _atommc_host_path(void* ctx, const char* path) {
+   atommc_t* atommc = (atommc_t*) ctx;
+   int n = snprintf(atommc->host_path, MAX_FILEPATH, "%s/%s", atommc->root, path);
+   if (n < 0 || n >= MAX_FILEPATH) {
+      return NULL;
+   }
+   return atommc->host_path;
+}
+
+static bool _atommc_host_stat(void* ctx, const char* path, atommc_stat_t* st) {
+   const char* host_path = _atommc_host_path(ctx, path);
+   struct stat statbuf;
+   if (!host_path || stat(host_path, &statbuf)) {
+      return false;
+   }
+   st->dir = S_ISDIR(statbuf.st_mode);
+   st->size = (uint32_t) statbuf.st_size;
+   st->mtime = (int64_t) statbuf.st_mtime;
+   return true;
+}
+
+static bool _atommc_host_list(void* ctx, const char* path, atommc_list_cb_t cb, void* cb_data) {
+   const char* host_path = _atommc_host_path(ctx, path);
+   DIR *dir = host_path ? opendir(host_path) : NULL;
+   if (!dir) {
+      return false;
+   }
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != NULL) {
+      // Stat relative to the open directory, this avoids building paths
+      struct stat statbuf;
+      if (fstatat(dirfd(dir), entry->d_name, &statbuf, 0) == 0) {
+         atommc_stat_t st;
+         st.dir = S_ISDIR(statbuf.st_mode);
+         st.size = st.dir ? 0 : (uint32_t) statbuf.st_size;
+         st.mtime = (int64_t) statbuf.st_mtime;
+         cb(entry->d_name, &st, cb_data);
+      }
+   }
+   closedir(dir);
+   return true;
+}
+
+static bool _atommc_host_mkdir(void* ctx, const char* path) {
+   const char* host_path = _atommc_host_path(ctx, path);
+   return host_path && mkdir(host_path, 0x755) == 0;
+}
+
+static bool _atommc_host_rmdir(void* ctx, const char* path) {
+   const char* host_path = _atommc_host_path(ctx, path);
+   return host_path && rmdir(host_path) == 0;
+}
+
+static bool _atommc_host_remove(void* ctx, const char* path) {
+   const char* host_path = _atommc_host_path(ctx, path);
+   return host_path && remove(host_path) == 0;
+}
+
+static void* _atommc_host_open(void* ctx, const char* path, int mode) {
+   const char* host_path = _atommc_host_path(ctx, path);
+   if (!host_path) {
+      return NULL;
+   }
+   switch (mode) {
+   case ATOMMC_MODE_READ:
+      return fopen(host_path, "r");
+   case ATOMMC_MODE_WRITE:
+      return fopen(host_path, "w");
+   default:
+      {
+         FILE* fp = fopen(host_path, "r+");
+         return fp ? fp : fopen(host_path, "w+");
+      }
+   }
+}
+
+static bool _atommc_host_close(void* ctx, void* file) {
+   return fclose((FILE*) file) == 0;
+}
+
+static uint32_t _atommc_host_read(void* ctx, void* file, void* buf, uint32_t len) {
+   return (uint32_t) fread(buf, 1, len, (FILE*) file);
+}
+
+static uint32_t _atommc_host_write(void* ctx, void* file, const void* buf, uint32_t len) {
+   return (uint32_t) fwrite(buf, 1, len, (FILE*) file);
+}
+
+static bool _atommc_host_seek(void* ctx, void* file, uint32_t pos) {
+   return fseek((FILE*) file, pos, SEEK_SET) == 0;
+}
+
+static uint32_t _atommc_host_tell(void* ctx, void* file) {
+   return (uint32_t) ftell((FILE*) file);
+}
+
+static uint32_t _atommc_host_size(void* ctx, void* file) {
+   struct stat statbuf;
+   if (fstat(fileno((FILE*) file), &statbuf)) {
+      return 0;
+   }
+   return (uint32_t) statbuf.st_size;
+}
+
+static const uint8_t* _atommc_host_map(void* ctx, void* file, uint32_t size) {
+   // Writes must reach the file immediately to be visible in the mapping
+   setvbuf((FILE*) file, NULL, _IONBF, 0);
+   void* ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno((FILE*) file), 0);
+   return (ptr == MAP_FAILED) ? NULL : (const uint8_t*) ptr;
+}
+
+static void _atommc_host_unmap(void* ctx, void* file, const uint8_t* ptr, uint32_t size) {
+   munmap((void*) ptr, size);
+}
+
+static const atommc_fs_t _atommc_host_fs = {
+   _atommc_host_stat,
+   _atommc_host_list,
+   _atommc_host_mkdir,
+   _atommc_host_rmdir,
+   _atommc_host_remove,
+   _atommc_host_open,
+   _atommc_host_close,
+   _atommc_host_read,
+   _atommc_host_write,
+   _atommc_host_seek,
+   _atommc_host_tell,
+   _atommc_host_size,
+   _atommc_host_map,
+   _atommc_host_unmap
+};
+
+// In-memory file system backend
+//
+// Nodes are built from the packed archive at init, file data stays in
+// the archive until a file is written, then it is copied into a buffer
+// owned by this instance.
+
+static int _atommc_memfs_find(atommc_memfs_t* memfs, const char* path) {
+   for (int i = 0; i < memfs->num_nodes; i++) {
+      if (memfs->nodes[i].path && !strcmp(memfs->nodes[i].path, path)) {
+         return i;
+      }
+   }
+   return -1;
+}
+
+// Test whether the parent directory of a path exists
+static bool _atommc_memfs_parent(atommc_memfs_t* memfs, const char* path) {
+   const char* slash = strrchr(path, '/');
+   if (!slash) {
+      return true;
+   }
+   char parent[MAX_FILEPATH];
+   snprintf(parent, sizeof(parent), "%.*s", (int)(slash - path), path);
+   int i = _atommc_memfs_find(memfs, parent);
+   return (i >= 0) && memfs->nodes[i].dir;
+}
+
+static int _atommc_memfs_add(atommc_memfs_t* memfs, const char* path, bool dir) {
+   int i;
+   for (i = 0; i < memfs->num_nodes; i++) {
+      if (!memfs->nodes[i].path) {
+         break;
+      }
+   }
+   if (i == memfs->num_nodes) {
+      if (memfs->num_nodes == memfs->max_nodes) {
+         memfs->max_nodes = memfs->max_nodes ? (2 * memfs->max_nodes) : 64;
+         memfs->nodes = (atommc_memfs_node_t*) realloc(memfs->nodes, memfs->max_nodes * sizeof(atommc_memfs_node_t));
+      }
+      memfs->num_nodes++;
+   }
+   atommc_memfs_node_t* node = &memfs->nodes[i];
+   memset(node, 0, sizeof(*node));
+   memfs->mtime++;
+   node->path = (char*) malloc(strlen(path) + 1);
+   strcpy(node->path, path);
+   node->dir = dir;
+   return i;
+}
+
+static void _atommc_memfs_free(atommc_memfs_node_t* node) {
+   free(node->path);
+   free(node->own);
+   memset(node, 0, sizeof(*node));
+}
+
+// Add a node and any missing parent directories
+static int _atommc_memfs_add_path(atommc_memfs_t* memfs, const char* path, bool dir) {
+   char buf[MAX_FILEPATH];
+   snprintf(buf, sizeof(buf), "%s", path);
+   for (char* p = strchr(buf, '/'); p; p = strchr(p + 1, '/')) {
+      *p = 0;
+      if (_atommc_memfs_find(memfs, buf) < 0) {
+         _atommc_memfs_add(memfs, buf, true);
+      }
+      *p = '/';
+   }
+   int i = _atommc_memfs_find(memfs, buf);
+   return (i >= 0) ? i : _atommc_memfs_add(memfs, buf, dir);
+}
+
+static void _atommc_memfs_init(atommc_memfs_t* memfs, const uint8_t* archive, int archive_size) {
+   CHIPS_ASSERT(archive && (archive_size >= 4) && !memcmp(archive, "AMFS", 4));
+   int pos = 4;
+   while ((pos + 6) <= archive_size) {
+      bool dir = archive[pos] == 1;
+      int name_len = archive[pos + 1];
+      if ((pos + 6 + name_len) > archive_size) {
+         break;
+      }
+      char raw[256], path[MAX_FILEPATH];
+      memcpy(raw, &archive[pos + 2], name_len);
+      raw[name_len] = 0;
+      _atommc_normalize(path, raw);
+      pos += 2 + name_len;
+      uint32_t size = archive[pos] | (archive[pos + 1] << 8) | (archive[pos + 2] << 16) | ((uint32_t)archive[pos + 3] << 24);
+      pos += 4;
+      if (size > (uint32_t)(archive_size - pos)) {
+         break;
+      }
+      if (path[0]) {
+         int i = _atommc_memfs_add_path(memfs, path, dir);
+         atommc_memfs_node_t* node = &memfs->nodes[i];
+         if (!node->dir) {
+            node->data = &archive[pos];
+            node->size = size;
+         }
+      }
+      pos += size;
+   }
+}
+
+static void _atommc_memfs_discard(atommc_memfs_t* memfs) {
+   for (int i = 0; i < memfs->num_nodes; i++) {
+      _atommc_memfs_free(&memfs->nodes[i]);
+   }
+   free(memfs->nodes);
+   memset(memfs, 0, sizeof(*memfs));
+}
+
+// Make sure a file has an instance-private buffer of at least cap bytes
+static void _atommc_memfs_own(atommc_memfs_node_t* node, uint32_t cap) {
+   if (!node->own || (cap > node->cap)) {
+      // archive-backed files have no capacity yet, but must keep their content
+      if (cap < node->size) {
+         cap = node->size;
+      }
+      uint32_t new_cap = node->cap ? node->cap : 256;
+      while (new_cap < cap) {
+         new_cap *= 2;
+      }
+      CHIPS_ASSERT((new_cap >= node->size) && (0 == node->map_count));
+      uint8_t* own = (uint8_t*) malloc(new_cap);
+      if (node->size) {
+         memcpy(own, node->data, node->size);
+      }
+      free(node->own);
+      node->own = own;
+      node->data = own;
+      node->cap = new_cap;
+   }
+}
+
+static bool _atommc_memfs_stat(void* ctx, const char* path, atommc_stat_t* st) {
+   atommc_memfs_t* memfs = (atommc_memfs_t*) ctx;
+   // All directories share one modification time
+   st->mtime = memfs->mtime;
+   if (!path[0]) {
+      st->dir = true;
+      st->size = 0;
+      return true;
+   }
+   int i = _atommc_memfs_find(memfs, path);
+   if (i < 0) {
+      return false;
+   }
+   st->dir = memfs->nodes[i].dir;
+   st->size = memfs->nodes[i].size;
+   return true;
+}
+
+static bool _atommc_memfs_list(void* ctx, const char* path, atommc_list_cb_t cb, void* cb_data) {
+   atommc_memfs_t* memfs = (atommc_memfs_t*) ctx;
+   atommc_stat_t st;
+   if (!_atommc_memfs_stat(ctx, path, &st) || !st.dir) {
+      return false;
+   }
+   size_t len = strlen(path);
+   for (int i = 0; i < memfs->num_nodes; i++) {
+      const char* name = memfs->nodes[i].path;
+      if (!name) {
+         continue;
+      }
+      // Direct children only
+      if (len) {
+         if (strncmp(name, path, len) || (name[len] != '/')) {
+            continue;
+         }
+         name += len + 1;
+      }
+      if (!strchr(name, '/')) {
+         st.dir = memfs->nodes[i].dir;
+         st.size = memfs->nodes[i].size;
+         cb(name, &st, cb_data);
+      }
+   }
+   return true;
+}
+
+static bool _atommc_memfs_mkdir(void* ctx, const char* path) {
+   atommc_memfs_t* memfs = (atommc_memfs_t*) ctx;
+   if (!path[0] || (_atommc_memfs_find(memfs, path) >= 0) || !_atommc_memfs_parent(memfs, path)) {
+      return false;
+   }
+   _atommc_memfs_add(memfs, path, true);
+   return true;
+}
+
+static bool _atommc_memfs_remove(void* ctx, const char* path) {
+   atommc_memfs_t* memfs = (atommc_memfs_t*) ctx;
+   int i = _atommc_memfs_find(memfs, path);
+   if ((i < 0) || memfs->nodes[i].open_count) {
+      return false;
+   }
+   if (memfs->nodes[i].dir) {
+      // Directories must be empty
+      size_t len = strlen(path);
+      for (int j = 0; j < memfs->num_nodes; j++) {
+         const char* name = memfs->nodes[j].path;
+         if (name && !strncmp(name, path, len) && (name[len] == '/')) {
+            return false;
+         }
+      }
+   }
+   _atommc_memfs_free(&memfs->nodes[i]);
+   memfs->mtime++;
+   return true;
+}
+
+static bool _atommc_memfs_rmdir(void* ctx, const char* path) {
+   atommc_memfs_t* memfs = (atommc_memfs_t*) ctx;
+   int i = _atommc_memfs_find(memfs, path);
+   if ((i < 0) || !memfs->nodes[i].dir) {
+      return false;
+   }
+   return _atommc_memfs_remove(ctx, path);
+}
+
+static void* _atommc_memfs_open(void* ctx, const char* path, int mode) {
+   atommc_memfs_t* memfs = (atommc_memfs_t*) ctx;
+   int i = _atommc_memfs_find(memfs, path);
+   if ((i >= 0) && memfs->nodes[i].dir) {
+      return NULL;
+   }
+   if (i < 0) {
+      if ((mode == ATOMMC_MODE_READ) || !_atommc_memfs_parent(memfs, path)) {
+         return NULL;
+      }
+      i = _atommc_memfs_add(memfs, path, false);
+   }
+   for (int f = 0; f < (MAX_FD + MAX_IMG); f++) {
+      atommc_memfs_file_t* file = &memfs->files[f];
+      if (!file->used) {
+         file->used = true;
+         file->writable = (mode != ATOMMC_MODE_READ);
+         file->node = i;
+         file->pos = 0;
+         memfs->nodes[i].open_count++;
+         if (mode == ATOMMC_MODE_WRITE) {
+            memfs->nodes[i].size = 0;
+         }
+         return file;
+      }
+   }
+   return NULL;
+}
+
+static bool _atommc_memfs_close(void* ctx, void* file) {
+   atommc_memfs_t* memfs = (atommc_memfs_t*) ctx;
+   atommc_memfs_file_t* f = (atommc_memfs_file_t*) file;
+   memfs->nodes[f->node].open_count--;
+   f->used = false;
+   return true;
+}
+
+static uint32_t _atommc_memfs_read(void* ctx, void* file, void* buf, uint32_t len) {
+   atommc_memfs_t* memfs = (atommc_memfs_t*) ctx;
+   atommc_memfs_file_t* f = (atommc_memfs_file_t*) file;
+   atommc_memfs_node_t* node = &memfs->nodes[f->node];
+   if (f->pos >= node->size) {
+      return 0;
+   }
+   if (len > (node->size - f->pos)) {
+      len = node->size - f->pos;
+   }
+   memcpy(buf, node->data + f->pos, len);
+   f->pos += len;
+   return len;
+}
+
+static uint32_t _atommc_memfs_write(void* ctx, void* file, const void* buf, uint32_t len) {
+   atommc_memfs_t* memfs = (atommc_memfs_t*) ctx;
+   atommc_memfs_file_t* f = (atommc_memfs_file_t*) file;
+   atommc_memfs_node_t* node = &memfs->nodes[f->node];
+   uint32_t end = f->pos + len;
+   // A mapped file can't grow beyond its buffer, the mapping must stay valid
+   if (!f->writable || (node->map_count && (end > node->cap))) {
+      return 0;
+   }
+   _atommc_memfs_own(node, end);
+   if (f->pos > node->size) {
+      memset(node->own + node->size, 0, f->pos - node->size);
+   }
+   memcpy(node->own + f->pos, buf, len);
+   if (end > node->size) {
+      node->size = end;
+   }
+   f->pos = end;
+   return len;
+}
+
+static bool _atommc_memfs_seek(void* ctx, void* file, uint32_t pos) {
+   ((atommc_memfs_file_t*) file)->pos = pos;
+   return true;
+}
+
+static uint32_t _atommc_memfs_tell(void* ctx, void* file) {
+   return ((atommc_memfs_file_t*) file)->pos;
+}
+
+static uint32_t _atommc_memfs_size(void* ctx, void* file) {
+   atommc_memfs_t* memfs = (atommc_memfs_t*) ctx;
+   return memfs->nodes[((atommc_memfs_file_t*) file)->node].size;
+}
+
+static const uint8_t* _atommc_memfs_map(void* ctx, void* file, uint32_t size) {
+   atommc_memfs_t* memfs = (atommc_memfs_t*) ctx;
+   atommc_memfs_file_t* f = (atommc_memfs_file_t*) file;
+   atommc_memfs_node_t* node = &memfs->nodes[f->node];
+   // The mapping must follow later writes through any handle, so copy the
+   // file now, the private buffer isn't reallocated until unmapped
+   _atommc_memfs_own(node, node->size);
+   node->map_count++;
+   return node->data;
+}
+
+static void _atommc_memfs_unmap(void* ctx, void* file, const uint8_t* ptr, uint32_t size) {
+   atommc_memfs_t* memfs = (atommc_memfs_t*) ctx;
+   atommc_memfs_node_t* node = &memfs->nodes[((atommc_memfs_file_t*) file)->node];
+   CHIPS_ASSERT(node->map_count > 0);
+   node->map_count--;
+}
+
+static const atommc_fs_t _atommc_mem_fs = {
+   _atommc_memfs_stat,
+   _atommc_memfs_list,
+   _atommc_memfs_mkdir,
+   _atommc_memfs_rmdir,
+   _atommc_memfs_remove,
+   _atommc_memfs_open,
+   _atommc_memfs_close,
+   _atommc_memfs_read,
+   _atommc_memfs_write,
+   _atommc_memfs_seek,
+   _atommc_memfs_tell,
+   _atommc_memfs_size,
+   _atommc_memfs_map,
+   _atommc_memfs_unmap
+};
+
 void atommc_init(atommc_t* atommc, const atommc_desc_t* desc) {
    CHIPS_ASSERT(atommc && desc);
    memset(atommc, 0, sizeof(*atommc));
    atommc->in_cb = desc->in_cb;
    atommc->out_cb = desc->out_cb;
    atommc->user_data = desc->user_data;
-   atommc_reset(atommc);
-   atommc->cfg_byte = desc->autoboot ? 0xA0 : 0xE0;
-   // All the files are packaged in a subdirectory called mmc
-   if (chdir("mmc")) {
+   atommc->latency = desc->latency;
+   for (int i = 0; i < IMG_CACHE_SIZE; i++) {
+      atommc->img_cache[i].drive = -1;
+   }
+   if (desc->fs) {
+      // Custom file system backend
+      atommc->fs = desc->fs;
+      atommc->fs_ctx = desc->fs_ctx;
+   } else if (desc->archive) {
+      // In-memory file system backed by a packed archive
+      _atommc_memfs_init(&atommc->memfs, (const uint8_t*) desc->archive, desc->archive_size);
+      atommc->fs = &_atommc_mem_fs;
+      atommc->fs_ctx = &atommc->memfs;
+   } else {
+      // All the files are packaged in a subdirectory called mmc, paths are
+      // resolved relative to it (rather than calling chdir(), which would
+      // affect the whole host process and any other atommc instance)
+      const char *root_dir = desc->root_dir ? desc->root_dir : "mmc";
+      struct stat statbuf;
+      if (!stat(root_dir, &statbuf) && S_ISDIR(statbuf.st_mode)) {
+         snprintf(atommc->root, sizeof(atommc->root), "%s", root_dir);
+      } else {
 #ifdef ATOMMC_DEBUG
-      printf("failed to change to mmc subdirectory\n");
+         printf("failed to find %s subdirectory\n", root_dir);
 #endif
+         strcpy(atommc->root, ".");
+      }
+      atommc->fs = &_atommc_host_fs;
+      atommc->fs_ctx = atommc;
+   }
+   atommc_reset(atommc);
+   atommc->cfg_byte = desc->autoboot ? 0xA0 : 0xE0;
+   if (desc->async_io) {
+      pthread_mutex_init(&atommc->mutex, NULL);
+      pthread_cond_init(&atommc->cond, NULL);
+      if (0 == pthread_create(&atommc->worker, NULL, _atommc_worker, atommc)) {
+         atommc->async_io = true;
+      } else {
+         pthread_cond_destroy(&atommc->cond);
+         pthread_mutex_destroy(&atommc->mutex);
+      }
    }
 }
 
-void atommc_reset(atommc_t* atommc) {
-   CHIPS_ASSERT(atommc);
-   atommc->heartbeat = 0x55;
-   // Close any open files
+// Wait until the worker thread has completed the current command
+static void _atommc_wait_idle(atommc_t* atommc) {
+   if (atommc->async_io) {
+      pthread_mutex_lock(&atommc->mutex);
+      while (atommc->busy) {
+         pthread_cond_wait(&atommc->cond, &atommc->mutex);
+      }
+      pthread_mutex_unlock(&atommc->mutex);
+   }
+}
+
+// Close any open files
+static void _atommc_close_all(atommc_t* atommc) {
    for (int i = 0; i < MAX_FD; i++) {
       if (atommc->fd[i]) {
-         fclose(atommc->fd[i]);
+         atommc->fs->close(atommc->fs_ctx, atommc->fd[i]);
          atommc->fd[i] = NULL;
       }
    }
-   // Reset CWD to the root
-   strcpy(atommc->cwd, ".");
 }
 
-// Construct a complete file path from the string in the global data area
-static char *getFilename(atommc_t* atommc) {
-   static char buffer[MAX_FILEPATH];
-   // Strip any leading / characters
-   int index = 0;
-   while (atommc->global_data[index] == '/') {
-      index++;
+void atommc_discard(atommc_t* atommc) {
+   CHIPS_ASSERT(atommc);
+   if (atommc->async_io) {
+      pthread_mutex_lock(&atommc->mutex);
+      atommc->quit = true;
+      pthread_cond_broadcast(&atommc->cond);
+      pthread_mutex_unlock(&atommc->mutex);
+      pthread_join(atommc->worker, NULL);
+      pthread_cond_destroy(&atommc->cond);
+      pthread_mutex_destroy(&atommc->mutex);
+      atommc->async_io = false;
    }
-   if (index) {
-      // Path is absolute
-      sprintf(buffer, "./%s", (char *)atommc->global_data + index);
-   } else {
-      // Path is relative to cwd
-      sprintf(buffer, "%s/%s", atommc->cwd, (char *)atommc->global_data);
+   _atommc_close_all(atommc);
+   for (int i = 0; i < MAX_IMG; i++) {
+      _atommc_img_unmount(atommc, i);
    }
-#ifdef ATOMMC_DEBUG
-   printf("%s\n", buffer);
-#endif
-   return buffer;
+   _atommc_memfs_discard(&atommc->memfs);
+   free(atommc->dir_entries);
+   free(atommc->dir_arena);
+   atommc->dir_entries = NULL;
+   atommc->dir_arena = NULL;
+   atommc->dir_valid = false;
 }
 
-// Compare two directory entries, based on their names
-static int cmpstringp(const void *p1, const void *p2) {
-   atommc_dirent_t *d1 = (atommc_dirent_t *)p1;
-   atommc_dirent_t *d2 = (atommc_dirent_t *)p2;
-   return strcmp(* (char * const *) d1->name, * (char * const *) d2->name);
+void atommc_reset(atommc_t* atommc) {
+   CHIPS_ASSERT(atommc);
+   _atommc_wait_idle(atommc);
+   atommc->countdown = 0;
+   atommc->heartbeat = 0x55;
+   _atommc_close_all(atommc);
+   // Mounted SDDOS images survive a reset, but are written back
+   _atommc_img_flush(atommc);
+   // Reset CWD to the root
+   atommc->cwd[0] = 0;
 }
 
+
 // Case 1: Open Read
 // if exists and regular, mode = "r"
 // if exists and not regular, error = "DENIED"
@@ -348,10 +1122,14 @@ static void openFile(atommc_t* atommc, int filenum, int open_mode) {
    atommc->response = ATOMMC_ERROR_INT_ERR;
    // Construct the filename
    char *filename = getFilename(atommc);
+   if (!filename) {
+      atommc->response = ATOMMC_ERROR_NO_PATH;
+      return;
+   }
    // Stat the file
-   struct stat statbuf;
-   bool exists = !stat(filename, &statbuf);
-   bool regular = exists && (statbuf.st_mode & S_IFREG);
+   atommc_stat_t st;
+   bool exists = atommc->fs->stat(atommc->fs_ctx, filename, &st);
+   bool regular = exists && !st.dir;
 
    // This error is common to all three modes
    // and will typical mean trying read a directory
@@ -359,13 +1137,10 @@ static void openFile(atommc_t* atommc, int filenum, int open_mode) {
       atommc->response = ATOMMC_ERROR_DENIED;
       return;
    }
-   // Initial checks, and pick the right mode to match AtoMMC semantics
-   char *mode;
+   // Initial checks to match AtoMMC semantics
    switch (open_mode) {
    case ATOMMC_MODE_READ:
-      if (exists) {
-         mode = "r";
-      } else {
+      if (!exists) {
          atommc->response = ATOMMC_ERROR_NO_FILE;
          return;
       }
@@ -374,16 +1149,9 @@ static void openFile(atommc_t* atommc, int filenum, int open_mode) {
       if (exists) {
          atommc->response = ATOMMC_ERROR_EXIST;
          return;
-      } else {
-         mode = "w";
       }
       break;
    case ATOMMC_MODE_RAF:
-      if (exists) {
-         mode = "r+";
-      } else {
-         mode = "w+";
-      }
       break;
    default:
       return;
@@ -404,8 +1172,8 @@ static void openFile(atommc_t* atommc, int filenum, int open_mode) {
       return;
    }
    // Try to open the file
-   FILE **fdp = &atommc->fd[filenum];
-   *fdp = fopen(getFilename(atommc), mode);
+   void **fdp = &atommc->fd[filenum];
+   *fdp = atommc->fs->open(atommc->fs_ctx, filename, open_mode);
    if (*fdp == 0) {
       atommc->response = ATOMMC_ERROR_DENIED;
       return;
@@ -505,355 +1273,756 @@ static int wildcmp(const char *wild, const char *string)  {
    return !*wild;
 }
 
-// Handle writes to the following registers:
-//   ATOMMC_CMD_REG
-//   ATOMMC_LATCH_REG
-//   ATOMMC_WRITE_DATA_REG
+// SDDOS disk image support
 //
-// Note, ATOMMC_READ_DATA_REG is read only, so is ignored here
-
-static void _atommc_write(atommc_t* atommc, uint8_t addr, uint8_t data) {
-   int filenum = 0;
-   FILE **fdp;
-
-   // Latch the address only on writes
-   atommc->address = addr & 3;
-
-   switch (addr & 3) {
+// Images are mapped read-only and shared (if the backend supports it), so
+// sector reads are a copy out of the mapping. Sector writes are collected
+// in a small LRU cache and written back to the image file (which updates
+// the shared mapping) when the entry is evicted or the images are flushed.
+
+// Write back a dirty cache entry
+static bool _atommc_img_writeback(atommc_t* atommc, atommc_sector_t* entry) {
+   bool ok = true;
+   if (entry->drive >= 0 && entry->dirty) {
+      atommc_img_t* img = &atommc->img[entry->drive];
+      ok = atommc->fs->seek(atommc->fs_ctx, img->file, entry->sector * IMG_SECTOR_SIZE) &&
+           atommc->fs->write(atommc->fs_ctx, img->file, entry->data, IMG_SECTOR_SIZE) == IMG_SECTOR_SIZE;
+      entry->dirty = false;
+   }
+   return ok;
+}
 
-   case ATOMMC_CMD_REG:
+// Write back all dirty sectors
+static void _atommc_img_flush(atommc_t* atommc) {
+   for (int i = 0; i < IMG_CACHE_SIZE; i++) {
+      _atommc_img_writeback(atommc, &atommc->img_cache[i]);
+   }
+}
 
-      // Deal with random access files
+// Find a sector in the cache, returns NULL if not cached
+static atommc_sector_t* _atommc_img_lookup(atommc_t* atommc, int drive, uint32_t sector) {
+   for (int i = 0; i < IMG_CACHE_SIZE; i++) {
+      atommc_sector_t* entry = &atommc->img_cache[i];
+      if (entry->drive == drive && entry->sector == sector) {
+         entry->last_use = ++atommc->img_clock;
+         return entry;
+      }
+   }
+   return NULL;
+}
 
-      // File Group 0x10-0x17, 0x30-0x37, 0x50-0x57, 0x70-0x77
-      // filenum = bits 6,5
-      // mask1 = 10011000 (test for file group command)
-      // mask2 = 10011111 (remove file number)
-      if ((data & 0x98) == 0x10) {
-         filenum = (data >> 5) & 3;
-         data &= 0x9F;
+// Allocate a cache entry for a sector, evicting the least recently used
+static atommc_sector_t* _atommc_img_alloc(atommc_t* atommc, int drive, uint32_t sector) {
+   atommc_sector_t* lru = &atommc->img_cache[0];
+   for (int i = 0; i < IMG_CACHE_SIZE; i++) {
+      atommc_sector_t* entry = &atommc->img_cache[i];
+      if (entry->drive < 0) {
+         lru = entry;
+         break;
       }
-
-      // Data Group 0x20-0x23, 0x24-0x27, 0x28-0x2B, 0x2C-0x2F
-      // filenum = bits 3,2
-      // mask1 = 11110000 (test for data group command)
-      // mask2 = 11110011 (remove file number)
-      if ((data & 0xf0) == 0x20) {
-         filenum = (data >> 2) & 3;
-         data &= 0xF3;
+      if (entry->last_use < lru->last_use) {
+         lru = entry;
       }
+   }
+   if (!_atommc_img_writeback(atommc, lru)) {
+      return NULL;
+   }
+   lru->drive = drive;
+   lru->sector = sector;
+   lru->last_use = ++atommc->img_clock;
+   return lru;
+}
 
-      fdp = &atommc->fd[filenum];
+// Unmount an image, writing back any dirty sectors first
+static void _atommc_img_unmount(atommc_t* atommc, int drive) {
+   atommc_img_t* img = &atommc->img[drive];
+   for (int i = 0; i < IMG_CACHE_SIZE; i++) {
+      atommc_sector_t* entry = &atommc->img_cache[i];
+      if (entry->drive == drive) {
+         _atommc_img_writeback(atommc, entry);
+         entry->drive = -1;
+      }
+   }
+   if (img->file) {
+      if (img->map) {
+         atommc->fs->unmap(atommc->fs_ctx, img->file, img->map, img->num_sectors * IMG_SECTOR_SIZE);
+         img->map = NULL;
+      }
+      atommc->fs->close(atommc->fs_ctx, img->file);
+      img->file = NULL;
+   }
+   img->num_sectors = 0;
+   img->name[0] = 0;
+   img->path[0] = 0;
+}
 
-      uint8_t cmd = data;
+// Mount an image file
+//   global_data[0] = drive number 0-3
+//   global_data[1..n] = image filename
+static void _atommc_img_mount(atommc_t* atommc) {
+   int drive = atommc->global_data[0] & (MAX_IMG - 1);
+   _atommc_img_unmount(atommc, drive);
+   // Drop the drive number, so the filename is at the start of global data
+   memmove(atommc->global_data, atommc->global_data + 1, MAX_GLOBAL - 1);
+   atommc->global_data[MAX_GLOBAL - 1] = 0;
+   char *filename = getFilename(atommc);
+   atommc_img_t* img = &atommc->img[drive];
+   atommc_stat_t st;
+   int n = snprintf(img->name, sizeof(img->name), "%s", (char *)atommc->global_data);
+   if (!filename || n < 0 || n >= (int) sizeof(img->name)) {
+      atommc->response = ATOMMC_ERROR_NO_PATH;
+      return;
+   }
+   if (!atommc->fs->stat(atommc->fs_ctx, filename, &st)) {
+      atommc->response = ATOMMC_ERROR_NO_FILE;
+      return;
+   }
+   if (st.dir || st.size < IMG_SECTOR_SIZE) {
+      atommc->response = ATOMMC_ERROR_DENIED;
+      return;
+   }
+   // The file exists, so opening it for random access doesn't create it
+   img->attr = 0;
+   img->file = atommc->fs->open(atommc->fs_ctx, filename, ATOMMC_MODE_RAF);
+   if (!img->file) {
+      img->attr = ATOMMC_IMG_READ_ONLY;
+      img->file = atommc->fs->open(atommc->fs_ctx, filename, ATOMMC_MODE_READ);
+   }
+   if (!img->file) {
+      atommc->response = ATOMMC_ERROR_DENIED;
+      return;
+   }
+   img->num_sectors = st.size / IMG_SECTOR_SIZE;
+   if (atommc->fs->map) {
+      img->map = atommc->fs->map(atommc->fs_ctx, img->file, img->num_sectors * IMG_SECTOR_SIZE);
+   }
+   snprintf(img->path, sizeof(img->path), "%s", filename);
+   atommc->response = ATOMMC_STATUS_OK;
+}
 
-      // Assume all commands are slow commands
-      atommc->response = ATOMMC_STATUS_BUSY;
+// Check the parameters loaded by LOAD_PARAM, returns the image or NULL
+static atommc_img_t* _atommc_img_param(atommc_t* atommc) {
+   atommc_img_t* img = &atommc->img[atommc->img_drive];
+   if (!img->file) {
+      atommc->response = ATOMMC_ERROR_NO_FILE;
+      return NULL;
+   }
+   if (atommc->img_sector >= img->num_sectors) {
+      atommc->response = ATOMMC_ERROR_INT_ERR;
+      return NULL;
+   }
+   return img;
+}
 
-#ifdef ATOMMC_DEBUG
-      printf("atommc: cmd=%02x\n", cmd);
-#endif
+// Directory cache
+//
+// The entries of the last listed directory are kept in an arena which
+// grows to fit the directory. The listing is unfiltered and sorted, the
+// wildcard is applied on DIR_READ, so a repeated *CAT (with any wildcard)
+// only costs one stat of the directory while its modification time is
+// unchanged. Commands which modify the card drop the cache, as changing
+// a file's length doesn't change its directory's modification time.
+
+// Copy a string into the arena, returns its offset
+static uint32_t _atommc_dir_intern(atommc_t* atommc, const char* prefix, const char* name, const char* suffix) {
+   uint32_t len = (uint32_t)(strlen(prefix) + strlen(name) + strlen(suffix) + 1);
+   if ((atommc->dir_arena_size + len) > atommc->dir_arena_cap) {
+      uint32_t cap = atommc->dir_arena_cap ? atommc->dir_arena_cap : 1024;
+      while (cap < (atommc->dir_arena_size + len)) {
+         cap *= 2;
+      }
+      atommc->dir_arena = (char*) realloc(atommc->dir_arena, cap);
+      atommc->dir_arena_cap = cap;
+   }
+   uint32_t offset = atommc->dir_arena_size;
+   snprintf(atommc->dir_arena + offset, len, "%s%s%s", prefix, name, suffix);
+   atommc->dir_arena_size += len;
+   return offset;
+}
 
-      switch (cmd) {
+// Directory listing callback, adds an entry to the directory cache
+static void _atommc_dir_add(const char* name, const atommc_stat_t* st, void* cb_data) {
+   atommc_t* atommc = (atommc_t*) cb_data;
+   if (atommc->dir_size == atommc->dir_cap) {
+      atommc->dir_cap = atommc->dir_cap ? (2 * atommc->dir_cap) : 64;
+      atommc->dir_entries = (atommc_dirent_t*) realloc(atommc->dir_entries, atommc->dir_cap * sizeof(atommc_dirent_t));
+   }
+   atommc_dirent_t* entry = &atommc->dir_entries[atommc->dir_size++];
+   entry->raw = _atommc_dir_intern(atommc, "", name, "");
+   if (st->dir) {
+      entry->name = _atommc_dir_intern(atommc, "<", name, ">");
+      entry->attr = ATOMMC_ATTR_DIR;
+   } else {
+      entry->name = entry->raw;
+      entry->attr = 0;
+   }
+   entry->len = st->size;
+}
 
-      case ATOMMC_CMD_DIR_OPEN:
-         {
-            // Separate wildcard and path
-            parseWildcard(atommc);
+// Sort the directory entries by their display names (insertion sort, as
+// qsort can't be given the arena base, directories are mostly in order)
+static void _atommc_dir_sort(atommc_t* atommc) {
+   const char* arena = atommc->dir_arena;
+   for (int i = 1; i < atommc->dir_size; i++) {
+      atommc_dirent_t entry = atommc->dir_entries[i];
+      int j = i - 1;
+      while (j >= 0 && strcmp(arena + atommc->dir_entries[j].name, arena + entry.name) > 0) {
+         atommc->dir_entries[j + 1] = atommc->dir_entries[j];
+         j--;
+      }
+      atommc->dir_entries[j + 1] = entry;
+   }
+}
 
-#ifdef ATOMMC_DEBUG
-            printf("wildcard = %s\n", atommc->wildPattern);
-            printf("path = %s\n", getFilename(atommc));
-#endif
+// Load a directory into the cache, unless it's already there
+static bool _atommc_dir_load(atommc_t* atommc, const char* path) {
+   atommc_stat_t st;
+   if (!atommc->fs->stat(atommc->fs_ctx, path, &st) || !st.dir) {
+      return false;
+   }
+   if (atommc->dir_valid && (st.mtime == atommc->dir_mtime) && !strcmp(path, atommc->dir_path)) {
+      return true;
+   }
+   atommc->dir_valid = false;
+   atommc->dir_size = 0;
+   atommc->dir_arena_size = 0;
+   if (!atommc->fs->list(atommc->fs_ctx, path, _atommc_dir_add, atommc)) {
+      return false;
+   }
+   _atommc_dir_sort(atommc);
+   snprintf(atommc->dir_path, sizeof(atommc->dir_path), "%s", path);
+   atommc->dir_mtime = st.mtime;
+   atommc->dir_valid = true;
+   return true;
+}
 
-            // Cache the directory entries, in sorted order
-            DIR *dir = opendir(getFilename(atommc));
-            if (dir) {
-               struct dirent *entry;
-               int i = 0;
-               while (i < MAX_DIRSIZE && (entry = readdir(dir)) != NULL) {
+// Execute a command, this is called on the worker thread for
+// commands which access the host file system if async_io is enabled
 
-                  uint8_t attr = 0;
+static void _atommc_exec(atommc_t* atommc, uint8_t cmd, int filenum) {
+   void **fdp = &atommc->fd[filenum];
+   const atommc_fs_t* fs = atommc->fs;
+   char *filename;
 
-                  if (!wildcmp(atommc->wildPattern, entry->d_name)) {
-                     continue;
-                  }
+#ifdef ATOMMC_DEBUG
+   printf("atommc: cmd=%02x\n", cmd);
+#endif
 
-                  char *ptr = atommc->dirlist[i].name;
-                  if (entry->d_type == DT_DIR) {
-                     attr |= ATOMMC_ATTR_DIR;
-                     *ptr++ = '<';
-                  }
+   // Commands which modify the card drop the directory cache
+   switch (cmd) {
+   case ATOMMC_CMD_DIR_MKDIR:
+   case ATOMMC_CMD_DIR_RMDIR:
+   case ATOMMC_CMD_FILE_OPEN_WRITE:
+   case ATOMMC_CMD_FILE_OPEN_RAF:
+   case ATOMMC_CMD_FILE_DELETE:
+   case ATOMMC_CMD_WRITE_BYTES:
+      atommc->dir_valid = false;
+      break;
+   }
 
-                  strcpy(ptr, entry->d_name);
-                  ptr = ptr + strlen(entry->d_name);
-                  if (entry->d_type == DT_DIR) {
-                     *ptr++ = '>';
-                     *ptr++ = 0;
-                  }
+   switch (cmd) {
 
-                  // TODO: populate the length field
-                  atommc->dirlist[i].len = 0;
+   case ATOMMC_CMD_DIR_OPEN:
+      {
+         // Separate wildcard and path
+         parseWildcard(atommc);
 
-                  atommc->dirlist[i].attr = attr;
 #ifdef ATOMMC_DEBUG
-                  printf("dirent name:%s\n",   atommc->dirlist[i].name);
-                  printf("dirent  len:%d\n",   atommc->dirlist[i].len);
-                  printf("dirent attr:%02x\n", atommc->dirlist[i].attr);
+         printf("wildcard = %s\n", atommc->wildPattern);
+         printf("path = %s\n", getFilename(atommc));
 #endif
-                  atommc->dirsorted[i] = &atommc->dirlist[i];
-                  i++;
-               }
-               closedir(dir);
-               qsort(atommc->dirsorted, i, sizeof(char *), cmpstringp);
-               atommc->dir_size = i;
-               atommc->dir_index = 0;
-               atommc->response = ATOMMC_STATUS_OK;
-            } else {
-               atommc->response = ATOMMC_ERROR_NO_PATH;
-            }
-         }
-         break;
 
-      case ATOMMC_CMD_DIR_READ:
-         {
-            // Return the next name from the caches directory
-            if (atommc->dir_index < atommc->dir_size) {
-               memset(atommc->global_data, 0, sizeof(atommc->global_data));
-               char *name = atommc->dirsorted[atommc->dir_index]->name;
-               strcpy((char *)atommc->global_data, name);
-               // Additional metadata folloes the name
-               uint8_t *ptr = (uint8_t *)(atommc->global_data) + strlen(name) + 1;
-               // Copy the attribute byte
-               *ptr++ = atommc->dirsorted[atommc->dir_index]->attr;
-               // Copy the length
-               uint32_t len = atommc->dirsorted[atommc->dir_index]->len;
-               for (int i = 0; i < 4; i++) {
-                  *ptr++ = len & 0xff;
-                  len >>= 8;
-               }
-               // Move on to the entry
-               atommc->dir_index++;
-               atommc->response = ATOMMC_STATUS_OK;
-#ifdef ATOMMC_DEBUG
-               printf("dir: %d %s\n", atommc->dir_index, name);
-#endif
-            } else {
-               atommc->global_data[0] = 0;
-               atommc->response = ATOMMC_STATUS_COMPLETE;
-            }
+         // Cache the directory entries, in sorted order
+         char *dirname = getFilename(atommc);
+         if (dirname && _atommc_dir_load(atommc, dirname)) {
+            atommc->dir_index = 0;
+            atommc->response = ATOMMC_STATUS_OK;
+         } else {
+            atommc->response = ATOMMC_ERROR_NO_PATH;
          }
-         break;
+      }
+      break;
 
-      case ATOMMC_CMD_DIR_CWD:
-         {
-            // Form the new directory name
-            char *dirname = getFilename(atommc);
-
-            // Test if it's a directory
-            DIR *dir = opendir(dirname);
-            if (dir) {
-               strcpy(atommc->cwd, dirname);
-               closedir(dir);
-               atommc->response = ATOMMC_STATUS_COMPLETE;
-            } else {
-               atommc->response = ATOMMC_ERROR_NO_PATH;
+   case ATOMMC_CMD_DIR_READ:
+      {
+         // Skip entries which don't match the wildcard
+         while (atommc->dir_index < atommc->dir_size &&
+                !wildcmp(atommc->wildPattern, atommc->dir_arena + atommc->dir_entries[atommc->dir_index].raw)) {
+            atommc->dir_index++;
+         }
+         // Return the next name from the caches directory
+         if (atommc->dir_index < atommc->dir_size) {
+            atommc_dirent_t *entry = &atommc->dir_entries[atommc->dir_index];
+            memset(atommc->global_data, 0, sizeof(atommc->global_data));
+            char *name = atommc->dir_arena + entry->name;
+            // Truncate long names, leaving room for the metadata
+            snprintf((char *)atommc->global_data, MAX_GLOBAL - 5, "%s", name);
+            // Additional metadata folloes the name
+            uint8_t *ptr = (uint8_t *)(atommc->global_data) + strlen((char *)atommc->global_data) + 1;
+            // Copy the attribute byte
+            *ptr++ = entry->attr;
+            // Copy the length
+            uint32_t len = entry->len;
+            for (int i = 0; i < 4; i++) {
+               *ptr++ = len & 0xff;
+               len >>= 8;
             }
+            // Move on to the entry
+            atommc->dir_index++;
+            atommc->response = ATOMMC_STATUS_OK;
+#ifdef ATOMMC_DEBUG
+            printf("dir: %d %s\n", atommc->dir_index, name);
+#endif
+         } else {
+            atommc->global_data[0] = 0;
+            atommc->response = ATOMMC_STATUS_COMPLETE;
          }
-         break;
+      }
+      break;
 
-      case ATOMMC_CMD_DIR_GETCWD:
-         // This is never used by the AtoMMC filesystem ROM
-         atommc->response = ATOMMC_ERROR_INT_ERR;
-         break;
+   case ATOMMC_CMD_DIR_CWD:
+      {
+         // Form the new directory name
+         char *dirname = getFilename(atommc);
 
-      case ATOMMC_CMD_DIR_MKDIR:
-         if (mkdir(getFilename(atommc), 0x755)) {
-            atommc->response = ATOMMC_ERROR_DENIED;
-         } else {
+         // Test if it's a directory
+         atommc_stat_t st;
+         if (dirname && fs->stat(atommc->fs_ctx, dirname, &st) && st.dir) {
+            strcpy(atommc->cwd, dirname);
             atommc->response = ATOMMC_STATUS_COMPLETE;
+         } else {
+            atommc->response = ATOMMC_ERROR_NO_PATH;
          }
-         break;
+      }
+      break;
 
-      case ATOMMC_CMD_DIR_RMDIR:
-         if (rmdir(getFilename(atommc))) {
-            atommc->response = ATOMMC_ERROR_DENIED;
-         } else {
+   case ATOMMC_CMD_DIR_GETCWD:
+      // This is never used by the AtoMMC filesystem ROM
+      atommc->response = ATOMMC_ERROR_INT_ERR;
+      break;
+
+   case ATOMMC_CMD_DIR_MKDIR:
+      filename = getFilename(atommc);
+      if (!filename || !fs->mkdir(atommc->fs_ctx, filename)) {
+         atommc->response = ATOMMC_ERROR_DENIED;
+      } else {
+         atommc->response = ATOMMC_STATUS_COMPLETE;
+      }
+      break;
+
+   case ATOMMC_CMD_DIR_RMDIR:
+      filename = getFilename(atommc);
+      if (!filename || !fs->rmdir(atommc->fs_ctx, filename)) {
+         atommc->response = ATOMMC_ERROR_DENIED;
+      } else {
+         atommc->response = ATOMMC_STATUS_COMPLETE;
+      }
+      break;
+
+   case ATOMMC_CMD_FILE_CLOSE:
+      atommc->response = ATOMMC_ERROR_INT_ERR;
+      if (*fdp) {
+         if (fs->close(atommc->fs_ctx, *fdp)) {
             atommc->response = ATOMMC_STATUS_COMPLETE;
          }
-         break;
+      }
+      *fdp = NULL;
+      break;
+
+   case ATOMMC_CMD_FILE_OPEN_READ:
+      openFile(atommc, filenum, ATOMMC_MODE_READ);
+      break;
+
+   case ATOMMC_CMD_FILE_OPEN_RAF:
+      openFile(atommc, filenum, ATOMMC_MODE_RAF);
+      break;
+
+   case ATOMMC_CMD_FILE_OPEN_WRITE:
+      openFile(atommc, filenum, ATOMMC_MODE_WRITE);
+      break;
 
-      case ATOMMC_CMD_FILE_CLOSE:
+   case ATOMMC_CMD_FILE_DELETE:
+      filename = getFilename(atommc);
+      if (!filename || !fs->remove(atommc->fs_ctx, filename)) {
+         atommc->response = ATOMMC_ERROR_NO_PATH;
+      } else {
+         atommc->response = ATOMMC_STATUS_COMPLETE;
+      }
+      break;
+
+   case ATOMMC_CMD_FILE_GETINFO:
+      atommc->response = ATOMMC_ERROR_INT_ERR;
+      if (*fdp) {
+         // File size
+         *(uint32_t *)(atommc->global_data) = fs->size(atommc->fs_ctx, *fdp);
+         // Start Sector (TODO)
+         *(uint32_t *)(atommc->global_data + 4) = 0;
+         // Current random access file pointer
+         *(uint32_t *)(atommc->global_data + 8) = fs->tell(atommc->fs_ctx, *fdp);
+         // File attributes (TODO)
+         atommc->global_data[12] = 0;
          atommc->response = ATOMMC_ERROR_INT_ERR;
-         if (*fdp) {
-            if (fclose(*fdp) == 0) {
-               atommc->response = ATOMMC_STATUS_COMPLETE;
-            }
-         }
-         *fdp = NULL;
-         break;
+      }
+      break;
 
-      case ATOMMC_CMD_FILE_OPEN_READ:
-         openFile(atommc, filenum, ATOMMC_MODE_READ);
-         break;
+   case ATOMMC_CMD_FILE_SEEK:
+      atommc->response = ATOMMC_ERROR_INT_ERR;
+      if (*fdp) {
+         uint32_t offset = *(uint32_t *)(&atommc->global_data[0]);
+         fs->seek(atommc->fs_ctx, *fdp, offset);
+         atommc->response = ATOMMC_STATUS_COMPLETE;
+      }
+      break;
 
-      case ATOMMC_CMD_FILE_OPEN_RAF:
-         openFile(atommc, filenum, ATOMMC_MODE_RAF);
-         break;
+   case ATOMMC_CMD_INIT_READ:
+      atommc->response = atommc->global_data[0];
+      atommc->global_index = 1;
+      atommc->address = ATOMMC_READ_DATA_REG;
+      break;
 
-      case ATOMMC_CMD_FILE_OPEN_WRITE:
-         openFile(atommc, filenum, ATOMMC_MODE_WRITE);
-         break;
+   case ATOMMC_CMD_INIT_WRITE:
+      atommc->global_index = 0;
+      break;
 
-      case ATOMMC_CMD_FILE_DELETE:
-         if (remove(getFilename(atommc))) {
-            atommc->response = ATOMMC_ERROR_NO_PATH;
-         } else {
+   case ATOMMC_CMD_READ_BYTES:
+      atommc->response = ATOMMC_ERROR_INT_ERR;
+      if (*fdp) {
+         int len = atommc->latch;
+         if (len == 0) {
+            len = 256;
+         }
+         if (fs->read(atommc->fs_ctx, *fdp, atommc->global_data, len) == (uint32_t)len) {
             atommc->response = ATOMMC_STATUS_COMPLETE;
+         } else {
+            atommc->response = ATOMMC_STATUS_EOF;
          }
-         break;
+      }
+      break;
 
-      case ATOMMC_CMD_FILE_GETINFO:
-         atommc->response = ATOMMC_ERROR_INT_ERR;
-         if (*fdp) {
-            struct stat statbuf;
-            if (fstat(fileno(*fdp), &statbuf) == 0) {
-               // File size
-               *(uint32_t *)(atommc->global_data) = statbuf.st_size;
-               // Start Sector (TODO)
-               *(uint32_t *)(atommc->global_data + 4) = 0;
-               // Current random access file pointer
-               *(uint32_t *)(atommc->global_data + 8) = ftell(*fdp);
-               // File attributes (TODO)
-               atommc->global_data[12] = 0;
-               atommc->response = ATOMMC_ERROR_INT_ERR;
-            }
+   case ATOMMC_CMD_WRITE_BYTES:
+      atommc->response = ATOMMC_ERROR_INT_ERR;
+      if (*fdp) {
+         int len = atommc->latch;
+         if (len == 0) {
+            len = 256;
          }
-         break;
-
-      case ATOMMC_CMD_FILE_SEEK:
-         atommc->response = ATOMMC_ERROR_INT_ERR;
-         if (*fdp) {
-            int offset = *(uint32_t *)(&atommc->global_data[0]);
-            fseek(*fdp, offset, SEEK_SET);
+         if (fs->write(atommc->fs_ctx, *fdp, atommc->global_data, len) == (uint32_t)len) {
             atommc->response = ATOMMC_STATUS_COMPLETE;
+         } else {
+            atommc->response = ATOMMC_ERROR_DENIED;
          }
-         break;
+      }
+      break;
 
-      case ATOMMC_CMD_INIT_READ:
-         atommc->response = atommc->global_data[0];
-         atommc->global_index = 1;
-         atommc->address = ATOMMC_READ_DATA_REG;
-         break;
+   // This is never used by the AtoMMC filesystem ROM
+   case ATOMMC_CMD_EXEC_PACKET:
+      atommc->response = ATOMMC_ERROR_INT_ERR;
+      break;
 
-      case ATOMMC_CMD_INIT_WRITE:
-         atommc->global_index = 0;
-         break;
+   // SDDOS image commands
+   // These are never used by the AtoMMC filesystem ROM, only by SDDOS
 
-      case ATOMMC_CMD_READ_BYTES:
-         atommc->response = ATOMMC_ERROR_INT_ERR;
-         if (*fdp) {
-            int len = atommc->latch;
-            if (len == 0) {
-               len = 256;
-            }
-            if (fread(atommc->global_data, len, 1, *fdp) == 1) {
-               atommc->response = ATOMMC_STATUS_COMPLETE;
-            } else if (feof(*fdp)) {
-               atommc->response = ATOMMC_STATUS_EOF;
-            } else {
+   case ATOMMC_CMD_FILE_OPEN_IMG:
+      _atommc_img_mount(atommc);
+      break;
+
+   case ATOMMC_CMD_LOAD_PARAM:
+      // global_data[0] = drive number, global_data[1..4] = sector number
+      atommc->img_drive = atommc->global_data[0] & (MAX_IMG - 1);
+      atommc->img_sector = atommc->global_data[1] |
+                           (atommc->global_data[2] << 8) |
+                           (atommc->global_data[3] << 16) |
+                           ((uint32_t)atommc->global_data[4] << 24);
+      atommc->response = ATOMMC_STATUS_OK;
+      break;
+
+   case ATOMMC_CMD_GET_IMG_STATUS:
+      {
+         atommc_img_t* img = &atommc->img[atommc->global_data[0] & (MAX_IMG - 1)];
+         atommc->response = img->file ? img->attr : ATOMMC_IMG_NOT_MOUNTED;
+      }
+      break;
+
+   case ATOMMC_CMD_GET_IMG_NAME:
+      {
+         atommc_img_t* img = &atommc->img[atommc->global_data[0] & (MAX_IMG - 1)];
+         memset(atommc->global_data, 0, sizeof(atommc->global_data));
+         if (img->file) {
+            snprintf((char *)atommc->global_data, MAX_GLOBAL, "%s", img->name);
+            atommc->response = ATOMMC_STATUS_OK;
+         } else {
+            atommc->response = ATOMMC_ERROR_NO_FILE;
+         }
+      }
+      break;
+
+   case ATOMMC_CMD_READ_IMG_SEC:
+      {
+         atommc_img_t* img = _atommc_img_param(atommc);
+         if (img) {
+            // Dirty sectors in the cache take priority over the image
+            atommc_sector_t* entry = _atommc_img_lookup(atommc, atommc->img_drive, atommc->img_sector);
+            uint32_t offset = atommc->img_sector * IMG_SECTOR_SIZE;
+            atommc->response = ATOMMC_STATUS_OK;
+            if (entry) {
+               memcpy(atommc->global_data, entry->data, IMG_SECTOR_SIZE);
+            } else if (img->map) {
+               memcpy(atommc->global_data, img->map + offset, IMG_SECTOR_SIZE);
+            } else if (!atommc->fs->seek(atommc->fs_ctx, img->file, offset) ||
+                       atommc->fs->read(atommc->fs_ctx, img->file, atommc->global_data, IMG_SECTOR_SIZE) != IMG_SECTOR_SIZE) {
                atommc->response = ATOMMC_ERROR_DENIED;
             }
          }
-         break;
+      }
+      break;
 
-      case ATOMMC_CMD_WRITE_BYTES:
-         atommc->response = ATOMMC_ERROR_INT_ERR;
-         if (*fdp) {
-            int len = atommc->latch;
-            if (len == 0) {
-               len = 256;
+   case ATOMMC_CMD_WRITE_IMG_SEC:
+      {
+         atommc_img_t* img = _atommc_img_param(atommc);
+         if (img) {
+            if (img->attr & ATOMMC_IMG_READ_ONLY) {
+               atommc->response = ATOMMC_ERROR_DENIED;
+               break;
             }
-            if (fwrite(atommc->global_data, len, 1, *fdp) == 1) {
-               atommc->response = ATOMMC_STATUS_COMPLETE;
+            atommc_sector_t* entry = _atommc_img_lookup(atommc, atommc->img_drive, atommc->img_sector);
+            if (!entry) {
+               entry = _atommc_img_alloc(atommc, atommc->img_drive, atommc->img_sector);
+            }
+            if (entry) {
+               memcpy(entry->data, atommc->global_data, IMG_SECTOR_SIZE);
+               entry->dirty = true;
+               atommc->response = ATOMMC_STATUS_OK;
             } else {
                atommc->response = ATOMMC_ERROR_DENIED;
             }
          }
-         break;
+      }
+      break;
 
-      // This is never used by the AtoMMC filesystem ROM
-      case ATOMMC_CMD_EXEC_PACKET:
-         atommc->response = ATOMMC_ERROR_INT_ERR;
-         break;
+   case ATOMMC_CMD_SER_IMG_INFO:
+      // The real firmware saves the mounted image names to the card here,
+      // the mounts persist in the emulator, so just write back the cache
+      _atommc_img_flush(atommc);
+      atommc->response = ATOMMC_STATUS_OK;
+      break;
 
-      // SDDOS image commands
-      // This is never used by the AtoMMC filesystem ROM
+   case ATOMMC_CMD_VALID_IMG_NAMES:
+      // Unmount any images which no longer exist on the card
+      for (int i = 0; i < MAX_IMG; i++) {
+         atommc_stat_t st;
+         if (atommc->img[i].file && !atommc->fs->stat(atommc->fs_ctx, atommc->img[i].path, &st)) {
+            _atommc_img_unmount(atommc, i);
+         }
+      }
+      atommc->response = ATOMMC_STATUS_OK;
+      break;
 
-      case ATOMMC_CMD_LOAD_PARAM:
-      case ATOMMC_CMD_FILE_OPEN_IMG:
-      case ATOMMC_CMD_GET_IMG_STATUS:
-      case ATOMMC_CMD_GET_IMG_NAME:
-      case ATOMMC_CMD_READ_IMG_SEC:
-      case ATOMMC_CMD_WRITE_IMG_SEC:
-      case ATOMMC_CMD_SER_IMG_INFO:
-      case ATOMMC_CMD_VALID_IMG_NAMES:
-      case ATOMMC_CMD_IMG_UNMOUNT:
-         atommc->response = ATOMMC_ERROR_INT_ERR;
-         break;
+   case ATOMMC_CMD_IMG_UNMOUNT:
+      _atommc_img_unmount(atommc, atommc->global_data[0] & (MAX_IMG - 1));
+      atommc->response = ATOMMC_STATUS_OK;
+      break;
 
-      // Utility commands
+   // Utility commands
 
-      case ATOMMC_CMD_GET_CARD_TYPE:
-         atommc->response = ATOMMC_CT_DEFAULT;
-         break;
+   case ATOMMC_CMD_GET_CARD_TYPE:
+      atommc->response = ATOMMC_CT_DEFAULT;
+      break;
 
-      case ATOMMC_CMD_GET_PORT_DDR:
-         atommc->response = atommc->port_tris;
-         break;
+   case ATOMMC_CMD_GET_PORT_DDR:
+      atommc->response = atommc->port_tris;
+      break;
 
-      case ATOMMC_CMD_SET_PORT_DDR:
-         atommc->port_tris = atommc->latch;
-         atommc->response = ATOMMC_STATUS_OK;
-         break;
+   case ATOMMC_CMD_SET_PORT_DDR:
+      atommc->port_tris = atommc->latch;
+      atommc->response = ATOMMC_STATUS_OK;
+      break;
 
-      case ATOMMC_CMD_READ_PORT:
-         atommc->response = atommc->port_data;
-         break;
+   case ATOMMC_CMD_READ_PORT:
+      atommc->response = atommc->port_data;
+      break;
 
-      case ATOMMC_CMD_WRITE_PORT:
-         atommc->port_data = atommc->latch;
-         atommc->response = ATOMMC_STATUS_OK;
-         break;
+   case ATOMMC_CMD_WRITE_PORT:
+      atommc->port_data = atommc->latch;
+      atommc->response = ATOMMC_STATUS_OK;
+      break;
 
-      case ATOMMC_CMD_GET_FW_VER:
-         atommc->response = 0x2D;
-         break;
+   case ATOMMC_CMD_GET_FW_VER:
+      atommc->response = 0x2D;
+      break;
 
-      case ATOMMC_CMD_GET_BL_VER:
-         atommc->response = 0x29;
-         break;
+   case ATOMMC_CMD_GET_BL_VER:
+      atommc->response = 0x29;
+      break;
 
-      case ATOMMC_CMD_GET_CFG_BYTE:
-         atommc->response = atommc->cfg_byte;
-         break;
+   case ATOMMC_CMD_GET_CFG_BYTE:
+      atommc->response = atommc->cfg_byte;
+      break;
 
-      case ATOMMC_CMD_SET_CFG_BYTE:
-         atommc->cfg_byte = atommc->latch;
-         atommc->response = ATOMMC_STATUS_OK;
-         break;
+   case ATOMMC_CMD_SET_CFG_BYTE:
+      atommc->cfg_byte = atommc->latch;
+      atommc->response = ATOMMC_STATUS_OK;
+      break;
 
-      case ATOMMC_CMD_READ_AUX:
-         atommc->response = atommc->address;
-         atommc->response = ATOMMC_STATUS_OK;
-         break;
+   case ATOMMC_CMD_READ_AUX:
+      atommc->response = atommc->address;
+      atommc->response = ATOMMC_STATUS_OK;
+      break;
+
+   case ATOMMC_CMD_GET_HEARTBEAT:
+      atommc->heartbeat ^= 0xff;
+      atommc->response = atommc->heartbeat;
+      break;
+
+   }
+}
+
+// Test whether a command accesses the host file system
+
+static bool _atommc_host_io(uint8_t cmd) {
+   switch (cmd) {
+   case ATOMMC_CMD_DIR_OPEN:
+   case ATOMMC_CMD_DIR_CWD:
+   case ATOMMC_CMD_DIR_MKDIR:
+   case ATOMMC_CMD_DIR_RMDIR:
+   case ATOMMC_CMD_FILE_CLOSE:
+   case ATOMMC_CMD_FILE_OPEN_READ:
+   case ATOMMC_CMD_FILE_OPEN_RAF:
+   case ATOMMC_CMD_FILE_OPEN_WRITE:
+   case ATOMMC_CMD_FILE_DELETE:
+   case ATOMMC_CMD_FILE_GETINFO:
+   case ATOMMC_CMD_FILE_SEEK:
+   case ATOMMC_CMD_READ_BYTES:
+   case ATOMMC_CMD_WRITE_BYTES:
+   case ATOMMC_CMD_FILE_OPEN_IMG:
+   case ATOMMC_CMD_READ_IMG_SEC:
+   case ATOMMC_CMD_WRITE_IMG_SEC:
+   case ATOMMC_CMD_SER_IMG_INFO:
+   case ATOMMC_CMD_VALID_IMG_NAMES:
+   case ATOMMC_CMD_IMG_UNMOUNT:
+      return true;
+   default:
+      return false;
+   }
+}
 
-      case ATOMMC_CMD_GET_HEARTBEAT:
-         atommc->heartbeat ^= 0xff;
-         atommc->response = atommc->heartbeat;
+// The host I/O worker thread, executes one command at a time and
+// publishes the response by clearing the busy flag
+
+static void* _atommc_worker(void* arg) {
+   atommc_t* atommc = (atommc_t*) arg;
+   pthread_mutex_lock(&atommc->mutex);
+   for (;;) {
+      while (!atommc->busy && !atommc->quit) {
+         pthread_cond_wait(&atommc->cond, &atommc->mutex);
+      }
+      if (atommc->quit) {
          break;
+      }
+      uint8_t cmd = atommc->pending_cmd;
+      int filenum = atommc->pending_filenum;
+      pthread_mutex_unlock(&atommc->mutex);
+      _atommc_exec(atommc, cmd, filenum);
+      pthread_mutex_lock(&atommc->mutex);
+      atommc->busy = false;
+      pthread_cond_broadcast(&atommc->cond);
+   }
+   pthread_mutex_unlock(&atommc->mutex);
+   return NULL;
+}
+
+// Get the latency of a command, only the slow commands (which the
+// firmware polls for completion) take time
+
+static uint32_t _atommc_latency(atommc_t* atommc, uint8_t cmd) {
+   const atommc_latency_t* l = &atommc->latency;
+   uint32_t len = atommc->latch ? atommc->latch : 256;
+   switch (cmd) {
+   case ATOMMC_CMD_DIR_OPEN:
+   case ATOMMC_CMD_DIR_CWD:
+      return l->command + l->dir_open;
+   case ATOMMC_CMD_DIR_READ:
+      return l->command + l->dir_read;
+   case ATOMMC_CMD_DIR_MKDIR:
+   case ATOMMC_CMD_DIR_RMDIR:
+   case ATOMMC_CMD_FILE_CLOSE:
+   case ATOMMC_CMD_FILE_OPEN_READ:
+   case ATOMMC_CMD_FILE_OPEN_RAF:
+   case ATOMMC_CMD_FILE_OPEN_WRITE:
+   case ATOMMC_CMD_FILE_OPEN_IMG:
+   case ATOMMC_CMD_FILE_DELETE:
+   case ATOMMC_CMD_FILE_GETINFO:
+   case ATOMMC_CMD_FILE_SEEK:
+      return l->command + l->file;
+   case ATOMMC_CMD_READ_BYTES:
+   case ATOMMC_CMD_WRITE_BYTES:
+      return l->command + l->sector + (l->byte * len);
+   case ATOMMC_CMD_READ_IMG_SEC:
+   case ATOMMC_CMD_WRITE_IMG_SEC:
+      return l->command + l->sector;
+   default:
+      return 0;
+   }
+}
+
+// Handle writes to the following registers:
+//   ATOMMC_CMD_REG
+//   ATOMMC_LATCH_REG
+//   ATOMMC_WRITE_DATA_REG
+//
+// Note, ATOMMC_READ_DATA_REG is read only, so is ignored here
+
+static void _atommc_write(atommc_t* atommc, uint8_t addr, uint8_t data) {
+   int filenum = 0;
+
+   // The firmware polls for completion before accessing any
+   // registers again, but be safe and wait for the worker
+   _atommc_wait_idle(atommc);
+
+   // Latch the address only on writes
+   atommc->address = addr & 3;
+
+   switch (addr & 3) {
+
+   case ATOMMC_CMD_REG:
+
+      // Deal with random access files
+
+      // File Group 0x10-0x17, 0x30-0x37, 0x50-0x57, 0x70-0x77
+      // filenum = bits 6,5
+      // mask1 = 10011000 (test for file group command)
+      // mask2 = 10011111 (remove file number)
+      if ((data & 0x98) == 0x10) {
+         filenum = (data >> 5) & 3;
+         data &= 0x9F;
+      }
+
+      // Data Group 0x20-0x23, 0x24-0x27, 0x28-0x2B, 0x2C-0x2F
+      // filenum = bits 3,2
+      // mask1 = 11110000 (test for data group command)
+      // mask2 = 11110011 (remove file number)
+      if ((data & 0xf0) == 0x20) {
+         filenum = (data >> 2) & 3;
+         data &= 0xF3;
+      }
+
+      // Assume all commands are slow commands
+      atommc->response = ATOMMC_STATUS_BUSY;
 
+      // Commands accessing the host file system are handed over to the
+      // worker thread if async_io is enabled, the response reads as BUSY
+      // until the worker has completed the command
+      if (atommc->async_io && _atommc_host_io(data)) {
+         pthread_mutex_lock(&atommc->mutex);
+         atommc->pending_cmd = data;
+         atommc->pending_filenum = filenum;
+         atommc->busy = true;
+         pthread_cond_broadcast(&atommc->cond);
+         pthread_mutex_unlock(&atommc->mutex);
+      } else {
+         _atommc_exec(atommc, data, filenum);
       }
+      // Start the countdown until the command completes
+      atommc->countdown = _atommc_latency(atommc, data);
       break;
 
    case ATOMMC_LATCH_REG:
@@ -884,6 +2053,20 @@ static void _atommc_write(atommc_t* atommc, uint8_t addr, uint8_t data) {
 // Otherwise the last command response is returned.
 
 static uint8_t _atommc_read(atommc_t* atommc, uint8_t addr) {
+   // The command is still executing
+   if (atommc->countdown > 0) {
+      return ATOMMC_STATUS_BUSY;
+   }
+   // While the worker thread is executing a command, the
+   // response is owned by the worker and reads as BUSY
+   if (atommc->async_io) {
+      pthread_mutex_lock(&atommc->mutex);
+      bool busy = atommc->busy;
+      pthread_mutex_unlock(&atommc->mutex);
+      if (busy) {
+         return ATOMMC_STATUS_BUSY;
+      }
+   }
    uint8_t data = atommc->response;
    if (atommc->address == ATOMMC_READ_DATA_REG) {
       atommc->response = atommc->global_data[atommc->global_index++];
@@ -915,9 +2098,62 @@ uint64_t atommc_iorq(atommc_t* atommc, uint64_t pins) {
     return pins;
 }
 
-// Tick is currently empty, as this is a purely functional emulation
+// Bulk version of _atommc_read() for fast data transfers, the
+// response register holds the next byte, global_index wraps at 256
+
+int atommc_read_data(atommc_t* atommc, uint8_t* dst, int num_bytes) {
+   CHIPS_ASSERT(atommc && dst);
+   if (atommc->countdown > 0) {
+      return 0;
+   }
+   if (atommc->async_io) {
+      pthread_mutex_lock(&atommc->mutex);
+      bool busy = atommc->busy;
+      pthread_mutex_unlock(&atommc->mutex);
+      if (busy) {
+         return 0;
+      }
+   }
+   if ((num_bytes <= 0) || (atommc->address != ATOMMC_READ_DATA_REG)) {
+      return 0;
+   }
+   dst[0] = atommc->response;
+   for (int i = 1; i < num_bytes;) {
+      // Copy up to the end of global data, then wrap around
+      int n = MAX_GLOBAL - atommc->global_index;
+      if (n > (num_bytes - i)) {
+         n = num_bytes - i;
+      }
+      memcpy(&dst[i], &atommc->global_data[atommc->global_index], n);
+      atommc->global_index += n;
+      i += n;
+   }
+   atommc->response = atommc->global_data[atommc->global_index++];
+   return num_bytes;
+}
+
+// Tick counts down the latency of the current command, there's
+// nothing else to do while idle
 
 void atommc_tick(atommc_t* atommc) {
+   if (atommc->countdown > 0) {
+      atommc->countdown--;
+   }
+}
+
+// Rough estimates for an AtoMMC2 with a typical SD card, in ticks
+// of the 1 MHz Atom clock (a FAT directory lookup reads a few sectors,
+// the PIC moves a byte to or from the global data area in a few us)
+
+atommc_latency_t atommc_default_latency(void) {
+   atommc_latency_t l;
+   l.command = 50;
+   l.dir_open = 4000;
+   l.dir_read = 400;
+   l.file = 5000;
+   l.sector = 1500;
+   l.byte = 4;
+   return l;
 }
 
 #endif /* CHIPS_IMPL */
@@ -35,7 +35,23 @@
     emulated system if the host-system key press was too short.
 
     Call the function kbd_test_lines() to check the current state of the
-    keyboard matrix.
+    keyboard matrix. Since some emulated systems test the keyboard matrix
+    very often, the test results are precomputed into lookup tables
+    whenever the set of pressed keys changes, so that a matrix test
+    is just a couple of table lookups.
+
+    To type in long texts (for instance pasting a BASIC listing), call
+    kbd_queue_text() with a string of key codes. Instead of depending on
+    host frames, queued keys are pressed and released as fast as the
+    emulated system's keyboard scanning code observes them: each time
+    kbd_test_lines() or kbd_test_columns() (or the kbd_scan_*() functions)
+    starts looking at the matrix position of the current queued key again,
+    this counts as one 'observed scan'. A queued key is held down for
+    a number of observed scans, and then released for a number of observed
+    scans before the next key is pressed, both counts can be tuned
+    with kbd_queue_timing() to match the debouncing logic of the emulated
+    system's keyboard driver. Key codes which haven't been registered are
+    skipped.
 
     ## zlib/libpng license
 
@@ -56,6 +72,7 @@
         distribution. 
 */
 #include <stdint.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -66,6 +83,8 @@ extern "C" {
 #define KBD_MAX_MOD_KEYS (4)
 #define KBD_MAX_KEYS (256)
 #define KBD_MAX_PRESSED_KEYS (4)
+#define KBD_DEFAULT_QUEUE_HOLD (2)      /* default number of observed scans a queued key is held down */
+#define KBD_DEFAULT_QUEUE_RELEASE (2)   /* default number of observed scans between queued keys */
 
 /* a pressed-key state */
 typedef struct {
@@ -96,6 +115,26 @@ typedef struct {
     uint32_t mod_masks[KBD_MAX_MOD_KEYS];
     /* currently pressed keys (bitmask==0 is empty slot) */
     key_state_t key_buffer[KBD_MAX_PRESSED_KEYS];
+    /* type-in queue, the text is owned by the caller */
+    const uint8_t* queue_ptr;
+    int queue_size;
+    int queue_pos;
+    /* number of observed scans a queued key is held down and released */
+    int queue_hold;
+    int queue_release;
+    int queue_repeat;
+    /* key mask of the current queued key, and whether it is down */
+    uint32_t queue_mask;
+    bool queue_down;
+    /* observed scans remaining until the next queued key event */
+    int queue_countdown;
+    /* true if the previous matrix test already looked at the queued key */
+    bool queue_seen;
+    /* precomputed matrix test results, rebuilt when the pressed keys change */
+    uint16_t scan_lines_any;        /* lines lit regardless of the column mask */
+    uint16_t scan_columns_any;      /* columns lit regardless of the line mask */
+    uint16_t scan_lines[2][64];     /* lit lines by lower and upper 6 column mask bits */
+    uint16_t scan_columns[2][64];   /* lit columns by lower and upper 6 line mask bits */
 } kbd_t;
 
 /* initialize a keyboard matrix instance */
@@ -126,6 +165,12 @@ uint16_t kbd_scan_lines(kbd_t* kbd);
 void kbd_set_active_lines(kbd_t* kbd, uint16_t line_mask);
 /* scan active columns (used together with kbd_set_active_lines */
 uint16_t kbd_scan_columns(kbd_t* kbd);
+/* queue key codes for typing in (text isn't copied, replaces any queued text) */
+void kbd_queue_text(kbd_t* kbd, const char* text, int num_bytes);
+/* set observed scans to hold down and release queued keys, repeat is the release count between identical keys */
+void kbd_queue_timing(kbd_t* kbd, int hold_scans, int release_scans, int repeat_scans);
+/* get number of queued key codes not yet typed */
+int kbd_queue_remaining(kbd_t* kbd);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -139,6 +184,8 @@ uint16_t kbd_scan_columns(kbd_t* kbd);
     #define CHIPS_ASSERT(c) assert(c)
 #endif
 
+static void _kbd_rebuild(kbd_t* kbd);
+
 /*
     kbd_init(kbd_t* kbd, int sticky_count)
 
@@ -155,12 +202,18 @@ void kbd_init(kbd_t* kbd, int sticky_count) {
     memset(kbd, 0, sizeof(*kbd));
     kbd->frame_count = 1;
     kbd->sticky_count = sticky_count;
+    kbd->queue_hold = KBD_DEFAULT_QUEUE_HOLD;
+    kbd->queue_release = KBD_DEFAULT_QUEUE_RELEASE;
+    kbd->queue_repeat = KBD_DEFAULT_QUEUE_RELEASE;
 }
 
 void kbd_update(kbd_t* kbd) {
     CHIPS_ASSERT(kbd);
     kbd->frame_count++;
+    /* a new frame also starts a new observed scan of the queued key */
+    kbd->queue_seen = false;
     /* check for sticky keys that should be released */
+    bool changed = false;
     for (int i = 0; i < KBD_MAX_PRESSED_KEYS; i++) {
         key_state_t* k = &kbd->key_buffer[i];
         if (k->released_frame != 0) {
@@ -169,9 +222,13 @@ void kbd_update(kbd_t* kbd) {
                 k->key = 0;
                 k->pressed_frame = 0;
                 k->released_frame = 0;
+                changed = true;
             }
         }
     }
+    if (changed) {
+        _kbd_rebuild(kbd);
+    }
 }
 
 void kbd_register_modifier(kbd_t* kbd, int layer, int column, int line) {
@@ -180,6 +237,7 @@ void kbd_register_modifier(kbd_t* kbd, int layer, int column, int line) {
     CHIPS_ASSERT((line >= 0) && (line < KBD_MAX_LINES));
     CHIPS_ASSERT((layer >= 0) && (layer < KBD_MAX_MOD_KEYS));
     kbd->mod_masks[layer] = (1<<(layer+KBD_MAX_COLUMNS+KBD_MAX_LINES)) | (1<<(column+KBD_MAX_LINES)) | (1<<line);
+    _kbd_rebuild(kbd);
 }
 
 void kbd_register_modifier_line(kbd_t* kbd, int layer, int line) {
@@ -187,6 +245,7 @@ void kbd_register_modifier_line(kbd_t* kbd, int layer, int line) {
     CHIPS_ASSERT((line >= 0) && (line < KBD_MAX_LINES));
     CHIPS_ASSERT((layer >= 0) && (layer < KBD_MAX_MOD_KEYS));
     kbd->mod_masks[layer] = (1<<(layer+KBD_MAX_COLUMNS+KBD_MAX_LINES)) | (1<<line);
+    _kbd_rebuild(kbd);
 }
 
 void kbd_register_modifier_column(kbd_t* kbd, int layer, int column) {
@@ -194,6 +253,7 @@ void kbd_register_modifier_column(kbd_t* kbd, int layer, int column) {
     CHIPS_ASSERT((column >= 0) && (column < KBD_MAX_COLUMNS));
     CHIPS_ASSERT((layer >= 0) && (layer < KBD_MAX_MOD_KEYS));
     kbd->mod_masks[layer] = (1<<(layer+KBD_MAX_COLUMNS+KBD_MAX_LINES)) | (1<<(column+KBD_MAX_LINES));
+    _kbd_rebuild(kbd);
 }
 
 void kbd_register_key(kbd_t* kbd, int key, int column, int line, int mod_mask) {
@@ -224,6 +284,7 @@ void kbd_key_down(kbd_t* kbd, int key) {
             k->mask = kbd->key_masks[key];
             k->pressed_frame = kbd->frame_count;
             k->released_frame = 0;
+            _kbd_rebuild(kbd);
             return;
         }
     }
@@ -255,69 +316,154 @@ static uint32_t _kbd_mod(uint32_t key_mask) {
     return key_mask & ((1<<KBD_MAX_MOD_KEYS)-1)<<(KBD_MAX_COLUMNS+KBD_MAX_LINES);
 }
 
-/* scan keyboard matrix lines by column mask */
-uint16_t kbd_test_lines(kbd_t* kbd, uint16_t column_mask) {
-    CHIPS_ASSERT(kbd);
-    uint16_t line_bits = 0;
-    for (int key_index = 0; key_index < KBD_MAX_PRESSED_KEYS; key_index++) {
-        const uint32_t key_mask = kbd->key_buffer[key_index].mask;
-        if (key_mask) {
-            const uint16_t key_col_mask = _kbd_columns(key_mask);
-            if ((key_col_mask & column_mask) == key_col_mask) {
-                line_bits |= _kbd_lines(key_mask);
+/* add a pressed key's column to line (and line to column) mapping */
+static void _kbd_add_key(uint32_t key_mask, uint16_t* col_lines, uint16_t* line_cols, uint16_t* any_lines, uint16_t* any_cols) {
+    const uint16_t cols = _kbd_columns(key_mask);
+    const uint16_t lines = _kbd_lines(key_mask);
+    /* a key without a line or column is visible in all lines or columns */
+    if (cols) {
+        for (int i = 0; i < KBD_MAX_COLUMNS; i++) {
+            if (cols & (1<<i)) {
+                col_lines[i] |= lines;
             }
-            const uint32_t key_mod_mask = _kbd_mod(key_mask);
-            if (key_mod_mask) {
-                for (int mod_index = 0; mod_index < KBD_MAX_MOD_KEYS; mod_index++) {
-                    const uint32_t mod_mask = kbd->mod_masks[mod_index];
-                    if (mod_mask & key_mod_mask) {
-                        const uint16_t mod_col_mask = _kbd_columns(mod_mask);
-                        if (mod_col_mask) {
-                            if ((mod_col_mask & column_mask) == mod_col_mask) {
-                                line_bits |= _kbd_lines(mod_mask);
-                            }
-                        }
-                        else {
-                            line_bits |= _kbd_lines(mod_mask);
-                        }
-                    }
-                }
+        }
+    }
+    else {
+        *any_lines |= lines;
+    }
+    if (lines) {
+        for (int i = 0; i < KBD_MAX_LINES; i++) {
+            if (lines & (1<<i)) {
+                line_cols[i] |= cols;
             }
         }
     }
-    return line_bits;
+    else {
+        *any_cols |= cols;
+    }
 }
 
-/* scan keyboard matrix lines by column mask */
-uint16_t kbd_test_columns(kbd_t* kbd, uint16_t line_mask) {
-    CHIPS_ASSERT(kbd);
-    uint16_t column_bits = 0;
-    for (int key_index = 0; key_index < KBD_MAX_PRESSED_KEYS; key_index++) {
-        const uint32_t key_mask = kbd->key_buffer[key_index].mask;
+/*  rebuild the matrix test lookup tables from the pressed keys, this
+    relies on each registered key and modifier occupying at most one
+    column and one line, so that the lines lit by a column mask are
+    simply the combination of the lines lit by each single column
+*/
+static void _kbd_rebuild(kbd_t* kbd) {
+    uint16_t col_lines[KBD_MAX_COLUMNS] = { 0 };
+    uint16_t line_cols[KBD_MAX_LINES] = { 0 };
+    uint16_t any_lines = 0;
+    uint16_t any_cols = 0;
+    for (int key_index = 0; key_index <= KBD_MAX_PRESSED_KEYS; key_index++) {
+        uint32_t key_mask;
+        if (key_index < KBD_MAX_PRESSED_KEYS) {
+            key_mask = kbd->key_buffer[key_index].mask;
+        }
+        else {
+            /* the current type-in queue key */
+            key_mask = kbd->queue_down ? kbd->queue_mask : 0;
+        }
         if (key_mask) {
-            const uint16_t key_line_mask = _kbd_lines(key_mask);
-            if ((key_line_mask & line_mask) == key_line_mask) {
-                column_bits |= _kbd_columns(key_mask);
-            }
+            _kbd_add_key(key_mask, col_lines, line_cols, &any_lines, &any_cols);
             const uint32_t key_mod_mask = _kbd_mod(key_mask);
             if (key_mod_mask) {
                 for (int mod_index = 0; mod_index < KBD_MAX_MOD_KEYS; mod_index++) {
                     const uint32_t mod_mask = kbd->mod_masks[mod_index];
                     if (mod_mask & key_mod_mask) {
-                        const uint16_t mod_line_mask = _kbd_lines(mod_mask);
-                        if (mod_line_mask) {
-                            if ((mod_line_mask & line_mask) == mod_line_mask) {
-                                column_bits |= _kbd_columns(mod_mask);
-                            }
-                        }
-                        else {
-                            column_bits |= _kbd_columns(mod_mask);
-                        }
+                        _kbd_add_key(mod_mask, col_lines, line_cols, &any_lines, &any_cols);
                     }
                 }
             }
         }
     }
+    kbd->scan_lines_any = any_lines;
+    kbd->scan_columns_any = any_cols;
+    kbd->scan_lines[0][0] = kbd->scan_lines[1][0] = 0;
+    kbd->scan_columns[0][0] = kbd->scan_columns[1][0] = 0;
+    for (int i = 1; i < 64; i++) {
+        /* combine the entry without the lowest bit with the lowest bit's entry */
+        int bit = 0;
+        while (0 == (i & (1<<bit))) {
+            bit++;
+        }
+        const int j = i & (i - 1);
+        kbd->scan_lines[0][i] = kbd->scan_lines[0][j] | col_lines[bit];
+        kbd->scan_lines[1][i] = kbd->scan_lines[1][j] | col_lines[bit+6];
+        kbd->scan_columns[0][i] = kbd->scan_columns[0][j] | line_cols[bit];
+        kbd->scan_columns[1][i] = kbd->scan_columns[1][j] | line_cols[bit+6];
+    }
+}
+
+/* skip unregistered key codes in the type-in queue, and return the next key mask */
+static uint32_t _kbd_queue_peek(kbd_t* kbd) {
+    while (kbd->queue_pos < kbd->queue_size) {
+        const uint32_t mask = kbd->key_masks[kbd->queue_ptr[kbd->queue_pos]];
+        if (mask) {
+            return mask;
+        }
+        kbd->queue_pos++;
+    }
+    return 0;
+}
+
+/* press the next key from the type-in queue (if any) */
+static void _kbd_queue_next(kbd_t* kbd) {
+    kbd->queue_mask = _kbd_queue_peek(kbd);
+    if (kbd->queue_mask) {
+        kbd->queue_pos++;
+    }
+    kbd->queue_down = (0 != kbd->queue_mask);
+    kbd->queue_countdown = kbd->queue_hold;
+    kbd->queue_seen = false;
+    _kbd_rebuild(kbd);
+}
+
+/* called when a matrix test looks at the queued key position, advances the queue */
+static void _kbd_queue_observe(kbd_t* kbd, bool seen) {
+    if (seen && !kbd->queue_seen) {
+        if (--kbd->queue_countdown <= 0) {
+            if (kbd->queue_down) {
+                /* release the key, identical keys in a row need a longer pause */
+                kbd->queue_down = false;
+                if (_kbd_queue_peek(kbd) == kbd->queue_mask) {
+                    kbd->queue_countdown = kbd->queue_repeat;
+                }
+                else {
+                    kbd->queue_countdown = kbd->queue_release;
+                }
+                _kbd_rebuild(kbd);
+            }
+            else {
+                _kbd_queue_next(kbd);
+                return;
+            }
+        }
+    }
+    kbd->queue_seen = seen;
+}
+
+/* scan keyboard matrix lines by column mask */
+uint16_t kbd_test_lines(kbd_t* kbd, uint16_t column_mask) {
+    CHIPS_ASSERT(kbd);
+    const uint16_t line_bits = kbd->scan_lines_any |
+                               kbd->scan_lines[0][column_mask & 0x3F] |
+                               kbd->scan_lines[1][(column_mask>>6) & 0x3F];
+    if (kbd->queue_mask) {
+        const uint16_t queue_col_mask = _kbd_columns(kbd->queue_mask);
+        _kbd_queue_observe(kbd, (queue_col_mask & column_mask) == queue_col_mask);
+    }
+    return line_bits;
+}
+
+/* scan keyboard matrix columns by line mask */
+uint16_t kbd_test_columns(kbd_t* kbd, uint16_t line_mask) {
+    CHIPS_ASSERT(kbd);
+    const uint16_t column_bits = kbd->scan_columns_any |
+                                 kbd->scan_columns[0][line_mask & 0x3F] |
+                                 kbd->scan_columns[1][(line_mask>>6) & 0x3F];
+    if (kbd->queue_mask) {
+        const uint16_t queue_line_mask = _kbd_lines(kbd->queue_mask);
+        _kbd_queue_observe(kbd, (queue_line_mask & line_mask) == queue_line_mask);
+    }
     return column_bits;
 }
 
@@ -341,4 +487,36 @@ uint16_t kbd_scan_columns(kbd_t* kbd) {
     return kbd_test_columns(kbd, kbd->active_lines);
 }
 
+/*
+    kbd_queue_text(kbd_t* kbd, const char* text, int num_bytes)
+
+    Queue a string of key codes for typing in, each byte is used as
+    a key code and must have been registered with kbd_register_key(),
+    unregistered key codes are skipped. The text isn't copied and must
+    remain valid until kbd_queue_remaining() returns 0. Queued keys
+    are independent from keys pressed with kbd_key_down() and
+    don't use the sticky count.
+*/
+void kbd_queue_text(kbd_t* kbd, const char* text, int num_bytes) {
+    CHIPS_ASSERT(kbd && (text || (0 == num_bytes)) && (num_bytes >= 0));
+    kbd->queue_ptr = (const uint8_t*) text;
+    kbd->queue_size = num_bytes;
+    kbd->queue_pos = 0;
+    kbd->queue_mask = 0;
+    _kbd_queue_next(kbd);
+}
+
+void kbd_queue_timing(kbd_t* kbd, int hold_scans, int release_scans, int repeat_scans) {
+    CHIPS_ASSERT(kbd && (hold_scans > 0) && (release_scans > 0) && (repeat_scans >= release_scans));
+    kbd->queue_hold = hold_scans;
+    kbd->queue_release = release_scans;
+    kbd->queue_repeat = repeat_scans;
+}
+
+int kbd_queue_remaining(kbd_t* kbd) {
+    CHIPS_ASSERT(kbd);
+    /* the current key counts as remaining until it has been released */
+    return (kbd->queue_size - kbd->queue_pos) + (kbd->queue_mask ? 1 : 0);
+}
+
 #endif /* CHIPS_IMPL */
@@ -37,6 +37,12 @@
     The real VIC-II has multiplexed address bus pins, the emulation
     doesn't.
 
+    The generated image is written either as RGBA8 pixels into rgba8_buffer,
+    or as 8-bit color indices (0..15) into index8_buffer, use m6569_palette()
+    to get the matching RGBA8 colors. Pixels are only written if they
+    differ from what's already in the framebuffer, and lines with changed
+    pixels are flagged in a dirty-row bitmap (see m6569_dirty_rows()).
+
     TODO: Documentation
 
     ## zlib/libpng license
@@ -120,6 +126,10 @@ typedef struct {
     uint32_t* rgba8_buffer;
     /* size of the RGBA framebuffer (must be at least 512x312, optional) */
     uint32_t rgba8_buffer_size;
+    /* alternative 8-bit color index framebuffer (optional, see m6569_palette()) */
+    uint8_t* index8_buffer;
+    /* size of the color index framebuffer in bytes */
+    uint32_t index8_buffer_size;
     /* visible CRT area blitted to rgba8_buffer (in pixels) */
     uint16_t vis_x, vis_y, vis_w, vis_h;
     /* the memory-fetch callback */
@@ -179,6 +189,9 @@ typedef struct {
 #define M6569_INT_EMBC      (1<<1)      /* int_mask: mob/bitmap collision interrupt enabled */
 #define M6569_INT_ERST      (1<<0)      /* int_mask: raster interrupt enabled */
 
+/* number of 32-bit words in the dirty-row bitmap (enough for 312 debug-vis lines) */
+#define M6569_DIRTY_WORDS (10)
+
 /* raster unit state */
 typedef struct {
     uint8_t h_count;
@@ -225,6 +238,8 @@ typedef struct {
     uint16_t vis_x0, vis_y0, vis_x1, vis_y1;  /* the visible area */
     uint16_t vis_w, vis_h;      /* width of visible area */
     uint32_t* rgba8_buffer;
+    uint8_t* index8_buffer;
+    uint32_t dirty_rows[M6569_DIRTY_WORDS];  /* one bit per changed display line */
 } m6569_crt_t;
 
 /* graphics sequencer state */
@@ -249,6 +264,7 @@ typedef struct {
     uint8_t p_data[8];          /* the byte read by p_access memory fetch */
     bool dma_enabled[8];        /* sprite dma is enabled */
     bool disp_enabled[8];       /* sprite display is enabled */
+    uint8_t disp_mask;          /* bit i set if disp_enabled[i], only changes at the start of a line */
     bool expand[8];             /* expand flip-flop */
     uint8_t mc[8];              /* 6-bit mob-data-counter */
     uint8_t mc_base[8];         /* 6-bit mob-data-counter base */
@@ -275,6 +291,8 @@ typedef struct {
     m6569_graphics_unit_t gunit;
     m6569_sprite_unit_t sunit;
     m6569_video_matrix_t vm;
+    uint32_t colors[16];        /* RGBA8 colors, or color index with alpha bits set if index8_buffer is used */
+    uint32_t pixel_masks[256][8];   /* pixel byte => 8 select masks (0 or 0xFFFFFFFF), MSB first */
     uint64_t pins;
 } m6569_t;
 
@@ -292,6 +310,10 @@ uint64_t m6569_iorq(m6569_t* vic, uint64_t pins);
 uint64_t m6569_tick(m6569_t* vic, uint64_t pins);
 /* get 32-bit RGBA8 value from color index (0..15) */
 uint32_t m6569_color(int i);
+/* copy the RGBA8 colors for the index8_buffer color indices, returns number of colors */
+int m6569_palette(m6569_t* vic, uint32_t* rgba8, int max_colors);
+/* copy and clear the dirty-row bitmap (bit y&31 of word y>>5 for display line y), returns number of lines */
+int m6569_dirty_rows(m6569_t* vic, uint32_t* bits, int max_rows);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -300,6 +322,7 @@ uint32_t m6569_color(int i);
 /*--- IMPLEMENTATION ---------------------------------------------------------*/
 #ifdef CHIPS_IMPL
 #include <string.h>
+#include "mem.h" /* dirty-row helpers */
 #ifndef CHIPS_ASSERT
     #include <assert.h>
     #define CHIPS_ASSERT(c) assert(c)
@@ -390,7 +413,9 @@ static void _m6569_init_crt(m6569_crt_t* crt, const m6569_desc_t* desc) {
     /* vis area horizontal coords must be multiple of 8 */
     CHIPS_ASSERT((desc->vis_x & 7) == 0);
     CHIPS_ASSERT((desc->vis_w & 7) == 0);
-    crt->rgba8_buffer = desc->rgba8_buffer;
+    CHIPS_ASSERT(desc->vis_h <= M6569_DIRTY_WORDS*32);
+    crt->rgba8_buffer = desc->index8_buffer ? 0 : desc->rgba8_buffer;
+    crt->index8_buffer = desc->index8_buffer;
     crt->vis_x0 = desc->vis_x/8;
     crt->vis_y0 = desc->vis_y;
     crt->vis_w = desc->vis_w/8;
@@ -402,8 +427,17 @@ static void _m6569_init_crt(m6569_crt_t* crt, const m6569_desc_t* desc) {
 void m6569_init(m6569_t* vic, const m6569_desc_t* desc) {
     CHIPS_ASSERT(vic && desc);
     CHIPS_ASSERT((0 == desc->rgba8_buffer) || (desc->rgba8_buffer_size >= (_M6569_HTOTAL*8*_M6569_VTOTAL*sizeof(uint32_t))));
+    CHIPS_ASSERT((0 == desc->index8_buffer) || (desc->index8_buffer_size >= (_M6569_HTOTAL*8*_M6569_VTOTAL)));
     memset(vic, 0, sizeof(*vic));
     _m6569_init_crt(&vic->crt, desc);
+    for (int i = 0; i < 16; i++) {
+        vic->colors[i] = desc->index8_buffer ? (0xFF000000 | (uint32_t)i) : _m6569_colors[i];
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int j = 0; j < 8; j++) {
+            vic->pixel_masks[i][j] = (i & (0x80>>j)) ? 0xFFFFFFFF : 0;
+        }
+    }
     vic->mem.fetch_cb = desc->fetch_cb;
     vic->mem.user_data = desc->user_data;
 }
@@ -679,34 +713,34 @@ uint64_t m6569_iorq(m6569_t* vic, uint64_t pins) {
                 case 0x20:
                     /* border color */
                     vic->brd.bc_index = data & 0xF;
-                    vic->brd.bc_rgba8 = _m6569_colors[data & 0xF];
+                    vic->brd.bc_rgba8 = vic->colors[data & 0xF];
                     break;
                 case 0x21: case 0x22:
                     /* background colors (alpha bits 0 because these count as MCM BG colors) */
                     vic->gunit.bg_index[r_addr-0x21] = data & 0xF;
-                    vic->gunit.bg_rgba8[r_addr-0x21] = _m6569_colors[data & 0xF] & 0x00FFFFFF;
+                    vic->gunit.bg_rgba8[r_addr-0x21] = vic->colors[data & 0xF] & 0x00FFFFFF;
                     break;
                 case 0x23: case 0x24:
                     /* background colors (alpha bits 1 because these count as MCM FG colors) */
                     vic->gunit.bg_index[r_addr-0x21] = data & 0xF;
-                    vic->gunit.bg_rgba8[r_addr-0x21] = _m6569_colors[data & 0xF];
+                    vic->gunit.bg_rgba8[r_addr-0x21] = vic->colors[data & 0xF];
                     break;
                 case 0x25:
                     /* sprite multicolor 0 */
                     for (int i = 0; i < 8; i++) {
-                        vic->sunit.colors[i][1] = _m6569_colors[data & 0xF] & 0x00FFFFFF;
+                        vic->sunit.colors[i][1] = vic->colors[data & 0xF] & 0x00FFFFFF;
                     }
                     break;
                 case 0x26:
                     /* sprite multicolor 1*/
                     for (int i = 0; i < 8; i++) {
-                        vic->sunit.colors[i][3] = _m6569_colors[data & 0xF] & 0x00FFFFFF;
+                        vic->sunit.colors[i][3] = vic->colors[data & 0xF] & 0x00FFFFFF;
                     }
                     break;
                 case 0x27: case 0x28: case 0x29: case 0x2A: 
                 case 0x2B: case 0x2C: case 0x2D: case 0x2E:
                     /* sprite main color */
-                    vic->sunit.colors[r_addr-0x27][2] = _m6569_colors[data & 0xF] & 0x00FFFFFF;
+                    vic->sunit.colors[r_addr-0x27][2] = vic->colors[data & 0xF] & 0x00FFFFFF;
                     break;
             }
             if (write) {
@@ -752,6 +786,50 @@ static inline void _m6569_gunit_tick(m6569_t* vic, uint8_t g_data) {
     vic->gunit.shift <<= 1;
 }
 
+/* Tick the graphics sequencer 8 times at once, this has the same
+   effect as 8x _m6569_gunit_tick(). Returns the 8 output pixels (MSB first),
+   the pixels before the shifter reload (at pixel 'count') are colored
+   by c_data[0], the remaining pixels by c_data[1]. The counter is back
+   at its start value after 8 ticks.
+*/
+static inline uint8_t _m6569_gunit_tick8(m6569_t* vic, uint8_t g_data, uint16_t* c_data) {
+    m6569_graphics_unit_t* gu = &vic->gunit;
+    const int k = gu->count;
+    const uint8_t reload = (uint8_t)(gu->shift << k) | g_data;
+    const uint8_t bits = (gu->shift & (uint8_t)(0xFF00>>k)) | (reload >> k);
+    c_data[0] = gu->c_data;
+    gu->c_data = gu->enabled ? vic->vm.line[vic->vm.vmli] : 0;
+    c_data[1] = gu->c_data;
+    gu->outp = (uint8_t)(reload << (7 - k));
+    /* outp2 was last updated at the last tick with an odd counter */
+    gu->outp2 = (k & 1) ? gu->outp : (uint8_t)(reload << (6 - k));
+    gu->shift = (uint8_t)(reload << (8 - k));
+    return bits;
+}
+
+/* foreground and background color for the hires modes 0, 2 and 4 (black for invalid modes) */
+static inline void _m6569_gunit_hires_colors(m6569_t* vic, uint8_t mode, uint16_t c_data, uint32_t* fg, uint32_t* bg) {
+    switch (mode) {
+        case 0:
+            *fg = vic->colors[(c_data>>8) & 0xF];
+            *bg = vic->gunit.bg_rgba8[0];
+            break;
+        case 2:
+            *fg = vic->colors[(c_data>>4) & 0xF];
+            *bg = vic->colors[c_data & 0xF];
+            break;
+        case 4:
+            *fg = vic->colors[(c_data>>8) & 0xF];
+            *bg = vic->gunit.bg_rgba8[(c_data>>6) & 3];
+            break;
+        default:
+            *fg = *bg = 0;
+            break;
+    }
+    *fg |= 0xFF000000;
+    *bg |= 0xFF000000;
+}
+
 /* 
     graphics sequencer decoding functions for 1 pixel
 
@@ -763,7 +841,7 @@ static inline void _m6569_gunit_tick(m6569_t* vic, uint8_t g_data) {
 static inline uint32_t _m6569_gunit_decode_mode0(m6569_t* vic) {
     if (vic->gunit.outp & 0x80) {
         /* foreground color (alpha bits set) */
-        return _m6569_colors[(vic->gunit.c_data>>8)&0xF];
+        return vic->colors[(vic->gunit.c_data>>8)&0xF];
     }
     else {
         /* background color (alpha bits clear) */
@@ -773,7 +851,7 @@ static inline uint32_t _m6569_gunit_decode_mode0(m6569_t* vic) {
 
 static inline uint32_t _m6569_gunit_decode_mode1(m6569_t* vic) {
     /* only seven colors in multicolor mode */
-    const uint32_t fg = _m6569_colors[(vic->gunit.c_data>>8) & 0x7];
+    const uint32_t fg = vic->colors[(vic->gunit.c_data>>8) & 0x7];
     if (vic->gunit.c_data & (1<<11)) {
         /* outp2 is only updated every 2 ticks */
         uint8_t bits = ((vic->gunit.outp2)>>6) & 3;
@@ -809,11 +887,11 @@ static inline uint32_t _m6569_gunit_decode_mode1(m6569_t* vic) {
 static inline uint32_t _m6569_gunit_decode_mode2(m6569_t* vic) {
     if (vic->gunit.outp & 0x80) {
         /* foreground pixel */
-        return _m6569_colors[(vic->gunit.c_data >> 4) & 0xF];
+        return vic->colors[(vic->gunit.c_data >> 4) & 0xF];
     }
     else {
         /* background pixel (alpha bits must be clear for multiplexer) */
-        return _m6569_colors[vic->gunit.c_data & 0xF] & 0x00FFFFFF;
+        return vic->colors[vic->gunit.c_data & 0xF] & 0x00FFFFFF;
     }
 }
 
@@ -829,16 +907,16 @@ static inline uint32_t _m6569_gunit_decode_mode3(m6569_t* vic) {
     */
     switch ((bits>>6)&3) {
         case 0:     return vic->gunit.bg_rgba8[0]; break;
-        case 1:     return _m6569_colors[(vic->gunit.c_data>>4) & 0xF] & 0x00FFFFFF; break;
-        case 2:     return _m6569_colors[vic->gunit.c_data & 0xF]; break;
-        default:    return _m6569_colors[(vic->gunit.c_data>>8) & 0xF]; break;
+        case 1:     return vic->colors[(vic->gunit.c_data>>4) & 0xF] & 0x00FFFFFF; break;
+        case 2:     return vic->colors[vic->gunit.c_data & 0xF]; break;
+        default:    return vic->colors[(vic->gunit.c_data>>8) & 0xF]; break;
     }
 }
 
 static inline uint32_t _m6569_gunit_decode_mode4(m6569_t* vic) {
     if (vic->gunit.outp & 0x80) {
         /* foreground color as usual bits 8..11 of c_data */
-        return _m6569_colors[(vic->gunit.c_data>>8) & 0xF];
+        return vic->colors[(vic->gunit.c_data>>8) & 0xF];
     }
     else {
         /* bg color selected by bits 6 and 7 of c_data */
@@ -891,6 +969,7 @@ static inline void _m6569_sunit_start(m6569_t* vic) {
         /* NOTE: the following behaviour differes from the recipe */
         if (!su->dma_enabled[i]) {
             su->disp_enabled[i] = false;
+            su->disp_mask &= ~mask;
         }
     }
 }
@@ -907,6 +986,7 @@ static inline void _m6569_sunit_update_mc_disp_enable(m6569_t* vic) {
         su->mc[i] = su->mc_base[i];
         if (su->dma_enabled[i] && ((vic->rs.v_count & 0xFF) == vic->reg.mxy[i][1])) {
             su->disp_enabled[i] = true;
+            su->disp_mask |= (1<<i);
         }
     }
 }
@@ -1127,6 +1207,33 @@ static inline void _m6569_decode_pixels(m6569_t* vic, uint8_t g_data, uint32_t*
     uint32_t brd_color = vic->brd.main ? vic->brd.bc_rgba8 : vic->gunit.bg_rgba8[0];
     const uint8_t mdp = vic->reg.mdp;
     const uint8_t mode = vic->gunit.mode;
+
+    /* fast path for lines without sprites, unless in a multicolor mode:
+       no priority multiplexing or collision checks, and the graphics
+       sequencer output is expanded through a table
+    */
+    if ((0 == su->disp_mask) && (brd || ((mode != 1) && (mode != 3)))) {
+        uint16_t c_data[2];
+        const uint8_t bits = _m6569_gunit_tick8(vic, g_data, c_data);
+        if (brd) {
+            for (int i = 0; i < 8; i++) {
+                dst[i] = brd_color;
+            }
+        }
+        else {
+            uint32_t fg[2], bg[2];
+            _m6569_gunit_hires_colors(vic, mode, c_data[0], &fg[0], &bg[0]);
+            _m6569_gunit_hires_colors(vic, mode, c_data[1], &fg[1], &bg[1]);
+            const uint32_t* mask = vic->pixel_masks[bits];
+            const int k = vic->gunit.count;
+            for (int i = 0; i < 8; i++) {
+                const int n = (i >= k) ? 1 : 0;
+                dst[i] = bg[n] ^ ((fg[n] ^ bg[n]) & mask[i]);
+            }
+        }
+        return;
+    }
+
     uint32_t bmc = 0;
     for (int i = 0; i < 8; i++) {
         uint32_t sc = _m6569_sunit_decode(vic, hpos);
@@ -1174,6 +1281,28 @@ static void _m6569_decode_pixels_debug(m6569_t* vic, uint8_t g_data, bool ba_pin
     }
 }
 
+/* write 8 decoded pixels to the framebuffer, and flag the line as dirty if any changed */
+static inline void _m6569_store_pixels(m6569_t* vic, const uint32_t* src, int y, int offset) {
+    uint32_t diff = 0;
+    if (vic->crt.rgba8_buffer) {
+        uint32_t* dst = vic->crt.rgba8_buffer + offset;
+        for (int i = 0; i < 8; i++) {
+            diff |= dst[i] ^ src[i];
+            dst[i] = src[i];
+        }
+    }
+    else {
+        uint8_t* dst = vic->crt.index8_buffer + offset;
+        for (int i = 0; i < 8; i++) {
+            diff |= dst[i] ^ (uint8_t)src[i];
+            dst[i] = (uint8_t) src[i];
+        }
+    }
+    if (diff) {
+        mem_dirty_row(vic->crt.dirty_rows, y);
+    }
+}
+
 /*
     (see 3.7.2 in http://www.zimmers.net/cbmpics/cbm/c64/vic-ii.txt)
 
@@ -1623,23 +1752,32 @@ uint64_t m6569_tick(m6569_t* vic, uint64_t pins) {
     }
 
     /*--- decode pixels into framebuffer -------------------------------------*/
-    if (vic->crt.rgba8_buffer) {
-        int x, y, w;
+    if (vic->crt.rgba8_buffer || vic->crt.index8_buffer) {
+        /* in indexed mode, color indices are in the low byte and the
+           debug visualization isn't tinted
+        */
+        int x = -1, y = 0, w = 0;
         if (vic->debug_vis) {
             x = vic->rs.h_count;
             y = vic->rs.v_count;
             w = _M6569_HTOTAL + 1;
-            uint32_t* dst = vic->crt.rgba8_buffer + (y * w + x) * 8;;
-            _m6569_decode_pixels_debug(vic, g_data, 0 != (pins & M6569_BA), dst, vic->rs.h_count);
         }
         else if ((vic->crt.x >= vic->crt.vis_x0) && (vic->crt.x < vic->crt.vis_x1) &&
                  (vic->crt.y >= vic->crt.vis_y0) && (vic->crt.y < vic->crt.vis_y1))
         {
-            const int x = vic->crt.x - vic->crt.vis_x0;
-            const int y = vic->crt.y - vic->crt.vis_y0;
-            const int w = vic->crt.vis_w;
-            uint32_t* dst = vic->crt.rgba8_buffer + (y * w + x) * 8;;
-            _m6569_decode_pixels(vic, g_data, dst, vic->rs.h_count);
+            x = vic->crt.x - vic->crt.vis_x0;
+            y = vic->crt.y - vic->crt.vis_y0;
+            w = vic->crt.vis_w;
+        }
+        if (x >= 0) {
+            uint32_t tmp[8];
+            if (vic->debug_vis && vic->crt.rgba8_buffer) {
+                _m6569_decode_pixels_debug(vic, g_data, 0 != (pins & M6569_BA), tmp, vic->rs.h_count);
+            }
+            else {
+                _m6569_decode_pixels(vic, g_data, tmp, vic->rs.h_count);
+            }
+            _m6569_store_pixels(vic, tmp, y, (y * w + x) * 8);
         }
     }
     vic->vm.vmli = vic->vm.next_vmli;
@@ -1663,4 +1801,19 @@ uint32_t m6569_color(int i) {
     CHIPS_ASSERT((i >= 0) && (i < 16));
     return _m6569_colors[i];
 }
+
+int m6569_palette(m6569_t* vic, uint32_t* rgba8, int max_colors) {
+    CHIPS_ASSERT(vic && rgba8);
+    int num = (max_colors < 16) ? max_colors : 16;
+    for (int i = 0; i < num; i++) {
+        rgba8[i] = _m6569_colors[i];
+    }
+    return num;
+}
+
+int m6569_dirty_rows(m6569_t* vic, uint32_t* bits, int max_rows) {
+    CHIPS_ASSERT(vic && bits);
+    int h = m6569_display_height(vic);
+    return mem_take_dirty_rows(vic->crt.dirty_rows, h, bits, max_rows);
+}
 #endif /* CHIPS_IMPL */
@@ -284,8 +284,6 @@ static const uint8_t _m6581_env_gen_dr_divisors[256] = {
     1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1    
 };
 
-static float _m6581_cutoff_freq[2048];
-
 static void _m6581_init_voice(m6581_voice_t* v) {
     memset(v, 0, sizeof(*v));
     v->noise_shift = 0x007FFFFC;
@@ -293,12 +291,14 @@ static void _m6581_init_voice(m6581_voice_t* v) {
     v->env_counter = 0x7FFF;
 }
 
-static void _m6581_init_cutoff_table() {
-    for (int i = 0; i < 2048; i++) {
-        float x = i / 8.0f;
-        float cf = -0.0156f * x * x + 48.473f * x - 45.074f;
-        _m6581_cutoff_freq[i] = cf <= 0 ? 0 : cf;
-    }
+/* map the 11-bit cutoff register value to a filter cutoff frequency,
+   this is only evaluated when the cutoff registers are written, so there's
+   no need for a (shared, mutable) lookup table
+*/
+static float _m6581_cutoff_freq(int cutoff) {
+    float x = cutoff / 8.0f;
+    float cf = -0.0156f * x * x + 48.473f * x - 45.074f;
+    return cf <= 0 ? 0 : cf;
 }
 
 static void _m6581_set_filter_cutoff(m6581_filter_t*);
@@ -324,7 +324,6 @@ void m6581_init(m6581_t* sid, const m6581_desc_t* desc) {
     for (int i = 0; i < 3; i++) {
         _m6581_init_voice(&sid->voice[i]);
     }
-    _m6581_init_cutoff_table();
     _m6581_init_filter(&sid->filter, sid->sound_hz);
 }
 
@@ -566,7 +565,7 @@ static inline void _m6581_voice_sync(m6581_t* sid, int voice_index) {
 /*--- FILTER IMPLEMENTATION ---------------------------------------------------*/
 static void _m6581_set_filter_cutoff(m6581_filter_t* f) {
     const float freq_domain_div_coeff = 2.0f * ((float)M_PI) * 1.048576f;
-    f->w0 = (int) (_m6581_cutoff_freq[f->cutoff] * freq_domain_div_coeff);
+    f->w0 = (int) (_m6581_cutoff_freq(f->cutoff) * freq_domain_div_coeff);
     const float nyquist_freq = (float) f->nyquist_freq;
     const float max_cutoff = nyquist_freq > 16000.0f ? 16000.0f : nyquist_freq;
     const int w0_max_dt = (int)(max_cutoff * freq_domain_div_coeff);
@@ -267,7 +267,7 @@ uint64_t mc6845_tick(mc6845_t* mc6845);
 #endif
 
 /* some registers are not full width */
-static uint8_t _mc6845_mask[0x20] = {
+static const uint8_t _mc6845_mask[0x20] = {
     0xFF,       /* HTOTAL */
     0xFF,       /* HDISPLAYED */
     0xFF,       /* HSYNCPOS */
@@ -290,7 +290,7 @@ static uint8_t _mc6845_mask[0x20] = {
 };
 
 /* readable/writable per chip type and register (1: writable, 2: readable, 3: read/write) */
-static uint8_t _mc6845_rw[MC6845_NUM_TYPES][0x20] = {
+static const uint8_t _mc6845_rw[MC6845_NUM_TYPES][0x20] = {
     { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 3, 3, 2, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
     { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 2, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 },
     { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 2, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
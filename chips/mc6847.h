@@ -28,6 +28,33 @@
            CSS -->|           |
                   +-----------+
 
+    The visible scanline is expanded through small lookup tables which map
+    4 bits of video memory data to 4 or 8 RGBA8 pixels (one table per mode
+    group and CSS setting, plus one for the semigraphics colors). The
+    tables are rebuilt at the start of a frame if the colors in the
+    mc6847_t struct have been changed. Groups of 4 pixels are copied
+    with SSE2 or NEON stores where available.
+
+    Instead of an RGBA8 framebuffer, an 8-bit framebuffer can be provided
+    in index8_buffer, this receives color indices into the palette returned
+    by mc6847_palette() (indices 0..7 are the graphics mode palette, 8 is
+    black, and 9..12 are the alphanumeric green, dark green, orange and
+    dark orange).
+
+    Each decoded line is compared with the line already in the framebuffer,
+    and only written if it changed. Changed display lines are flagged
+    in a dirty-row bitmap which can be fetched (and cleared) with
+    mc6847_dirty_rows(), so that only those lines need to be uploaded
+    to a texture.
+
+    Video memory is either read one byte at a time through the fetch_cb
+    pin callback (which may also drive the INV, AS and INTEXT pins from the
+    fetched byte), or, if the much cheaper fetch_row_cb is provided, a
+    whole row of video memory is read through a single pointer. In the
+    latter case the per-byte mode pins are looked up in a table which is
+    built from the inv_bits, as_bits and intext_bits desc members (the
+    data bus bits which are wired to those pins).
+
     FIXME: documentation
 
     ## zlib/libpng license
@@ -185,15 +212,22 @@ extern "C" {
 
 /* horizontal border width */
 #define MC6847_BORDER_PIXELS ((MC6847_DISPLAY_WIDTH-MC6847_IMAGE_WIDTH)/2)
+/* number of 32-bit words in the dirty-row bitmap */
+#define MC6847_DIRTY_WORDS ((MC6847_DISPLAY_HEIGHT+31)/32)
 
 /* the MC6847 is always clocked at 3.579 MHz */
 #define MC6847_TICK_HZ (3579545)
 
+/* number of colors in the palette for the indexed framebuffer */
+#define MC6847_NUM_COLORS (13)
+
 /* fixed point precision for more precise error accumulation */
 #define MC6847_FIXEDPOINT_SCALE (16)
 
 /* a memory-fetch callback, used to read video memory bytes into the MC6847 */
 typedef uint64_t (*mc6847_fetch_t)(uint64_t pins, void* user_data);
+/* an optional row-fetch callback, return pointer to num_bytes of video memory at addr, or 0 to use fetch_cb */
+typedef const uint8_t* (*mc6847_fetch_row_t)(uint16_t addr, int num_bytes, void* user_data);
 
 /* the mc6847 setup parameters */
 typedef struct {
@@ -203,8 +237,18 @@ typedef struct {
     uint32_t* rgba8_buffer;
     /* size of rgba8_buffer in bytes (must be at least 320*244*4=312320 bytes) */
     uint32_t rgba8_buffer_size;
+    /* alternatively, an 8-bit color index framebuffer (see mc6847_palette()) */
+    uint8_t* index8_buffer;
+    /* size of index8_buffer in bytes (must be at least 320*243 bytes) */
+    uint32_t index8_buffer_size;
     /* memory-fetch callback */
     mc6847_fetch_t fetch_cb;
+    /* optional row-fetch callback (fetch_cb can be zero if this never returns a null pointer) */
+    mc6847_fetch_row_t fetch_row_cb;
+    /* data bus bits wired to the INV, AS and INTEXT pins (only used with fetch_row_cb) */
+    uint8_t inv_bits;
+    uint8_t as_bits;
+    uint8_t intext_bits;
     /* optional user-data for the fetch callback */
     void* user_data;
 } mc6847_desc_t;
@@ -227,6 +271,18 @@ typedef struct {
     uint32_t alnum_orange;
     uint32_t alnum_dark_orange;
 
+    /* pixel expansion tables (indexed by CSS and a 4-bit data nibble) */
+    uint32_t lut_rg6[2][16][4];     /* RG6: 1 bit per pixel */
+    uint32_t lut_rg[2][16][8];      /* RG1..RG3: 1 bit per 2 pixels */
+    uint32_t lut_cg[2][16][4];      /* CG2..CG6: 2 bits per 2 pixels */
+    uint32_t lut_cg1[2][16][8];     /* CG1: 2 bits per 4 pixels */
+    uint32_t lut_alnum[2][16][4];   /* alphanumeric: 1 bit per pixel */
+    uint32_t lut_sg[8][4][8];       /* semigraphics: color and 2 bits to 8 pixels */
+    /* the colors the tables were built from, to detect changes */
+    uint32_t lut_colors[MC6847_NUM_COLORS];
+    /* the output value for each color (RGBA8, or the color index) */
+    uint32_t lut_pixel[MC6847_NUM_COLORS];
+
     /* internal counters */
     int h_count;
     int h_sync_start;
@@ -236,10 +292,18 @@ typedef struct {
 
     /* the fetch callback function */
     mc6847_fetch_t fetch_cb;
+    /* the row-fetch callback function, and the mode pins for each data byte */
+    mc6847_fetch_row_t fetch_row_cb;
+    uint64_t data_pins_mask;
+    uint64_t data_pins[256];
     /* optional user-data for the fetch-callback */
     void* user_data;
     /* pointer to RGBA8 buffer where decoded video image is written too */
     uint32_t* rgba8_buffer;
+    /* or alternatively the 8-bit color index buffer */
+    uint8_t* index8_buffer;
+    /* one bit per display line which changed since the last mc6847_dirty_rows() */
+    uint32_t dirty_rows[MC6847_DIRTY_WORDS];
 } mc6847_t;
 
 /* initialize a new mc6847_t instance */
@@ -250,6 +314,10 @@ void mc6847_reset(mc6847_t* vdg);
 void mc6847_ctrl(mc6847_t* vdg, uint64_t pins, uint64_t mask);
 /* tick the mc6847_t instance, this will call the fetch_cb and generate the image */
 void mc6847_tick(mc6847_t* vdg);
+/* copy the RGBA8 colors for the index8_buffer color indices, returns number of colors */
+int mc6847_palette(mc6847_t* vdg, uint32_t* rgba8, int max_colors);
+/* copy and clear the dirty-row bitmap (bit y&31 of word y>>5 for display line y), returns number of lines */
+int mc6847_dirty_rows(mc6847_t* vdg, uint32_t* bits, int max_rows);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -258,26 +326,55 @@ void mc6847_tick(mc6847_t* vdg);
 /*--- IMPLEMENTATION ---------------------------------------------------------*/
 #ifdef CHIPS_IMPL
 #include <string.h>
+#include "mem.h" /* dirty-row helpers */
 #ifndef CHIPS_ASSERT
     #include <assert.h>
     #define CHIPS_ASSERT(c) assert(c)
 #endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+    #include <emmintrin.h>
+    #define _MC6847_SSE2 (1)
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #include <arm_neon.h>
+    #define _MC6847_NEON (1)
+#endif
+
+static void _mc6847_build_luts(mc6847_t* vdg);
 
 #define _MC6847_CLAMP(x) ((x)>255?255:(x))
 #define _MC6847_RGBA(r,g,b) (0xFF000000|_MC6847_CLAMP((r*4)/3)|(_MC6847_CLAMP((g*4)/3)<<8)|(_MC6847_CLAMP((b*4)/3)<<16))
 
 void mc6847_init(mc6847_t* vdg, const mc6847_desc_t* desc) {
     CHIPS_ASSERT(vdg && desc);
-    CHIPS_ASSERT(desc->rgba8_buffer);
-    CHIPS_ASSERT(desc->rgba8_buffer_size >= (MC6847_DISPLAY_WIDTH*MC6847_DISPLAY_HEIGHT*sizeof(uint32_t)));
-    CHIPS_ASSERT(desc->fetch_cb);
+    if (desc->index8_buffer) {
+        CHIPS_ASSERT(desc->index8_buffer_size >= (MC6847_DISPLAY_WIDTH*MC6847_DISPLAY_HEIGHT));
+    }
+    else {
+        CHIPS_ASSERT(desc->rgba8_buffer);
+        CHIPS_ASSERT(desc->rgba8_buffer_size >= (MC6847_DISPLAY_WIDTH*MC6847_DISPLAY_HEIGHT*sizeof(uint32_t)));
+    }
+    CHIPS_ASSERT(desc->fetch_cb || desc->fetch_row_cb);
     CHIPS_ASSERT((desc->tick_hz > 0) && (desc->tick_hz < MC6847_TICK_HZ));
 
     memset(vdg, 0, sizeof(*vdg));
-    vdg->rgba8_buffer = desc->rgba8_buffer;
+    vdg->rgba8_buffer = desc->index8_buffer ? 0 : desc->rgba8_buffer;
+    vdg->index8_buffer = desc->index8_buffer;
     vdg->fetch_cb = desc->fetch_cb;
+    vdg->fetch_row_cb = desc->fetch_row_cb;
     vdg->user_data = desc->user_data;
 
+    /* mode pin lookup table for row-fetches */
+    if (desc->inv_bits) { vdg->data_pins_mask |= MC6847_INV; }
+    if (desc->as_bits) { vdg->data_pins_mask |= MC6847_AS; }
+    if (desc->intext_bits) { vdg->data_pins_mask |= MC6847_INTEXT; }
+    for (int i = 0; i < 256; i++) {
+        uint64_t p = 0;
+        if (i & desc->inv_bits) { p |= MC6847_INV; }
+        if (i & desc->as_bits) { p |= MC6847_AS; }
+        if (i & desc->intext_bits) { p |= MC6847_INTEXT; }
+        vdg->data_pins[i] = p;
+    }
+
     /* compute counter periods, the MC6847 is always clocked at 3.579 MHz,
        and the frequency of how the tick function is called must be 
        communicated to the init function
@@ -330,6 +427,7 @@ void mc6847_init(mc6847_t* vdg, const mc6847_desc_t* desc) {
     vdg->alnum_dark_green = 0xFF002400;
     vdg->alnum_orange = _MC6847_RGBA(140, 31, 11);
     vdg->alnum_dark_orange = 0xFF000E22;
+    _mc6847_build_luts(vdg);
 }
 
 void mc6847_reset(mc6847_t* vdg) {
@@ -415,29 +513,140 @@ static const uint8_t _mc6847_font[64 * 12] = {
 };
 
 
+/* gather the colors the lookup tables depend on */
+static void _mc6847_lut_colors(mc6847_t* vdg, uint32_t* colors) {
+    for (int i = 0; i < 8; i++) {
+        colors[i] = vdg->palette[i];
+    }
+    colors[8] = vdg->black;
+    colors[9] = vdg->alnum_green;
+    colors[10] = vdg->alnum_dark_green;
+    colors[11] = vdg->alnum_orange;
+    colors[12] = vdg->alnum_dark_orange;
+}
+
+/* build the pixel expansion tables from the current colors */
+static void _mc6847_build_luts(mc6847_t* vdg) {
+    _mc6847_lut_colors(vdg, vdg->lut_colors);
+    /* in indexed mode, the tables contain color indices instead of RGBA8 colors */
+    const uint32_t* px = vdg->lut_pixel;
+    for (int i = 0; i < MC6847_NUM_COLORS; i++) {
+        vdg->lut_pixel[i] = vdg->index8_buffer ? (uint32_t)i : vdg->lut_colors[i];
+    }
+    const uint32_t black = px[8];
+    for (int css = 0; css < 2; css++) {
+        const uint32_t fg = css ? px[4] : px[0];
+        const uint32_t alnum_fg = css ? px[11] : px[9];
+        const uint32_t alnum_bg = css ? px[12] : px[10];
+        for (int n = 0; n < 16; n++) {
+            for (int p = 0; p < 4; p++) {
+                /* 1 bit per pixel, leftmost pixel in the highest bit */
+                const bool bit = 0 != (n & (8>>p));
+                vdg->lut_rg6[css][n][p] = bit ? fg : black;
+                vdg->lut_rg[css][n][p*2] = vdg->lut_rg[css][n][p*2+1] = bit ? fg : black;
+                vdg->lut_alnum[css][n][p] = bit ? alnum_fg : alnum_bg;
+            }
+            for (int p = 0; p < 2; p++) {
+                /* 2 bits per pixel, CSS selects the upper half of the palette */
+                const uint32_t c = px[((n >> (2-p*2)) & 3) + css*4];
+                vdg->lut_cg[css][n][p*2] = vdg->lut_cg[css][n][p*2+1] = c;
+                for (int d = 0; d < 4; d++) {
+                    vdg->lut_cg1[css][n][p*4+d] = c;
+                }
+            }
+        }
+    }
+    for (int ci = 0; ci < 8; ci++) {
+        for (int m = 0; m < 4; m++) {
+            for (int p = 0; p < 8; p++) {
+                /* 2 horizontal blocks of 4 pixels each */
+                const bool bit = 0 != (m & ((p < 4) ? 2 : 1));
+                vdg->lut_sg[ci][m][p] = bit ? px[ci] : black;
+            }
+        }
+    }
+}
+
+/* rebuild the lookup tables if any color has changed */
+static void _mc6847_check_luts(mc6847_t* vdg) {
+    uint32_t colors[MC6847_NUM_COLORS];
+    _mc6847_lut_colors(vdg, colors);
+    if (0 != memcmp(colors, vdg->lut_colors, sizeof(colors))) {
+        _mc6847_build_luts(vdg);
+    }
+}
+
+/* copy a group of 4 pixels */
+static inline void _mc6847_copy4(uint32_t* dst, const uint32_t* src) {
+    #if defined(_MC6847_SSE2)
+        _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+    #elif defined(_MC6847_NEON)
+        vst1q_u32(dst, vld1q_u32(src));
+    #else
+        dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2]; dst[3] = src[3];
+    #endif
+}
+
+/* copy a group of 8 pixels */
+static inline void _mc6847_copy8(uint32_t* dst, const uint32_t* src) {
+    _mc6847_copy4(dst, src);
+    _mc6847_copy4(dst + 4, src + 4);
+}
+
+/* fetch a row of video memory through the row-fetch callback (may return 0) */
+static inline const uint8_t* _mc6847_fetch_row(mc6847_t* vdg, uint16_t addr, int num_bytes) {
+    if (vdg->fetch_row_cb) {
+        const uint8_t* row = vdg->fetch_row_cb(addr, num_bytes, vdg->user_data);
+        CHIPS_ASSERT(row || vdg->fetch_cb);
+        return row;
+    }
+    return 0;
+}
+
+/* fetch the byte at addr, either from a fetched row, or through the fetch callback */
+static inline uint64_t _mc6847_fetch(mc6847_t* vdg, uint64_t pins, const uint8_t* row, int x, uint16_t addr) {
+    MC6847_SET_ADDR(pins, addr);
+    if (row) {
+        const uint8_t data = row[x];
+        MC6847_SET_DATA(pins, data);
+        return (pins & ~vdg->data_pins_mask) | vdg->data_pins[data];
+    }
+    else {
+        return vdg->fetch_cb(pins, vdg->user_data);
+    }
+}
+
 static inline uint32_t _mc6847_border_color(mc6847_t* vdg, uint64_t pins) {
     if (pins & MC6847_AG) {
         /* a graphics mode, either green or buff, depending on CSS pin */
-        return (pins & MC6847_CSS) ? vdg->palette[4] : vdg->palette[0];
+        return (pins & MC6847_CSS) ? vdg->lut_pixel[4] : vdg->lut_pixel[0];
     }
     else {
         /* alphanumeric or semigraphics mode, always black */
-        return vdg->black;
+        return vdg->lut_pixel[8];
     }
 }
 
+/* write a decoded line to the framebuffer if it differs from the previous frame */
+static void _mc6847_store_row(mc6847_t* vdg, int y, const uint32_t* row) {
+    void* buffer = vdg->index8_buffer ? (void*)vdg->index8_buffer : (void*)vdg->rgba8_buffer;
+    mem_store_pixels(vdg->dirty_rows, y, buffer, 0 != vdg->index8_buffer, y * MC6847_DISPLAY_WIDTH, row, MC6847_DISPLAY_WIDTH);
+}
+
 static void _mc6847_decode_border(mc6847_t* vdg, uint64_t pins, int y) {
-    uint32_t* dst = &(vdg->rgba8_buffer[y * MC6847_DISPLAY_WIDTH]);
+    uint32_t row_buf[MC6847_DISPLAY_WIDTH];
     uint32_t c = _mc6847_border_color(vdg, pins);
     for (int x = 0; x < MC6847_DISPLAY_WIDTH; x++) {
-        *dst++ = c;
+        row_buf[x] = c;
     }
+    _mc6847_store_row(vdg, y, row_buf);
 }
 
 static uint64_t _mc6847_decode_scanline(mc6847_t* vdg, uint64_t pins, int y) {
-    uint32_t* dst = &(vdg->rgba8_buffer[(y+MC6847_TOP_BORDER_LINES) * MC6847_DISPLAY_WIDTH]);
+    /* decode into a temporary row, which is then compared with the framebuffer */
+    uint32_t row_buf[MC6847_DISPLAY_WIDTH];
+    uint32_t* dst = row_buf;
     uint32_t bc = _mc6847_border_color(vdg, pins);
-    void* ud = vdg->user_data;
 
     /* left border */
     for (int i = 0; i < MC6847_BORDER_PIXELS; i++) {
@@ -445,6 +654,7 @@ static uint64_t _mc6847_decode_scanline(mc6847_t* vdg, uint64_t pins, int y) {
     }
 
     /* visible scanline */
+    const int css = (pins & MC6847_CSS) ? 1 : 0;
     if (pins & MC6847_AG) {
         /* one of the 8 graphics modes */
         uint8_t sub_mode = (uint8_t) ((pins & (MC6847_GM2|MC6847_GM1)) / MC6847_GM1);
@@ -456,20 +666,22 @@ static uint64_t _mc6847_decode_scanline(mc6847_t* vdg, uint64_t pins, int y) {
                     10:    RG3, 128x192, 16 bytes per row
                     11:    RG6, 256x192, 32 bytes per row
             */
-            int dots_per_bit  = (sub_mode < 3) ? 2 : 1;
             int bytes_per_row = (sub_mode < 3) ? 16 : 32;
             int row_height = (pins & MC6847_GM2) ? 1 : (pins & MC6847_GM1) ? 2 : 3;
             uint16_t addr = (y / row_height) * bytes_per_row;
-            uint32_t fg_color = (pins & MC6847_CSS) ? vdg->palette[4] : vdg->palette[0];
+            const uint8_t* row = _mc6847_fetch_row(vdg, addr, bytes_per_row);
             for (int x = 0; x < bytes_per_row; x++) {
-                MC6847_SET_ADDR(pins, addr++);
-                pins = vdg->fetch_cb(pins, ud);
+                pins = _mc6847_fetch(vdg, pins, row, x, addr++);
                 uint8_t m = MC6847_GET_DATA(pins);
-                for (int p = 7; p >= 0; p--) {
-                    uint32_t c = ((m>>p) & 1) ? fg_color : vdg->black;
-                    for (int d = 0; d < dots_per_bit; d++) {
-                        *dst++ = c;
-                    }
+                if (sub_mode < 3) {
+                    _mc6847_copy8(dst, vdg->lut_rg[css][m>>4]);
+                    _mc6847_copy8(dst + 8, vdg->lut_rg[css][m & 15]);
+                    dst += 16;
+                }
+                else {
+                    _mc6847_copy4(dst, vdg->lut_rg6[css][m>>4]);
+                    _mc6847_copy4(dst + 4, vdg->lut_rg6[css][m & 15]);
+                    dst += 8;
                 }
             }
         }
@@ -482,20 +694,22 @@ static uint64_t _mc6847_decode_scanline(mc6847_t* vdg, uint64_t pins, int y) {
                     10: CG3, 128x96, 32 bytes per row
                     11: CG6, 128x192, 32 bytes per row
             */
-            uint32_t pal_offset = (pins & MC6847_CSS) ? 4 : 0;
-            int dots_per_2bit = (sub_mode == 0) ? 4 : 2;
             int bytes_per_row = (sub_mode == 0) ? 16 : 32;
             int row_height = (pins & MC6847_GM2) ? ((pins & MC6847_GM1) ? 1 : 2) : 3;
             uint16_t addr = (y / row_height) * bytes_per_row;
+            const uint8_t* row = _mc6847_fetch_row(vdg, addr, bytes_per_row);
             for (int x = 0; x < bytes_per_row; x++) {
-                MC6847_SET_ADDR(pins, addr++);
-                pins = vdg->fetch_cb(pins, ud);
+                pins = _mc6847_fetch(vdg, pins, row, x, addr++);
                 uint8_t m = MC6847_GET_DATA(pins);
-                for (int p = 6; p >= 0; p -= 2) {
-                    const uint32_t c = vdg->palette[((m>>p) & 3) + pal_offset];
-                    for (int d = 0; d < dots_per_2bit; d++) {
-                        *dst++ = c;
-                    }
+                if (sub_mode == 0) {
+                    _mc6847_copy8(dst, vdg->lut_cg1[css][m>>4]);
+                    _mc6847_copy8(dst + 8, vdg->lut_cg1[css][m & 15]);
+                    dst += 16;
+                }
+                else {
+                    _mc6847_copy4(dst, vdg->lut_cg[css][m>>4]);
+                    _mc6847_copy4(dst + 4, vdg->lut_cg[css][m & 15]);
+                    dst += 8;
                 }
             }
         }
@@ -510,15 +724,13 @@ static uint64_t _mc6847_decode_scanline(mc6847_t* vdg, uint64_t pins, int y) {
         /* bit shifters to extract a 2x2 or 2x3 semigraphics 2-bit stack */
         int shift_2x2 = (1 - (chr_y / 6))*2;
         int shift_2x3 = (2 - (chr_y / 4))*2;
-        uint32_t alnum_fg = (pins & MC6847_CSS) ? vdg->alnum_orange : vdg->alnum_green;
-        uint32_t alnum_bg = (pins & MC6847_CSS) ? vdg->alnum_dark_orange : vdg->alnum_dark_green;
+        const uint8_t* row = _mc6847_fetch_row(vdg, addr, 32);
         for (int x = 0; x < 32; x++) {
-            MC6847_SET_ADDR(pins, addr++);
-            pins = vdg->fetch_cb(pins, ud);
+            pins = _mc6847_fetch(vdg, pins, row, x, addr++);
             uint8_t chr = MC6847_GET_DATA(pins);
             if (pins & MC6847_AS) {
                 /* semigraphics mode */
-                uint32_t fg_color;
+                int color_index;
                 if (pins & MC6847_INTEXT) {
                     /*  2x3 semigraphics, 2 color sets at 4 colors (selected by CSS pin)
                         |C1|C0|L5|L4|L3|L2|L1|L0|
@@ -535,7 +747,7 @@ static uint64_t _mc6847_decode_scanline(mc6847_t* vdg, uint64_t pins, int y) {
                     /* extract the 2 horizontal bits from one of the 3 stacks */
                     m = (chr>>shift_2x3) & 3;
                     /* 2 bits of color, CSS bit selects upper or lower half of color palette */
-                    fg_color = vdg->palette[((chr>>6)&3) + ((pins&MC6847_CSS)?4:0)];
+                    color_index = ((chr>>6)&3) + css*4;
                 }
                 else {
                     /*  2x2 semigraphics, 8 colors + black
@@ -551,25 +763,23 @@ static uint64_t _mc6847_decode_scanline(mc6847_t* vdg, uint64_t pins, int y) {
                     /* extract the 2 horizontal bits from the upper or lower stack */
                     m = (chr>>shift_2x2) & 3;
                     /* 3 color bits directly point into the color palette */
-                    fg_color = vdg->palette[(chr>>4) & 7];
+                    color_index = (chr>>4) & 7;
                 }
                 /* write the horizontal pixel blocks (2 blocks @ 4 pixel each) */
-                for (int p = 1; p>=0; p--) {
-                    uint32_t c = (m & (1<<p)) ? fg_color : vdg->black;
-                    *dst++=c; *dst++=c; *dst++=c; *dst++=c;
-                }
+                _mc6847_copy8(dst, vdg->lut_sg[color_index][m]);
+                dst += 8;
             }
             else {
                 /*  alphanumeric mode
                     FIXME: INT_EXT (switch between internal and external font
                 */
-                uint8_t m = _mc6847_font[(chr&0x3F)*12 + chr_y];
+                m = _mc6847_font[(chr&0x3F)*12 + chr_y];
                 if (pins & MC6847_INV) {
                     m = ~m;
                 }
-                for (int p = 7; p >= 0; p--) {
-                    *dst++ = m & (1<<p) ? alnum_fg : alnum_bg;
-                }                
+                _mc6847_copy4(dst, vdg->lut_alnum[css][m>>4]);
+                _mc6847_copy4(dst + 4, vdg->lut_alnum[css][m & 15]);
+                dst += 8;
             }
         }
     }
@@ -579,6 +789,7 @@ static uint64_t _mc6847_decode_scanline(mc6847_t* vdg, uint64_t pins, int y) {
         *dst++ = bc;
     }
 
+    _mc6847_store_row(vdg, y + MC6847_TOP_BORDER_LINES, row_buf);
     return pins;
 }
 
@@ -621,6 +832,9 @@ void mc6847_tick(mc6847_t* vdg) {
         else if (vdg->l_count < MC6847_DISPLAY_END) {
             /* visible area */
             int y = vdg->l_count - MC6847_DISPLAY_START;
+            if (0 == y) {
+                _mc6847_check_luts(vdg);
+            }
             pins = _mc6847_decode_scanline(vdg, pins, y);
         }
         else if (vdg->l_count < MC6847_BOTTOM_BORDER_END) {
@@ -636,4 +850,20 @@ void mc6847_tick(mc6847_t* vdg) {
     vdg->pins = pins;
 }
 
+int mc6847_palette(mc6847_t* vdg, uint32_t* rgba8, int max_colors) {
+    CHIPS_ASSERT(vdg && rgba8);
+    uint32_t colors[MC6847_NUM_COLORS];
+    _mc6847_lut_colors(vdg, colors);
+    int num = (max_colors < MC6847_NUM_COLORS) ? max_colors : MC6847_NUM_COLORS;
+    for (int i = 0; i < num; i++) {
+        rgba8[i] = colors[i];
+    }
+    return num;
+}
+
+int mc6847_dirty_rows(mc6847_t* vdg, uint32_t* bits, int max_rows) {
+    CHIPS_ASSERT(vdg && bits);
+    return mem_take_dirty_rows(vdg->dirty_rows, MC6847_DISPLAY_HEIGHT, bits, max_rows);
+}
+
 # endif /* CHIPS_IMPL */
@@ -143,7 +143,8 @@
     void mem_write_range(mem_t* mem, uint16_t addr, const uint8_t* src, int num_bytes)
     ~~~
     A helper function to copy a range of bytes from host memory to a 16-bit
-    address range. This will do a series of mem_wr() calls. 
+    address range. This does one memcpy() per memory page touched, the
+    address wraps around at the end of the 64 KByte address range.
 
     ~~~C
     void mem_wr16(mem_t* mem, uint16_t addr, uint16_t data)
@@ -157,6 +158,43 @@
     A helper function to read a 16-bit value in little-endian format.
     This will do 2 calls to mem_rd().
 
+    ~~~C
+    void mem_dirty_row(uint32_t* dirty_rows, int y)
+    ~~~
+    Set the bit of display line y in a dirty-row bitmap (one bit per
+    line, 32 lines per word). The video chips and systems with a
+    xxx_dirty_rows() function keep their changed-line bitmap this way.
+
+    ~~~C
+    bool mem_store_pixels(uint32_t* dirty_rows, int y, void* buffer, bool indexed, int offset, const uint32_t* src, int num)
+    ~~~
+    Write num pixels to a pixel buffer at offset (in pixels), the buffer
+    is either RGBA8 or, if indexed is true, 8-bit color indices (the
+    source pixels are narrowed to 8 bits). If any pixel changed, line y
+    is flagged in the dirty-row bitmap and true is returned.
+
+    ~~~C
+    int mem_take_dirty_rows(uint32_t* dirty_rows, int num_rows, uint32_t* bits, int max_rows)
+    ~~~
+    Copy the dirty-row bits of the first min(num_rows, max_rows) lines
+    to bits and clear them in dirty_rows, returns the number of lines.
+
+    ~~~C
+    char mem_screen_char(uint8_t chr)
+    ~~~
+    Map a byte of an ASCII text screen to a printable character, 0 becomes
+    a space and anything outside 0x20..0x7E becomes '?'.
+
+    ~~~C
+    uint32_t mem_screen_text(const uint8_t* cells, int cols, int rows, char (*map)(uint8_t), char* buf, int buf_size, uint32_t* hash, uint32_t* changes)
+    ~~~
+    The common part of the xxx_screen_text() functions. Writes a cols x rows
+    grid of character cells to buf as newline-terminated lines (each cell
+    mapped through map, or used as is if map is NULL), the text is truncated
+    to buf_size-1 characters and always zero-terminated. If the FNV-1a hash
+    of the whole text differs from *hash, *hash is updated and *changes is
+    incremented, the function returns *changes.
+
     ## zlib/libpng license
 
     Copyright (c) 2018 Andre Weissflog
@@ -177,6 +215,7 @@
 #*/
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h> /* memcmp, memcpy */
 
 #ifdef __cplusplus
 extern "C" {
@@ -249,6 +288,80 @@ static inline uint16_t mem_rd16(mem_t* mem, uint16_t addr) {
     return (h<<8)|l;
 }
 
+/* flag a display line in a dirty-row bitmap */
+static inline void mem_dirty_row(uint32_t* dirty_rows, int y) {
+    dirty_rows[y>>5] |= 1U<<(y&31);
+}
+/* write pixels to a RGBA8 or 8-bit indexed pixel buffer, flags line y as dirty if they changed */
+static inline bool mem_store_pixels(uint32_t* dirty_rows, int y, void* buffer, bool indexed, int offset, const uint32_t* src, int num) {
+    uint32_t diff = 0;
+    if (indexed) {
+        uint8_t* dst = (uint8_t*)buffer + offset;
+        for (int i = 0; i < num; i++) {
+            diff |= dst[i] ^ (uint8_t)src[i];
+            dst[i] = (uint8_t) src[i];
+        }
+    }
+    else {
+        uint32_t* dst = (uint32_t*)buffer + offset;
+        diff = 0 != memcmp(dst, src, num * sizeof(uint32_t));
+        if (diff) {
+            memcpy(dst, src, num * sizeof(uint32_t));
+        }
+    }
+    if (diff) {
+        mem_dirty_row(dirty_rows, y);
+    }
+    return 0 != diff;
+}
+/* copy and clear the dirty-row bits of the first min(num_rows, max_rows) lines */
+static inline int mem_take_dirty_rows(uint32_t* dirty_rows, int num_rows, uint32_t* bits, int max_rows) {
+    int num = (max_rows < num_rows) ? max_rows : num_rows;
+    for (int i = 0; i < (num+31)/32; i++) {
+        uint32_t mask = ((i+1)*32 <= num) ? 0xFFFFFFFF : ((1U<<(num&31))-1);
+        bits[i] = dirty_rows[i] & mask;
+        dirty_rows[i] &= ~mask;
+    }
+    return num;
+}
+
+/* map an ASCII text screen byte to a printable character */
+static inline char mem_screen_char(uint8_t chr) {
+    if ((chr >= 0x20) && (chr < 0x7F)) {
+        return (char) chr;
+    }
+    else if (chr == 0) {
+        return ' ';
+    }
+    else {
+        return '?';
+    }
+}
+/* dump a character grid as text, counts changes of the text's hash */
+static inline uint32_t mem_screen_text(const uint8_t* cells, int cols, int rows, char (*map)(uint8_t), char* buf, int buf_size, uint32_t* hash, uint32_t* changes) {
+    uint32_t h = 0x811C9DC5;
+    int pos = 0;
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x <= cols; x++) {
+            char c = '\n';
+            if (x < cols) {
+                uint8_t chr = cells[y*cols + x];
+                c = map ? map(chr) : (char) chr;
+            }
+            h = (h ^ (uint8_t)c) * 0x01000193;
+            if (pos < (buf_size - 1)) {
+                buf[pos++] = c;
+            }
+        }
+    }
+    buf[pos] = 0;
+    if (h != *hash) {
+        *hash = h;
+        (*changes)++;
+    }
+    return *changes;
+}
+
 /* read a byte from a specific layer (slow!) */
 uint8_t mem_layer_rd(mem_t* mem, int layer, uint16_t addr);
 /* write a byte to a specific layer (slow!) */
@@ -364,8 +477,16 @@ uint8_t* mem_readptr(mem_t* m, uint16_t addr) {
 } 
 
 void mem_write_range(mem_t* m, uint16_t addr, const uint8_t* src, int num_bytes) {
-    for (int i = 0; i < num_bytes; i++) {
-        mem_wr(m, addr++, src[i]);
+    while (num_bytes > 0) {
+        /* copy up to the end of the current page */
+        int n = MEM_PAGE_SIZE - (addr & MEM_PAGE_MASK);
+        if (n > num_bytes) {
+            n = num_bytes;
+        }
+        memcpy(&m->page_table[addr>>MEM_PAGE_SHIFT].write_ptr[addr & MEM_PAGE_MASK], src, n);
+        addr += n;
+        src += n;
+        num_bytes -= n;
     }
 }
 
@@ -0,0 +1,433 @@
+#pragma once
+/*#
+    # movie.h
+
+    Deterministic input recording and playback ('movie files') for the
+    system emulators.
+
+    Do this:
+    ~~~C
+    #define CHIPS_IMPL
+    ~~~
+    before you include this file in *one* C or C++ file to create the
+    implementation.
+
+    Optionally provide the following macros with your own implementation
+
+    ~~~C
+    CHIPS_ASSERT(c)
+    ~~~
+        your own assert macro (default: assert(c))
+
+    ## Overview
+
+    A movie is a log of all inputs into an emulated system (key presses,
+    joystick state, ...) with the exact tick position where the input
+    happened. Playing the movie back on a system which starts in the same
+    state reproduces the recorded session bit by bit, independent from the
+    host frame rate or the number of micro-seconds passed to xxx_exec().
+
+    To record a movie, initialize a movie_t with a buffer which receives the
+    recorded data, and attach it to a system right after the system has been
+    initialized:
+
+    ~~~C
+    static uint8_t buf[1<<20];
+    movie_t movie;
+    movie_init_recording(&movie, buf, sizeof(buf));
+    atom_init(&atom, &desc);
+    atom_attach_movie(&atom, &movie);
+    ...
+    // after the session, write the recorded data to a file:
+    fwrite(buf, movie_size(&movie), 1, fp);
+    ~~~
+
+    To play back the movie, initialize a movie_t with the movie data and
+    attach it to a freshly initialized system with the same configuration.
+    Host input is ignored while the movie is playing, once all events have
+    been played back the system continues normally:
+
+    ~~~C
+    if (movie_init_playback(&movie, data, size)) {
+        atom_init(&atom, &desc);
+        atom_attach_movie(&atom, &movie);
+    }
+    ~~~
+
+    The movie also records the frame boundaries (the end of each call to
+    xxx_exec()), since some of the system state, like the 'sticky' keys of
+    the keyboard matrix, is updated once per frame. Every movie_t.hash_interval
+    frames a hash of the system RAM is recorded which is compared during
+    playback. On the first mismatch, movie_t.desync is set to true, and
+    movie_t.desync_frame and movie_t.desync_tick contain the position where
+    the desync has been detected.
+
+    If the recording buffer runs full, the recording stops and
+    movie_t.overflow is set to true.
+
+    ## Data Format
+
+    A movie starts with an 8-byte header (the 4 characters 'CMOV', a version
+    byte and 3 reserved bytes), followed by the events. Each event is encoded
+    as the number of ticks since the previous event (as variable-length
+    integer with 7 bits per byte, bit 7 set on all but the last byte), followed
+    by the event type byte. If bit 7 of the type byte is set, the event
+    data follows as variable-length integer.
+
+    ## Integrating with a System Emulator
+
+    The system emulator keeps a pointer to the attached movie_t and
+    does the following:
+
+    - public input functions like xxx_key_down() call movie_input() first,
+      if this returns false the input must be ignored (because the movie
+      is playing back), otherwise the input is handled as usual (and recorded
+      if the movie is recording)
+    - xxx_exec() calls movie_ticks_to_run() to get the number of ticks until
+      the next event, executes those ticks, and calls movie_ticks_executed()
+      with the number of executed ticks
+    - whenever the movie is at an event position, movie_pull() returns the
+      events which must be applied to the system without going through
+      movie_input() (including MOVIE_EVENT_FRAME events for the once-per-frame
+      work like kbd_update(), and MOVIE_EVENT_HASH events which are checked
+      with movie_check_hash())
+    - at the end of xxx_exec(), if the movie is not playing, the system does
+      its once-per-frame work and calls movie_frame(), if this returns true
+      the system calls movie_record_hash() with a hash of its RAM
+
+    ## zlib/libpng license
+
+    Copyright (c) 2018 Andre Weissflog
+    This software is provided 'as-is', without any express or implied warranty.
+    In no event will the authors be held liable for any damages arising from the
+    use of this software.
+    Permission is granted to anyone to use this software for any purpose,
+    including commercial applications, and to alter it and redistribute it
+    freely, subject to the following restrictions:
+        1. The origin of this software must not be misrepresented; you must not
+        claim that you wrote the original software. If you use this software in a
+        product, an acknowledgment in the product documentation would be
+        appreciated but is not required.
+        2. Altered source versions must be plainly marked as such, and must not
+        be misrepresented as being the original software.
+        3. This notice may not be removed or altered from any source
+        distribution.
+#*/
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MOVIE_VERSION (1)
+#define MOVIE_HEADER_SIZE (8)
+#define MOVIE_DEFAULT_HASH_INTERVAL (50)    /* record a RAM hash every 50 frames */
+#define MOVIE_HASH_SEED (0x811C9DC5)
+
+/* movie modes */
+typedef enum {
+    MOVIE_MODE_NONE,
+    MOVIE_MODE_RECORD,
+    MOVIE_MODE_PLAY,
+} movie_mode_t;
+
+/* event types */
+typedef enum {
+    MOVIE_EVENT_NONE,
+    MOVIE_EVENT_FRAME,          /* end of a frame (end of xxx_exec()) */
+    MOVIE_EVENT_HASH,           /* data: hash of system RAM */
+    MOVIE_EVENT_KEY_DOWN,       /* data: key code */
+    MOVIE_EVENT_KEY_UP,         /* data: key code */
+    MOVIE_EVENT_JOYSTICK,       /* data: system-specific joystick mask(s) */
+    MOVIE_EVENT_INPUT_SET,      /* data: system-specific input bits */
+    MOVIE_EVENT_INPUT_CLEAR,    /* data: system-specific input bits */
+} movie_event_type_t;
+
+/* a decoded event */
+typedef struct {
+    uint64_t tick;
+    movie_event_type_t type;
+    uint32_t data;
+} movie_event_t;
+
+/* movie recorder/player state */
+typedef struct {
+    movie_mode_t mode;
+    uint8_t* buf;               /* recording buffer or playback data */
+    int buf_size;
+    int pos;                    /* current read/write position in buf */
+    uint64_t tick;              /* current tick position */
+    uint64_t last_tick;         /* tick position of last recorded or decoded event */
+    uint32_t frame_count;       /* number of recorded or played back frames */
+    int hash_interval;          /* record a RAM hash every N frames (default: MOVIE_DEFAULT_HASH_INTERVAL) */
+    bool overflow;              /* true if recording buffer has overflown */
+    bool desync;                /* true if a hash mismatch was detected during playback */
+    uint32_t desync_frame;      /* frame where the first desync was detected */
+    uint64_t desync_tick;       /* tick where the first desync was detected */
+    bool has_next;              /* playback: true if 'next' holds the next event */
+    movie_event_t next;
+} movie_t;
+
+/* start recording into a buffer */
+void movie_init_recording(movie_t* movie, void* buf, int buf_size);
+/* start playback of movie data (data must remain valid), returns false if not a valid movie */
+bool movie_init_playback(movie_t* movie, const void* data, int data_size);
+/* return true if the movie is recording */
+bool movie_recording(const movie_t* movie);
+/* return true if the movie is playing back and has events left */
+bool movie_playing(const movie_t* movie);
+/* get the number of recorded bytes */
+int movie_size(const movie_t* movie);
+/* called by system on host input, returns false if input must be ignored */
+bool movie_input(movie_t* movie, movie_event_type_t type, uint32_t data);
+/* called by system, clamp number of ticks to run to the next event */
+uint32_t movie_ticks_to_run(const movie_t* movie, uint32_t num_ticks);
+/* called by system after executing ticks */
+void movie_ticks_executed(movie_t* movie, uint32_t num_ticks);
+/* called by system, get next event at the current tick position, returns false if none */
+bool movie_pull(movie_t* movie, movie_event_t* out_event);
+/* called by system at end of frame when not playing, returns true if a hash should be recorded */
+bool movie_frame(movie_t* movie);
+/* called by system to record a hash after movie_frame() returned true */
+void movie_record_hash(movie_t* movie, uint32_t hash);
+/* called by system to compare the hash of a MOVIE_EVENT_HASH event, returns false on desync */
+bool movie_check_hash(movie_t* movie, const movie_event_t* event, uint32_t hash);
+/* compute a FNV-1a hash over a memory range (start with MOVIE_HASH_SEED) */
+uint32_t movie_hash(uint32_t hash, const void* ptr, int num_bytes);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*-- IMPLEMENTATION ----------------------------------------------------------*/
+#ifdef CHIPS_IMPL
+#include <string.h>
+#ifndef CHIPS_ASSERT
+    #include <assert.h>
+    #define CHIPS_ASSERT(c) assert(c)
+#endif
+
+static const uint8_t _movie_magic[4] = { 'C', 'M', 'O', 'V' };
+
+/* write a variable-length integer, return false if buffer is full */
+static bool _movie_write_varint(movie_t* movie, uint64_t val) {
+    do {
+        if (movie->pos >= movie->buf_size) {
+            return false;
+        }
+        uint8_t b = val & 0x7F;
+        val >>= 7;
+        if (val) {
+            b |= 0x80;
+        }
+        movie->buf[movie->pos++] = b;
+    } while (val);
+    return true;
+}
+
+static bool _movie_read_varint(movie_t* movie, uint64_t* out_val) {
+    uint64_t val = 0;
+    int shift = 0;
+    uint8_t b;
+    do {
+        if ((movie->pos >= movie->buf_size) || (shift > 63)) {
+            return false;
+        }
+        b = movie->buf[movie->pos++];
+        val |= ((uint64_t)(b & 0x7F)) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    *out_val = val;
+    return true;
+}
+
+static void _movie_record(movie_t* movie, movie_event_type_t type, uint32_t data) {
+    if (movie->mode != MOVIE_MODE_RECORD) {
+        return;
+    }
+    const int start_pos = movie->pos;
+    uint8_t type_byte = (uint8_t) type;
+    if (data) {
+        type_byte |= 0x80;
+    }
+    bool ok = _movie_write_varint(movie, movie->tick - movie->last_tick);
+    if (ok && (movie->pos < movie->buf_size)) {
+        movie->buf[movie->pos++] = type_byte;
+    }
+    else {
+        ok = false;
+    }
+    if (ok && data) {
+        ok = _movie_write_varint(movie, data);
+    }
+    if (ok) {
+        movie->last_tick = movie->tick;
+    }
+    else {
+        /* buffer full, drop the partial event and stop recording */
+        movie->pos = start_pos;
+        movie->overflow = true;
+        movie->mode = MOVIE_MODE_NONE;
+    }
+}
+
+/* decode the next event into movie->next, stop playback at end of data */
+static void _movie_decode_next(movie_t* movie) {
+    movie->has_next = false;
+    if (movie->pos >= movie->buf_size) {
+        movie->mode = MOVIE_MODE_NONE;
+        return;
+    }
+    uint64_t delta = 0;
+    uint64_t data = 0;
+    if (!_movie_read_varint(movie, &delta) || (movie->pos >= movie->buf_size)) {
+        movie->mode = MOVIE_MODE_NONE;
+        return;
+    }
+    uint8_t type_byte = movie->buf[movie->pos++];
+    if ((type_byte & 0x80) && !_movie_read_varint(movie, &data)) {
+        movie->mode = MOVIE_MODE_NONE;
+        return;
+    }
+    movie->last_tick += delta;
+    movie->next.tick = movie->last_tick;
+    movie->next.type = (movie_event_type_t) (type_byte & 0x7F);
+    movie->next.data = (uint32_t) data;
+    movie->has_next = true;
+}
+
+void movie_init_recording(movie_t* movie, void* buf, int buf_size) {
+    CHIPS_ASSERT(movie && buf && (buf_size >= MOVIE_HEADER_SIZE));
+    memset(movie, 0, sizeof(movie_t));
+    movie->mode = MOVIE_MODE_RECORD;
+    movie->buf = (uint8_t*) buf;
+    movie->buf_size = buf_size;
+    movie->hash_interval = MOVIE_DEFAULT_HASH_INTERVAL;
+    memset(movie->buf, 0, MOVIE_HEADER_SIZE);
+    memcpy(movie->buf, _movie_magic, sizeof(_movie_magic));
+    movie->buf[4] = MOVIE_VERSION;
+    movie->pos = MOVIE_HEADER_SIZE;
+}
+
+bool movie_init_playback(movie_t* movie, const void* data, int data_size) {
+    CHIPS_ASSERT(movie && data);
+    memset(movie, 0, sizeof(movie_t));
+    const uint8_t* ptr = (const uint8_t*) data;
+    if ((data_size < MOVIE_HEADER_SIZE) ||
+        (0 != memcmp(ptr, _movie_magic, sizeof(_movie_magic))) ||
+        (ptr[4] != MOVIE_VERSION))
+    {
+        return false;
+    }
+    movie->mode = MOVIE_MODE_PLAY;
+    /* the buffer is never written during playback */
+    movie->buf = (uint8_t*) ptr;
+    movie->buf_size = data_size;
+    movie->pos = MOVIE_HEADER_SIZE;
+    _movie_decode_next(movie);
+    return true;
+}
+
+bool movie_recording(const movie_t* movie) {
+    CHIPS_ASSERT(movie);
+    return movie->mode == MOVIE_MODE_RECORD;
+}
+
+bool movie_playing(const movie_t* movie) {
+    CHIPS_ASSERT(movie);
+    return movie->mode == MOVIE_MODE_PLAY;
+}
+
+int movie_size(const movie_t* movie) {
+    CHIPS_ASSERT(movie);
+    return movie->pos;
+}
+
+bool movie_input(movie_t* movie, movie_event_type_t type, uint32_t data) {
+    CHIPS_ASSERT(movie);
+    if (movie->mode == MOVIE_MODE_PLAY) {
+        return false;
+    }
+    _movie_record(movie, type, data);
+    return true;
+}
+
+uint32_t movie_ticks_to_run(const movie_t* movie, uint32_t num_ticks) {
+    CHIPS_ASSERT(movie);
+    if ((movie->mode == MOVIE_MODE_PLAY) && movie->has_next) {
+        CHIPS_ASSERT(movie->next.tick >= movie->tick);
+        const uint64_t ticks_to_event = movie->next.tick - movie->tick;
+        if (ticks_to_event < num_ticks) {
+            return (uint32_t) ticks_to_event;
+        }
+    }
+    return num_ticks;
+}
+
+void movie_ticks_executed(movie_t* movie, uint32_t num_ticks) {
+    CHIPS_ASSERT(movie);
+    movie->tick += num_ticks;
+}
+
+bool movie_pull(movie_t* movie, movie_event_t* out_event) {
+    CHIPS_ASSERT(movie && out_event);
+    if ((movie->mode != MOVIE_MODE_PLAY) || !movie->has_next) {
+        return false;
+    }
+    /* NOTE: a CPU emulator which runs whole instructions may overshoot
+       the event position, in this case the event is applied late
+       instead of never
+    */
+    if (movie->next.tick > movie->tick) {
+        return false;
+    }
+    *out_event = movie->next;
+    if (out_event->type == MOVIE_EVENT_FRAME) {
+        movie->frame_count++;
+    }
+    _movie_decode_next(movie);
+    return true;
+}
+
+bool movie_frame(movie_t* movie) {
+    CHIPS_ASSERT(movie);
+    if (movie->mode != MOVIE_MODE_RECORD) {
+        return false;
+    }
+    _movie_record(movie, MOVIE_EVENT_FRAME, 0);
+    movie->frame_count++;
+    return (movie->mode == MOVIE_MODE_RECORD) &&
+           (movie->hash_interval > 0) &&
+           ((movie->frame_count % movie->hash_interval) == 0);
+}
+
+void movie_record_hash(movie_t* movie, uint32_t hash) {
+    CHIPS_ASSERT(movie);
+    _movie_record(movie, MOVIE_EVENT_HASH, hash);
+}
+
+bool movie_check_hash(movie_t* movie, const movie_event_t* event, uint32_t hash) {
+    CHIPS_ASSERT(movie && event && (event->type == MOVIE_EVENT_HASH));
+    if (event->data != hash) {
+        if (!movie->desync) {
+            movie->desync = true;
+            movie->desync_frame = movie->frame_count;
+            movie->desync_tick = movie->tick;
+        }
+        return false;
+    }
+    return true;
+}
+
+uint32_t movie_hash(uint32_t hash, const void* ptr, int num_bytes) {
+    CHIPS_ASSERT(ptr && (num_bytes >= 0));
+    const uint8_t* p = (const uint8_t*) ptr;
+    for (int i = 0; i < num_bytes; i++) {
+        hash ^= p[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+#endif /* CHIPS_IMPL */
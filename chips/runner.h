@@ -0,0 +1,457 @@
+#pragma once
+/*#
+    # runner.h
+
+    A thread pool which advances many independent emulator instances
+    in parallel (for instance for automated software testing).
+
+    Do this:
+    ~~~C
+    #define CHIPS_IMPL
+    ~~~
+    before you include this file in *one* C or C++ file to create the
+    implementation.
+
+    Optionally provide the following macros with your own implementation
+
+    ~~~C
+    CHIPS_ASSERT(c)
+    ~~~
+        your own assert macro (default: assert(c))
+
+    Uses pthreads on POSIX platforms and native threads on Windows (you
+    may need to link with -lpthread).
+
+    ## Overview
+
+    The runner doesn't know anything about the emulated systems, it
+    only works on an array of opaque instance pointers and a per-frame
+    callback which advances one instance by one frame, for instance:
+
+    ~~~C
+    static void exec_atom(void* instance, int index, void* user_data) {
+        atom_exec((atom_t*)instance, 20000);
+    }
+
+    atom_t atoms[256];
+    void* instances[256];
+    for (int i = 0; i < 256; i++) {
+        atom_init(&atoms[i], &(atom_desc_t){ ... });
+        instances[i] = &atoms[i];
+    }
+    runner_t runner;
+    runner_init(&runner, &(runner_desc_t){
+        .num_workers = 8,
+        .num_instances = 256,
+        .instances = instances,
+        .frame_cb = exec_atom
+    });
+    for (int frame = 0; frame < 1000; frame++) {
+        runner_frame(&runner);
+    }
+    runner_discard(&runner);
+    ~~~
+
+    Each call to runner_frame() creates one task per instance, wakes up
+    the worker threads and blocks until all tasks have been executed.
+
+    Each worker thread 'owns' a contiguous range of instances (its home
+    range) and executes the tasks of this range first, so that an instance
+    is usually advanced on the same worker thread from frame to frame and
+    its state stays in the same CPU cache. A worker which has run out of
+    tasks steals the remaining tasks of other workers, so that the whole
+    frame isn't held up by a few slow instances.
+
+    The frame callback is called concurrently on different threads for
+    different instances, it must only access the instance it has been
+    called for. All chip and system headers keep their entire state in the
+    instance structs (there are no shared mutable globals), so running
+    different instances of the same system on different threads is safe.
+    The only exception is host IO, e.g. two AtoMMC instances writing to
+    the same host directory (use the atommc_root_dir setting in
+    atom_desc_t to give each Atom instance its own directory).
+
+    Per-instance statistics (number of frames, host time spent executing
+    frames, and how often a frame was executed outside the home worker)
+    can be inspected between calls to runner_frame() with runner_stats().
+
+    ## Functions
+
+    ~~~C
+    void runner_init(runner_t* runner, const runner_desc_t* desc)
+    ~~~
+        Initialize a runner instance and start the worker threads.
+
+    ~~~C
+    void runner_discard(runner_t* runner)
+    ~~~
+        Stop and join the worker threads.
+
+    ~~~C
+    void runner_frame(runner_t* runner)
+    ~~~
+        Advance all instances by one frame (blocks until all tasks have
+        been executed).
+
+    ~~~C
+    const runner_stats_t* runner_stats(runner_t* runner, int index)
+    ~~~
+        Get the statistics of an instance.
+
+    ~~~C
+    void runner_reset_stats(runner_t* runner)
+    ~~~
+        Clear the statistics of all instances.
+
+    ## zlib/libpng license
+
+    Copyright (c) 2018 Andre Weissflog
+    This software is provided 'as-is', without any express or implied warranty.
+    In no event will the authors be held liable for any damages arising from the
+    use of this software.
+    Permission is granted to anyone to use this software for any purpose,
+    including commercial applications, and to alter it and redistribute it
+    freely, subject to the following restrictions:
+        1. The origin of this software must not be misrepresented; you must not
+        claim that you wrote the original software. If you use this software in a
+        product, an acknowledgment in the product documentation would be
+        appreciated but is not required.
+        2. Altered source versions must be plainly marked as such, and must not
+        be misrepresented as being the original software.
+        3. This notice may not be removed or altered from any source
+        distribution.
+#*/
+#include <stdint.h>
+#include <stdbool.h>
+#if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+#else
+    #include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RUNNER_MAX_WORKERS (64)
+#define RUNNER_MAX_INSTANCES (1024)
+#define RUNNER_DEFAULT_WORKERS (4)
+
+#if defined(_WIN32)
+typedef HANDLE runner_thread_t;
+typedef CRITICAL_SECTION runner_mutex_t;
+typedef CONDITION_VARIABLE runner_cond_t;
+#else
+typedef pthread_t runner_thread_t;
+typedef pthread_mutex_t runner_mutex_t;
+typedef pthread_cond_t runner_cond_t;
+#endif
+
+/* callback to advance one instance by one frame, called on a worker thread */
+typedef void (*runner_frame_t)(void* instance, int index, void* user_data);
+
+/* setup parameters for runner_init() */
+typedef struct {
+    int num_workers;            /* number of worker threads, default is RUNNER_DEFAULT_WORKERS */
+    int num_instances;          /* number of instances (<= RUNNER_MAX_INSTANCES) */
+    void** instances;           /* array of num_instances instance pointers */
+    runner_frame_t frame_cb;    /* the per-instance frame callback */
+    void* user_data;            /* optional user data for the frame callback */
+} runner_desc_t;
+
+/* per-instance statistics */
+typedef struct {
+    uint64_t frame_count;       /* number of executed frames */
+    uint64_t total_ns;          /* accumulated host time in frame callback */
+    uint64_t last_ns;           /* host time of the last frame */
+    uint64_t max_ns;            /* longest frame */
+    uint64_t stolen_count;      /* number of frames executed outside home worker */
+    int last_worker;            /* index of worker which executed the last frame */
+} runner_stats_t;
+
+struct runner_t;
+
+/* worker thread state */
+typedef struct {
+    struct runner_t* runner;
+    int index;
+    int begin, end;             /* home range of instance indices */
+    int head, tail;             /* remaining tasks of current frame */
+    runner_mutex_t mutex;       /* protects head and tail */
+    runner_thread_t thread;
+} runner_worker_t;
+
+/* runner state */
+typedef struct runner_t {
+    bool valid;
+    bool quit;
+    int num_workers;
+    int num_instances;
+    runner_frame_t frame_cb;
+    void* user_data;
+    uint32_t frame_gen;         /* bumped for each new frame */
+    int num_done;               /* number of finished tasks in current frame */
+    runner_mutex_t mutex;       /* protects quit, frame_gen and num_done */
+    runner_cond_t start_cond;
+    runner_cond_t done_cond;
+    void* instances[RUNNER_MAX_INSTANCES];
+    runner_stats_t stats[RUNNER_MAX_INSTANCES];
+    runner_worker_t workers[RUNNER_MAX_WORKERS];
+} runner_t;
+
+/* initialize a runner instance and start worker threads */
+void runner_init(runner_t* runner, const runner_desc_t* desc);
+/* stop worker threads */
+void runner_discard(runner_t* runner);
+/* advance all instances by one frame, blocks until done */
+void runner_frame(runner_t* runner);
+/* get statistics of an instance */
+const runner_stats_t* runner_stats(runner_t* runner, int index);
+/* clear all statistics */
+void runner_reset_stats(runner_t* runner);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*-- IMPLEMENTATION ----------------------------------------------------------*/
+#ifdef CHIPS_IMPL
+#include <string.h>
+#if !defined(_WIN32)
+#include <time.h>
+#endif
+#ifndef CHIPS_ASSERT
+    #include <assert.h>
+    #define CHIPS_ASSERT(c) assert(c)
+#endif
+
+#define _RUNNER_DEFAULT(val,def) (((val) != 0) ? (val) : (def))
+
+/*--- platform wrappers ---*/
+#if defined(_WIN32)
+static void _runner_mutex_init(runner_mutex_t* m) { InitializeCriticalSection(m); }
+static void _runner_mutex_destroy(runner_mutex_t* m) { DeleteCriticalSection(m); }
+static void _runner_lock(runner_mutex_t* m) { EnterCriticalSection(m); }
+static void _runner_unlock(runner_mutex_t* m) { LeaveCriticalSection(m); }
+static void _runner_cond_init(runner_cond_t* c) { InitializeConditionVariable(c); }
+static void _runner_cond_destroy(runner_cond_t* c) { (void)c; }
+static void _runner_cond_wait(runner_cond_t* c, runner_mutex_t* m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void _runner_cond_signal(runner_cond_t* c) { WakeConditionVariable(c); }
+static void _runner_cond_broadcast(runner_cond_t* c) { WakeAllConditionVariable(c); }
+static uint64_t _runner_now_ns(void) {
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t) ((count.QuadPart / freq.QuadPart) * 1000000000LL +
+                       ((count.QuadPart % freq.QuadPart) * 1000000000LL) / freq.QuadPart);
+}
+#else
+static void _runner_mutex_init(runner_mutex_t* m) { pthread_mutex_init(m, 0); }
+static void _runner_mutex_destroy(runner_mutex_t* m) { pthread_mutex_destroy(m); }
+static void _runner_lock(runner_mutex_t* m) { pthread_mutex_lock(m); }
+static void _runner_unlock(runner_mutex_t* m) { pthread_mutex_unlock(m); }
+static void _runner_cond_init(runner_cond_t* c) { pthread_cond_init(c, 0); }
+static void _runner_cond_destroy(runner_cond_t* c) { pthread_cond_destroy(c); }
+static void _runner_cond_wait(runner_cond_t* c, runner_mutex_t* m) { pthread_cond_wait(c, m); }
+static void _runner_cond_signal(runner_cond_t* c) { pthread_cond_signal(c); }
+static void _runner_cond_broadcast(runner_cond_t* c) { pthread_cond_broadcast(c); }
+static uint64_t _runner_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+/* pop a task from the tail of the worker's own queue, -1 if empty */
+static int _runner_pop(runner_worker_t* w) {
+    int index = -1;
+    _runner_lock(&w->mutex);
+    if (w->head < w->tail) {
+        index = --w->tail;
+    }
+    _runner_unlock(&w->mutex);
+    return index;
+}
+
+/* steal a task from the head of another worker's queue, -1 if empty */
+static int _runner_steal(runner_worker_t* victim) {
+    int index = -1;
+    _runner_lock(&victim->mutex);
+    if (victim->head < victim->tail) {
+        index = victim->head++;
+    }
+    _runner_unlock(&victim->mutex);
+    return index;
+}
+
+static void _runner_exec_task(runner_t* r, runner_worker_t* w, int index) {
+    const uint64_t start = _runner_now_ns();
+    r->frame_cb(r->instances[index], index, r->user_data);
+    const uint64_t dt = _runner_now_ns() - start;
+    runner_stats_t* stats = &r->stats[index];
+    stats->frame_count++;
+    stats->total_ns += dt;
+    stats->last_ns = dt;
+    if (dt > stats->max_ns) {
+        stats->max_ns = dt;
+    }
+    if ((index < w->begin) || (index >= w->end)) {
+        stats->stolen_count++;
+    }
+    stats->last_worker = w->index;
+}
+
+/* execute tasks until no worker has any tasks left, return number of executed tasks */
+static int _runner_drain(runner_t* r, runner_worker_t* w) {
+    int num_tasks = 0;
+    int index;
+    while ((index = _runner_pop(w)) >= 0) {
+        _runner_exec_task(r, w, index);
+        num_tasks++;
+    }
+    for (int i = 1; i < r->num_workers; i++) {
+        runner_worker_t* victim = &r->workers[(w->index + i) % r->num_workers];
+        while ((index = _runner_steal(victim)) >= 0) {
+            _runner_exec_task(r, w, index);
+            num_tasks++;
+        }
+    }
+    return num_tasks;
+}
+
+static void _runner_worker_loop(runner_worker_t* w) {
+    runner_t* r = w->runner;
+    uint32_t gen = 0;
+    _runner_lock(&r->mutex);
+    for (;;) {
+        while ((gen == r->frame_gen) && !r->quit) {
+            _runner_cond_wait(&r->start_cond, &r->mutex);
+        }
+        if (r->quit) {
+            break;
+        }
+        gen = r->frame_gen;
+        _runner_unlock(&r->mutex);
+        int num_tasks = _runner_drain(r, w);
+        _runner_lock(&r->mutex);
+        r->num_done += num_tasks;
+        if (r->num_done == r->num_instances) {
+            _runner_cond_signal(&r->done_cond);
+        }
+    }
+    _runner_unlock(&r->mutex);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI _runner_thread_func(LPVOID arg) {
+    _runner_worker_loop((runner_worker_t*)arg);
+    return 0;
+}
+#else
+static void* _runner_thread_func(void* arg) {
+    _runner_worker_loop((runner_worker_t*)arg);
+    return 0;
+}
+#endif
+
+void runner_init(runner_t* r, const runner_desc_t* desc) {
+    CHIPS_ASSERT(r && desc);
+    CHIPS_ASSERT(desc->frame_cb);
+    CHIPS_ASSERT(desc->instances && (desc->num_instances > 0) && (desc->num_instances <= RUNNER_MAX_INSTANCES));
+    memset(r, 0, sizeof(runner_t));
+    r->valid = true;
+    r->num_workers = _RUNNER_DEFAULT(desc->num_workers, RUNNER_DEFAULT_WORKERS);
+    CHIPS_ASSERT((r->num_workers > 0) && (r->num_workers <= RUNNER_MAX_WORKERS));
+    r->num_instances = desc->num_instances;
+    r->frame_cb = desc->frame_cb;
+    r->user_data = desc->user_data;
+    for (int i = 0; i < r->num_instances; i++) {
+        CHIPS_ASSERT(desc->instances[i]);
+        r->instances[i] = desc->instances[i];
+        r->stats[i].last_worker = -1;
+    }
+    _runner_mutex_init(&r->mutex);
+    _runner_cond_init(&r->start_cond);
+    _runner_cond_init(&r->done_cond);
+    for (int i = 0; i < r->num_workers; i++) {
+        runner_worker_t* w = &r->workers[i];
+        w->runner = r;
+        w->index = i;
+        /* split instances into contiguous home ranges */
+        w->begin = (r->num_instances * i) / r->num_workers;
+        w->end = (r->num_instances * (i + 1)) / r->num_workers;
+        w->head = w->tail = w->begin;
+        _runner_mutex_init(&w->mutex);
+    }
+    for (int i = 0; i < r->num_workers; i++) {
+        runner_worker_t* w = &r->workers[i];
+        #if defined(_WIN32)
+            w->thread = CreateThread(NULL, 0, _runner_thread_func, w, 0, NULL);
+            CHIPS_ASSERT(w->thread);
+        #else
+            int res = pthread_create(&w->thread, 0, _runner_thread_func, w);
+            CHIPS_ASSERT(0 == res); (void)res;
+        #endif
+    }
+}
+
+void runner_discard(runner_t* r) {
+    CHIPS_ASSERT(r && r->valid);
+    _runner_lock(&r->mutex);
+    r->quit = true;
+    _runner_cond_broadcast(&r->start_cond);
+    _runner_unlock(&r->mutex);
+    for (int i = 0; i < r->num_workers; i++) {
+        runner_worker_t* w = &r->workers[i];
+        #if defined(_WIN32)
+            WaitForSingleObject(w->thread, INFINITE);
+            CloseHandle(w->thread);
+        #else
+            pthread_join(w->thread, 0);
+        #endif
+        _runner_mutex_destroy(&w->mutex);
+    }
+    _runner_cond_destroy(&r->done_cond);
+    _runner_cond_destroy(&r->start_cond);
+    _runner_mutex_destroy(&r->mutex);
+    r->valid = false;
+}
+
+void runner_frame(runner_t* r) {
+    CHIPS_ASSERT(r && r->valid);
+    _runner_lock(&r->mutex);
+    r->num_done = 0;
+    /* refill each worker's queue with its home range */
+    for (int i = 0; i < r->num_workers; i++) {
+        runner_worker_t* w = &r->workers[i];
+        _runner_lock(&w->mutex);
+        w->head = w->begin;
+        w->tail = w->end;
+        _runner_unlock(&w->mutex);
+    }
+    r->frame_gen++;
+    _runner_cond_broadcast(&r->start_cond);
+    while (r->num_done < r->num_instances) {
+        _runner_cond_wait(&r->done_cond, &r->mutex);
+    }
+    _runner_unlock(&r->mutex);
+}
+
+const runner_stats_t* runner_stats(runner_t* r, int index) {
+    CHIPS_ASSERT(r && r->valid);
+    CHIPS_ASSERT((index >= 0) && (index < r->num_instances));
+    return &r->stats[index];
+}
+
+void runner_reset_stats(runner_t* r) {
+    CHIPS_ASSERT(r && r->valid);
+    for (int i = 0; i < r->num_instances; i++) {
+        memset(&r->stats[i], 0, sizeof(runner_stats_t));
+        r->stats[i].last_worker = -1;
+    }
+}
+
+#endif /* CHIPS_IMPL */
@@ -28,6 +28,7 @@
     - chips/mem.h
     - chips/kbd.h
     - chips/clk.h
+    - chips/movie.h
 
     ## The Acorn Atom
 
@@ -67,7 +68,10 @@ extern "C" {
 #define ATOM_FREQUENCY (1000000)
 #define ATOM_MAX_AUDIO_SAMPLES (1024)       /* max number of audio samples in internal sample buffer */
 #define ATOM_DEFAULT_AUDIO_SAMPLES (128)    /* default number of samples in internal sample buffer */
-#define ATOM_MAX_TAPE_SIZE (1<<16)          /* max size of tape file in bytes */
+#define ATOM_MAX_TAPE_FILES (256)           /* max number of files on a tape */
+#define ATOM_SCREEN_TEXT_COLS (32)          /* text screen size in character cells */
+#define ATOM_SCREEN_TEXT_ROWS (16)
+#define ATOM_SCREEN_TEXT_SIZE (ATOM_SCREEN_TEXT_ROWS*(ATOM_SCREEN_TEXT_COLS+1)+1) /* buffer size for atom_screen_text() */
 
 /* joystick emulation types */
 typedef enum {
@@ -93,6 +97,9 @@ typedef enum {
 /* audio sample data callback */
 typedef void (*atom_audio_callback_t)(const float* samples, int num_samples, void* user_data);
 
+/* OSWRCH output character callback */
+typedef void (*atom_oswrch_callback_t)(uint8_t c, void* user_data);
+
 /* configuration parameters for atom_init() */
 typedef struct {
     atom_joystick_type_t joystick_type;     /* what joystick type to emulate, default is ATOM_JOYSTICK_NONE */
@@ -100,6 +107,7 @@ typedef struct {
     /* video output config */
     void* pixel_buffer;         /* pointer to a linear RGBA8 pixel buffer, at least 320*256*4 bytes */
     int pixel_buffer_size;      /* size of the pixel buffer in bytes */
+    bool indexed_pixels;        /* pixel_buffer receives 8-bit color indices (see atom_palette()) */
 
     /* optional user-data for callbacks */
     void* user_data;
@@ -110,6 +118,9 @@ typedef struct {
     int audio_sample_rate;          /* playback sample rate, default is 44100 */
     float audio_volume;             /* audio volume: 0.0..1.0, default is 0.25 */
 
+    /* optional OSWRCH trap, if set, text output goes to this callback instead of the screen */
+    atom_oswrch_callback_t oswrch_cb;
+
     /* ROM images */
     const void* rom_abasic;
     const void* rom_afloat;
@@ -121,6 +132,13 @@ typedef struct {
     /* AtoMMC configuration */
     bool atommc_enabled;
     bool atommc_autoboot;
+    const char* atommc_root_dir;    /* host directory of the SD card, default is "mmc" */
+    bool atommc_async_io;           /* execute AtoMMC file commands on a host I/O thread */
+    const void* atommc_archive;     /* optional packed archive for an in-memory SD card (not copied) */
+    int atommc_archive_size;
+    bool atommc_fast_read;          /* trap the firmware's data read loop and copy blocks directly to RAM */
+    int atommc_fast_read_cycles;    /* emulated CPU cycles per byte for fast reads (default: 0) */
+    atommc_latency_t atommc_latency;    /* AtoMMC command latencies, see atommc_default_latency() */
 } atom_desc_t;
 
 /* Acorn Atom emulation state */
@@ -163,11 +181,26 @@ typedef struct {
     bool in_reset;
     /* tape loading */
     int tape_size;  /* tape_size is > 0 if a tape is inserted */
-    int tape_pos;
-    uint8_t tape_buf[ATOM_MAX_TAPE_SIZE];
+    int tape_pos;   /* index of next file in tape_dir */
+    int tape_num_files;
+    const uint8_t* tape_ptr;                /* tape data, owned by caller */
+    int tape_dir[ATOM_MAX_TAPE_FILES];      /* offsets of file headers in tape data */
     /* AtoMMC configuration */
     bool atommc_enabled;
     bool atommc_autoboot;
+    bool atommc_fast_read;
+    int atommc_fast_read_cycles;
+    int atommc_stall;       /* remaining CPU stall ticks after a fast read */
+    /* optional input recorder/player */
+    movie_t* movie;
+    /* OS call traps for headless text I/O */
+    atom_oswrch_callback_t oswrch_cb;
+    const uint8_t* input_ptr;   /* OSRDCH input text, owned by caller */
+    int input_size;
+    int input_pos;
+    /* text screen change detection */
+    uint32_t screen_hash;
+    uint32_t screen_changes;
 } atom_t;
 
 /* initialize a new Atom instance */
@@ -182,6 +215,10 @@ int atom_max_display_size(void);
 /* get the current framebuffer width and height in pixels */
 int atom_display_width(atom_t* sys);
 int atom_display_height(atom_t* sys);
+/* get the RGBA8 colors for an indexed pixel buffer, returns number of colors */
+int atom_palette(atom_t* sys, uint32_t* rgba8, int max_colors);
+/* get and clear the bitmap of display lines changed since the last call (1 bit per line), returns number of lines */
+int atom_dirty_rows(atom_t* sys, uint32_t* bits, int max_rows);
 /* reset Atom instance */
 void atom_reset(atom_t* sys);
 /* execute a single tick */
@@ -198,10 +235,18 @@ void atom_set_joystick_type(atom_t* sys, atom_joystick_type_t type);
 atom_joystick_type_t atom_joystick_type(atom_t* sys);
 /* set joystick mask (combination of ATOM_JOYSTICK_*) */
 void atom_joystick(atom_t* sys, uint8_t mask);
-/* insert a tape for loading (must be an Atom TAP file), data will be copied */
+/* insert a tape for loading (must be an Atom TAP file), data must remain valid until tape is removed */
 bool atom_insert_tape(atom_t* sys, const uint8_t* ptr, int num_bytes);
 /* remove tape */
 void atom_remove_tape(atom_t* sys);
+/* attach a movie recorder or player (or detach with a null pointer) */
+void atom_attach_movie(atom_t* sys, movie_t* movie);
+/* feed text to OSRDCH, bypassing the keyboard (text isn't copied, '\n' is read as CR) */
+void atom_input_text(atom_t* sys, const char* text, int num_bytes);
+/* get number of input text bytes not yet read by OSRDCH */
+int atom_input_remaining(atom_t* sys);
+/* decode the text screen into buf (rows terminated by '\n'), returns a counter which increments when the text changes */
+uint32_t atom_screen_text(atom_t* sys, char* buf, int buf_size);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -219,6 +264,7 @@ void atom_remove_tape(atom_t* sys);
 
 static uint64_t _atom_tick(atom_t* sys, uint64_t pins);
 static uint64_t _atom_vdg_fetch(uint64_t pins, void* user_data);
+static const uint8_t* _atom_vdg_fetch_row(uint16_t addr, int num_bytes, void* user_data);
 static uint8_t _atom_ppi_in(int port_id, void* user_data);
 static uint64_t _atom_ppi_out(int port_id, uint64_t pins, uint8_t data, void* user_data);
 static uint8_t _atom_via_in(int port_id, void* user_data);
@@ -228,13 +274,23 @@ static void _atom_atommc_out(int port_id, uint8_t data, void* user_data);
 static void _atom_init_keymap(atom_t* sys);
 static void _atom_init_memorymap(atom_t* sys);
 static uint64_t _atom_osload(atom_t* sys, uint64_t pins);
+static uint64_t _atom_atommc_fast_read(atom_t* sys, uint64_t pins);
+static uint64_t _atom_oswrch(atom_t* sys, uint64_t pins);
+static uint64_t _atom_osrdch(atom_t* sys, uint64_t pins);
+static void _atom_key_down(atom_t* sys, int key_code);
+static void _atom_key_up(atom_t* sys, int key_code);
 
 #define _ATOM_DEFAULT(val,def) (((val) != 0) ? (val) : (def))
 #define _ATOM_CLEAR(val) memset(&val, 0, sizeof(val))
 
 void atom_init(atom_t* sys, const atom_desc_t* desc) {
     CHIPS_ASSERT(sys && desc);
-    CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= atom_max_display_size()));
+    if (desc->indexed_pixels) {
+        CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= atom_max_display_size()/4));
+    }
+    else {
+        CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= atom_max_display_size()));
+    }
 
     memset(sys, 0, sizeof(atom_t));
     sys->valid = true;
@@ -245,6 +301,9 @@ void atom_init(atom_t* sys, const atom_desc_t* desc) {
     sys->num_samples = _ATOM_DEFAULT(desc->audio_num_samples, ATOM_DEFAULT_AUDIO_SAMPLES);
     sys->atommc_enabled = desc->atommc_enabled;
     sys->atommc_autoboot = desc->atommc_autoboot;
+    sys->atommc_fast_read = desc->atommc_fast_read;
+    sys->oswrch_cb = desc->oswrch_cb;
+    sys->atommc_fast_read_cycles = desc->atommc_fast_read_cycles;
     CHIPS_ASSERT(sys->num_samples <= ATOM_MAX_AUDIO_SAMPLES);
     CHIPS_ASSERT(desc->rom_abasic && (desc->rom_abasic_size == sizeof(sys->rom_abasic)));
     memcpy(sys->rom_abasic, desc->rom_abasic, sizeof(sys->rom_abasic));
@@ -263,9 +322,19 @@ void atom_init(atom_t* sys, const atom_desc_t* desc) {
     mc6847_desc_t vdg_desc;
     _ATOM_CLEAR(vdg_desc);
     vdg_desc.tick_hz = ATOM_FREQUENCY;
-    vdg_desc.rgba8_buffer = (uint32_t*) desc->pixel_buffer;
-    vdg_desc.rgba8_buffer_size = desc->pixel_buffer_size;
+    if (desc->indexed_pixels) {
+        vdg_desc.index8_buffer = (uint8_t*) desc->pixel_buffer;
+        vdg_desc.index8_buffer_size = desc->pixel_buffer_size;
+    }
+    else {
+        vdg_desc.rgba8_buffer = (uint32_t*) desc->pixel_buffer;
+        vdg_desc.rgba8_buffer_size = desc->pixel_buffer_size;
+    }
     vdg_desc.fetch_cb = _atom_vdg_fetch;
+    vdg_desc.fetch_row_cb = _atom_vdg_fetch_row;
+    vdg_desc.inv_bits = (1<<7);
+    vdg_desc.as_bits = (1<<6);
+    vdg_desc.intext_bits = (1<<6);
     vdg_desc.user_data = sys;
     mc6847_init(&sys->vdg, &vdg_desc);
 
@@ -290,6 +359,11 @@ void atom_init(atom_t* sys, const atom_desc_t* desc) {
        atommc_desc.out_cb = _atom_atommc_out;
        atommc_desc.user_data = sys;
        atommc_desc.autoboot = sys->atommc_autoboot;
+       atommc_desc.root_dir = desc->atommc_root_dir;
+       atommc_desc.async_io = desc->atommc_async_io;
+       atommc_desc.archive = desc->atommc_archive;
+       atommc_desc.archive_size = desc->atommc_archive_size;
+       atommc_desc.latency = desc->atommc_latency;
        atommc_init(&sys->atommc, &atommc_desc);
     }
 
@@ -311,6 +385,9 @@ void atom_init(atom_t* sys, const atom_desc_t* desc) {
 
 void atom_discard(atom_t* sys) {
     CHIPS_ASSERT(sys && sys->valid);
+    if (sys->atommc_enabled) {
+        atommc_discard(&sys->atommc);
+    }
     sys->valid = false;
 }
 
@@ -336,6 +413,16 @@ int atom_display_height(atom_t* sys) {
     return MC6847_DISPLAY_HEIGHT;
 }
 
+int atom_palette(atom_t* sys, uint32_t* rgba8, int max_colors) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return mc6847_palette(&sys->vdg, rgba8, max_colors);
+}
+
+int atom_dirty_rows(atom_t* sys, uint32_t* bits, int max_rows) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return mc6847_dirty_rows(&sys->vdg, bits, max_rows);
+}
+
 void atom_reset(atom_t* sys) {
     CHIPS_ASSERT(sys && sys->valid);
     sys->pins |= M6502_RES;
@@ -348,6 +435,7 @@ void atom_reset(atom_t* sys) {
     beeper_reset(&sys->beeper);
     m6581_reset(&sys->sid);
     sys->state_2_4khz = false;
+    sys->atommc_stall = 0;
     sys->out_cass0 = false;
     sys->out_cass1 = false;
 }
@@ -356,15 +444,66 @@ void atom_tick(atom_t* sys) {
     sys->pins = _atom_tick(sys, sys->pins);
 }
 
+static uint32_t _atom_frame_hash(atom_t* sys) {
+    return movie_hash(MOVIE_HASH_SEED, sys->ram, sizeof(sys->ram));
+}
+
+/* apply input events from a movie at the current tick position */
+static void _atom_movie_pull(atom_t* sys) {
+    movie_event_t ev;
+    while (movie_pull(sys->movie, &ev)) {
+        switch (ev.type) {
+            case MOVIE_EVENT_FRAME:     kbd_update(&sys->kbd); break;
+            case MOVIE_EVENT_HASH:      movie_check_hash(sys->movie, &ev, _atom_frame_hash(sys)); break;
+            case MOVIE_EVENT_KEY_DOWN:  _atom_key_down(sys, (int)ev.data); break;
+            case MOVIE_EVENT_KEY_UP:    _atom_key_up(sys, (int)ev.data); break;
+            case MOVIE_EVENT_JOYSTICK:  sys->joy_joymask = (uint8_t)ev.data; break;
+            default: break;
+        }
+    }
+}
+
+/* exec path with an attached movie, split execution at event positions */
+static void _atom_exec_movie(atom_t* sys, uint32_t num_ticks) {
+    movie_t* movie = sys->movie;
+    uint64_t pins = sys->pins;
+    while (num_ticks > 0) {
+        _atom_movie_pull(sys);
+        uint32_t ticks_to_run = movie_ticks_to_run(movie, num_ticks);
+        for (uint32_t ticks = 0; ticks < ticks_to_run; ticks++) {
+            pins = _atom_tick(sys, pins);
+        }
+        movie_ticks_executed(movie, ticks_to_run);
+        num_ticks -= ticks_to_run;
+    }
+    sys->pins = pins;
+    /* during playback, frame boundaries come from the movie */
+    if (!movie_playing(movie)) {
+        kbd_update(&sys->kbd);
+        if (movie_frame(movie)) {
+            movie_record_hash(movie, _atom_frame_hash(sys));
+        }
+    }
+}
+
 void atom_exec(atom_t* sys, uint32_t micro_seconds) {
     CHIPS_ASSERT(sys && sys->valid);
     uint32_t num_ticks = clk_us_to_ticks(ATOM_FREQUENCY, micro_seconds);
+    if (sys->movie) {
+        _atom_exec_movie(sys, num_ticks);
+        return;
+    }
     for (uint32_t ticks = 0; ticks < num_ticks; ticks++) {
         sys->pins = _atom_tick(sys, sys->pins);
     }
     kbd_update(&sys->kbd);
 }
 
+void atom_attach_movie(atom_t* sys, movie_t* movie) {
+    CHIPS_ASSERT(sys && sys->valid);
+    sys->movie = movie;
+}
+
 int handle_shift_ctrl_rept_break(atom_t* sys, int key_code, bool val) {
 
    // Handle special keys, like shift, control, repeat and break
@@ -443,6 +582,21 @@ int handle_shift_ctrl_rept_break(atom_t* sys, int key_code, bool val) {
 
 void atom_key_down(atom_t* sys, int key_code) {
     CHIPS_ASSERT(sys && sys->valid);
+    if (sys->movie && !movie_input(sys->movie, MOVIE_EVENT_KEY_DOWN, (uint32_t)key_code)) {
+        return;
+    }
+    _atom_key_down(sys, key_code);
+}
+
+void atom_key_up(atom_t* sys, int key_code) {
+    CHIPS_ASSERT(sys && sys->valid);
+    if (sys->movie && !movie_input(sys->movie, MOVIE_EVENT_KEY_UP, (uint32_t)key_code)) {
+        return;
+    }
+    _atom_key_up(sys, key_code);
+}
+
+static void _atom_key_down(atom_t* sys, int key_code) {
     // Handle shift/ctrl/rept/break, remap higher key codes, handle joystick
     key_code = handle_shift_ctrl_rept_break(sys, key_code, true);
     // Pass on to keyboard matrix
@@ -451,8 +605,7 @@ void atom_key_down(atom_t* sys, int key_code) {
     }
 }
 
-void atom_key_up(atom_t* sys, int key_code) {
-    CHIPS_ASSERT(sys && sys->valid);
+static void _atom_key_up(atom_t* sys, int key_code) {
     // Handle shift/ctrl/rept/break, remap higher key codes, handle joystick
     key_code = handle_shift_ctrl_rept_break(sys, key_code, false);
     // Pass on to keyboard matrix
@@ -473,6 +626,9 @@ atom_joystick_type_t atom_joystick_type(atom_t* sys) {
 
 void atom_joystick(atom_t* sys, uint8_t mask) {
     CHIPS_ASSERT(sys && sys->valid);
+    if (sys->movie && !movie_input(sys->movie, MOVIE_EVENT_JOYSTICK, mask)) {
+        return;
+    }
     sys->joy_joymask = mask;
 }
 
@@ -481,9 +637,14 @@ void atom_joystick(atom_t* sys, uint8_t mask) {
 uint64_t _atom_tick(atom_t* sys, uint64_t pins) {
     bool sample = false;
 
-    /* tick the CPU */
+    /* tick the CPU (unless it's stalled after an AtoMMC fast read) */
     if (!sys->in_reset) {
-        pins = m6502_tick(&sys->cpu, pins);
+        if (sys->atommc_stall > 0) {
+            sys->atommc_stall--;
+        }
+        else {
+            pins = m6502_tick(&sys->cpu, pins);
+        }
     }
 
     /* tick the video chip */
@@ -618,6 +779,24 @@ uint64_t _atom_tick(atom_t* sys, uint64_t pins) {
             pins = _atom_osload(sys, pins);
         }
     }
+
+    /* check for the OSWRCH and OSRDCH entry points for headless text I/O */
+    if (pins & M6502_SYNC) {
+        const uint16_t pc = M6502_GET_ADDR(pins);
+        if (sys->oswrch_cb && (pc == 0xFFF4)) {
+            pins = _atom_oswrch(sys, pins);
+        }
+        else if ((sys->input_pos < sys->input_size) && (pc == 0xFFE3)) {
+            pins = _atom_osrdch(sys, pins);
+        }
+    }
+
+    /* check for the AtoMMC firmware's data read loop (LDA abs opcode fetch) */
+    if (sys->atommc_fast_read && (sys->atommc_stall == 0)) {
+        if ((pins & M6502_SYNC) && (M6502_GET_DATA(pins) == 0xAD)) {
+            pins = _atom_atommc_fast_read(sys, pins);
+        }
+    }
     return pins;
 }
 
@@ -640,6 +819,18 @@ uint64_t _atom_vdg_fetch(uint64_t pins, void* user_data) {
     return pins;
 }
 
+/* video memory rows are contiguous in RAM, the INV/AS/INTEXT wiring is in the VDG desc */
+const uint8_t* _atom_vdg_fetch_row(uint16_t addr, int num_bytes, void* user_data) {
+    atom_t* sys = (atom_t*) user_data;
+    const uint32_t start = (addr + 0x8000) & 0xFFFF;
+    if ((start + num_bytes) <= sizeof(sys->ram)) {
+        return &sys->ram[start];
+    }
+    else {
+        return 0;
+    }
+}
+
 uint64_t _atom_ppi_out(int port_id, uint64_t pins, uint8_t data, void* user_data) {
     atom_t* sys = (atom_t*) user_data;
     /*
@@ -869,22 +1060,100 @@ bool atom_insert_tape(atom_t* sys, const uint8_t* ptr, int num_bytes) {
     CHIPS_ASSERT(sys && sys->valid);
     CHIPS_ASSERT(ptr);
     atom_remove_tape(sys);
-    /* check for valid size */
-    if ((num_bytes < (int)sizeof(_atom_tap_header)) || (num_bytes > ATOM_MAX_TAPE_SIZE)) {
+    /* build the tape directory, the tape data itself isn't copied */
+    int pos = 0;
+    int num_files = 0;
+    while ((pos + (int)sizeof(_atom_tap_header)) <= num_bytes) {
+        if (num_files == ATOM_MAX_TAPE_FILES) {
+            return false;
+        }
+        const _atom_tap_header* hdr = (const _atom_tap_header*) &ptr[pos];
+        sys->tape_dir[num_files++] = pos;
+        pos += sizeof(_atom_tap_header) + hdr->length;
+    }
+    /* last file must be complete */
+    if ((num_files == 0) || (pos > num_bytes)) {
         return false;
     }
-    memcpy(sys->tape_buf, ptr, num_bytes);
+    sys->tape_ptr = ptr;
     sys->tape_pos = 0;
+    sys->tape_num_files = num_files;
     sys->tape_size = num_bytes;
     return true;
 }
 
+void atom_input_text(atom_t* sys, const char* text, int num_bytes) {
+    CHIPS_ASSERT(sys && sys->valid);
+    CHIPS_ASSERT(text || (num_bytes == 0));
+    sys->input_ptr = (const uint8_t*) text;
+    sys->input_size = num_bytes;
+    sys->input_pos = 0;
+}
+
+int atom_input_remaining(atom_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return sys->input_size - sys->input_pos;
+}
+
+/*  decode a video RAM byte to ASCII, bit 6 selects semigraphics (shown
+    as '#'), bit 7 is the INV bit which the Atom uses for lower-case letters,
+    the lower 6 bits are the MC6847 internal character code (@A-Z[\]^_ at
+    0x00..0x1F, followed by the regular ASCII range 0x20..0x3F)
+*/
+static char _atom_screen_char(uint8_t chr) {
+    if (chr & 0x40) {
+        return '#';
+    }
+    uint8_t c = chr & 0x3F;
+    if (c < 0x20) {
+        c += 0x40;
+        if (chr & 0x80) {
+            c += 0x20;
+        }
+    }
+    return (char) c;
+}
+
+uint32_t atom_screen_text(atom_t* sys, char* buf, int buf_size) {
+    CHIPS_ASSERT(sys && sys->valid && buf && (buf_size > 0));
+    /* the 32x16 text screen is at 0x8000, assumes the VDG is in text mode */
+    return mem_screen_text(&sys->ram[0x8000], ATOM_SCREEN_TEXT_COLS, ATOM_SCREEN_TEXT_ROWS, _atom_screen_char,
+        buf, buf_size, &sys->screen_hash, &sys->screen_changes);
+}
+
 void atom_remove_tape(atom_t* sys) {
     CHIPS_ASSERT(sys && sys->valid);
+    sys->tape_ptr = 0;
     sys->tape_pos = 0;
+    sys->tape_num_files = 0;
     sys->tape_size = 0;
 }
 
+/* find a file on tape by the filename which OSLOAD has been called with (CR-terminated
+   string at (#C9)), an empty filename selects the next file, return -1 if not found
+*/
+static int _atom_tape_find(atom_t* sys) {
+    uint16_t name_addr = mem_rd16(&sys->mem, 0xC9);
+    char name[16];
+    int len = 0;
+    uint8_t c;
+    while ((len < (int)sizeof(name)) && (0x0D != (c = mem_rd(&sys->mem, name_addr++)))) {
+        name[len++] = (char)c;
+    }
+    if (len == 0) {
+        return (sys->tape_pos < sys->tape_num_files) ? sys->tape_pos : -1;
+    }
+    for (int i = 0; i < sys->tape_num_files; i++) {
+        /* search starts at the current tape position */
+        const int index = (sys->tape_pos + i) % sys->tape_num_files;
+        const _atom_tap_header* hdr = (const _atom_tap_header*) &sys->tape_ptr[sys->tape_dir[index]];
+        if ((0 == memcmp(hdr->name, name, len)) && ((len == (int)sizeof(hdr->name)) || (0 == hdr->name[len]))) {
+            return index;
+        }
+    }
+    return -1;
+}
+
 /*
     trapped OSLOAD function, load ATM block in a TAP file:
       https://github.com/hoglet67/Atomulator/blob/master/docs/atommmc2.tx
@@ -927,30 +1196,24 @@ void atom_remove_tape(atom_t* sys) {
 uint64_t _atom_osload(atom_t* sys, uint64_t pins) {
     bool success = false;
 
-    /* tape inserted? */
+    /* tape inserted and file found? */
     uint16_t exec_addr = 0;
-    if ((sys->tape_size > 0) && (sys->tape_pos < sys->tape_size)) {
-        /* read next tape chunk */
-        if ((int)(sys->tape_pos + sizeof(_atom_tap_header)) < sys->tape_size) {
-            const _atom_tap_header* hdr = (const _atom_tap_header*) &sys->tape_buf[sys->tape_pos];
-            sys->tape_pos += sizeof(_atom_tap_header);
-            exec_addr = hdr->exec_addr;
-            uint16_t addr = hdr->load_addr;
-            /* override file load address? */
-            if (mem_rd(&sys->mem, 0xCD) & 0x80) {
-                addr = mem_rd16(&sys->mem, 0xCB);
-            }
-            if ((sys->tape_pos + hdr->length) <= sys->tape_size) {
-                for (int i = 0; i < hdr->length; i++) {
-                    mem_wr(&sys->mem, addr++, sys->tape_buf[sys->tape_pos++]);
-                }
-                success = true;
-            }
+    const int index = (sys->tape_size > 0) ? _atom_tape_find(sys) : -1;
+    if (index >= 0) {
+        const uint8_t* ptr = &sys->tape_ptr[sys->tape_dir[index]];
+        const _atom_tap_header* hdr = (const _atom_tap_header*) ptr;
+        ptr += sizeof(_atom_tap_header);
+        exec_addr = hdr->exec_addr;
+        uint16_t addr = hdr->load_addr;
+        /* override file load address? */
+        if (mem_rd(&sys->mem, 0xCD) & 0x80) {
+            addr = mem_rd16(&sys->mem, 0xCB);
         }
-    }
-    /* if tape at end, remove tape */
-    if (sys->tape_pos >= sys->tape_size) {
-        atom_remove_tape(sys);
+        for (int i = 0; i < hdr->length; i++) {
+            mem_wr(&sys->mem, addr++, *ptr++);
+        }
+        sys->tape_pos = index + 1;
+        success = true;
     }
     /* success/fail: set or clear bit 6 and clear bit 7 of 0xDD */
     uint8_t dd = mem_rd(&sys->mem, 0xDD);
@@ -979,4 +1242,128 @@ uint64_t _atom_osload(atom_t* sys, uint64_t pins) {
     return pins;
 }
 
+/*
+    trapped AtoMMC data read loop, the firmware copies each block from
+    the AtoMMC data register into memory with a loop like this:
+
+        loop:   LDA #B40x       AD 0x B4
+                STA (zp),Y      91 zp
+                INY             C8
+              [ CPY #nn         C0 nn     ]
+              [ CPY nn          C4 nn     ]
+              [ DEX             CA        ]
+                BNE loop        D0 xx
+
+    The loop is recognized by its code (so this doesn't depend on the
+    firmware version), all remaining bytes are copied at once, the CPU
+    registers are set as if the loop had run, and execution continues
+    after the loop. The CPU is then stalled for atommc_fast_read_cycles
+    per byte to advance the emulated clock.
+*/
+uint64_t _atom_atommc_fast_read(atom_t* sys, uint64_t pins) {
+    mem_t* mem = &sys->mem;
+    const uint16_t pc = M6502_GET_ADDR(pins);
+    const uint16_t io_addr = mem_rd16(mem, pc + 1);
+    /* only loops reading the AtoMMC data register (not status, latch or joystick) */
+    if (!sys->atommc_enabled || (io_addr < 0xB400) || (io_addr >= 0xB800) ||
+        ((io_addr & 3) != ATOMMC_READ_DATA_REG) ||
+        (mem_rd(mem, pc + 3) != 0x91) || (mem_rd(mem, pc + 5) != 0xC8))
+    {
+        return pins;
+    }
+    const uint8_t zp = mem_rd(mem, pc + 4);
+    uint8_t y = m6502_y(&sys->cpu);
+    uint8_t x = m6502_x(&sys->cpu);
+    uint8_t p = (m6502_p(&sys->cpu) & ~M6502_NF) | M6502_ZF;
+    uint16_t bne_addr = pc + 6;
+    int num_bytes;
+    const uint8_t op = mem_rd(mem, bne_addr);
+    if ((op == 0xC0) || (op == 0xC4)) {
+        /* CPY #nn or CPY nn: loop until Y == nn */
+        const uint8_t nn = (op == 0xC0) ? mem_rd(mem, pc + 7) : mem_rd(mem, mem_rd(mem, pc + 7));
+        num_bytes = (uint8_t)(nn - y) ? (uint8_t)(nn - y) : 256;
+        p |= M6502_CF;
+        bne_addr += 2;
+    }
+    else if (op == 0xCA) {
+        /* DEX: loop until X == 0 */
+        num_bytes = x ? x : 256;
+        x = 0;
+        bne_addr += 1;
+    }
+    else {
+        /* INY/BNE: loop until Y wraps around */
+        num_bytes = 256 - y;
+    }
+    /* the branch must go back to the start of the loop */
+    if ((mem_rd(mem, bne_addr) != 0xD0) || ((uint16_t)(bne_addr + 2 + (int8_t)mem_rd(mem, bne_addr + 1)) != pc)) {
+        return pins;
+    }
+    /* when INY wraps Y around to 0, STA (zp),Y continues at the base
+       address, so the copy is split into two parts at that point,
+       both must go to regular memory, not the IO area
+    */
+    const uint16_t base = mem_rd(mem, zp) + (mem_rd(mem, (zp + 1) & 0xFF) << 8);
+    const int num_first = ((y + num_bytes) > 256) ? (256 - y) : num_bytes;
+    if (((base + y + num_first) > 0xB000) || ((base + (num_bytes - num_first)) > 0xB000)) {
+        return pins;
+    }
+    uint8_t buf[256];
+    if (atommc_read_data(&sys->atommc, buf, num_bytes) != num_bytes) {
+        return pins;
+    }
+    mem_write_range(mem, base + y, buf, num_first);
+    if (num_first < num_bytes) {
+        mem_write_range(mem, base, buf + num_first, num_bytes - num_first);
+    }
+    m6502_set_a(&sys->cpu, buf[num_bytes - 1]);
+    m6502_set_x(&sys->cpu, x);
+    m6502_set_y(&sys->cpu, (uint8_t)(y + num_bytes));
+    m6502_set_p(&sys->cpu, p);
+    sys->atommc_stall = num_bytes * sys->atommc_fast_read_cycles;
+
+    /* continue after the loop */
+    const uint16_t next_addr = bne_addr + 2;
+    M6502_SET_ADDR(pins, next_addr);
+    M6502_SET_DATA(pins, mem_rd(mem, next_addr));
+    m6502_set_pc(&sys->cpu, next_addr);
+    return pins;
+}
+
+/* return from a trapped OS call like an RTS would */
+static uint64_t _atom_rts(atom_t* sys, uint64_t pins) {
+    const uint8_t s = m6502_s(&sys->cpu);
+    const uint8_t l = mem_rd(&sys->mem, 0x0100 | (uint8_t)(s+1));
+    const uint8_t h = mem_rd(&sys->mem, 0x0100 | (uint8_t)(s+2));
+    m6502_set_s(&sys->cpu, s+2);
+    const uint16_t ret_addr = ((h<<8) | l) + 1;
+    M6502_SET_ADDR(pins, ret_addr);
+    M6502_SET_DATA(pins, mem_rd(&sys->mem, ret_addr));
+    m6502_set_pc(&sys->cpu, ret_addr);
+    return pins;
+}
+
+/*
+    trapped OSWRCH (0xFFF4): the character in A goes to the host
+    callback instead of the screen, all registers are preserved
+*/
+uint64_t _atom_oswrch(atom_t* sys, uint64_t pins) {
+    sys->oswrch_cb(m6502_a(&sys->cpu), sys->user_data);
+    return _atom_rts(sys, pins);
+}
+
+/*
+    trapped OSRDCH (0xFFE3): return the next input text character in A
+    without scanning the keyboard, once the input text is used up, OSRDCH
+    reads the keyboard again
+*/
+uint64_t _atom_osrdch(atom_t* sys, uint64_t pins) {
+    uint8_t c = sys->input_ptr[sys->input_pos++];
+    if (c == '\n') {
+        c = 0x0D;
+    }
+    m6502_set_a(&sys->cpu, c);
+    return _atom_rts(sys, pins);
+}
+
 #endif /* CHIPS_IMPL */
@@ -129,6 +129,7 @@ typedef struct {
     /* video output config */
     void* pixel_buffer;         /* pointer to a linear RGBA8 pixel buffer, at least 256*256*4 bytes */
     int pixel_buffer_size;      /* size of the pixel buffer in bytes */
+    bool indexed_pixels;        /* pixel_buffer receives 8-bit color indices (see bombjack_palette()) */
 
     /* optional user-data for audio callback */
     void* user_data;
@@ -190,7 +191,7 @@ typedef struct {
         int vsync_count;
         int vblank_count;
         mem_t mem;
-        uint32_t palette[128];
+        uint32_t palette[129];  /* 128 hardware colors, and black for the cleared background */
     } mainboard;
     struct {
         z80_t cpu;
@@ -219,6 +220,17 @@ typedef struct {
         float sample_buffer[BOMBJACK_MAX_AUDIO_SAMPLES];
     } audio;
     uint32_t* pixel_buffer;
+    bool indexed_pixels;
+    /* the decoded frame as palette indices, with 32 guard lines above
+       and below for sprites which are partially outside the screen
+    */
+    uint8_t frame[(32+256+32)*256];
+    /* cached tile layers as palette indices (0 is a transparent foreground pixel) */
+    uint8_t bg_layer[256*256];
+    uint8_t fg_layer[256*256];
+    int bg_layer_image;         /* the bg_image bits the background layer was decoded for, or -1 */
+    uint16_t fg_cache[32*32];   /* color and char code each foreground tile was decoded with */
+    uint32_t dirty_rows[8];     /* one bit per display line which changed */
     struct {
         bool draw_background_layer;
         bool draw_foreground_layer;
@@ -245,6 +257,10 @@ int bombjack_max_display_size(void);
 /* get the current framebuffer width and height in pixels */
 int bombjack_display_width(bombjack_t* sys);
 int bombjack_display_height(bombjack_t* sys);
+/* get the RGBA8 colors for an indexed pixel buffer, returns number of colors */
+int bombjack_palette(bombjack_t* sys, uint32_t* rgba8, int max_colors);
+/* get and clear the bitmap of display lines changed since the last call (1 bit per line), returns number of lines */
+int bombjack_dirty_rows(bombjack_t* sys, uint32_t* bits, int max_rows);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -266,6 +282,10 @@ int bombjack_display_height(bombjack_t* sys);
 #define _BOMBJACK_DISPLAY_WIDTH (256)
 #define _BOMBJACK_DISPLAY_HEIGHT (256)
 #define _BOMBJACK_DISPLAY_SIZE (_BOMBJACK_DISPLAY_WIDTH*_BOMBJACK_DISPLAY_HEIGHT*4)
+#define _BOMBJACK_COLOR_BLACK (128)
+#define _BOMBJACK_NUM_COLORS (129)
+/* start of the visible area in the frame buffer (after the top guard lines) */
+#define _BOMBJACK_FRAME(sys) (&(sys)->frame[32*256])
 
 static uint64_t _bombjack_tick_mainboard(int num, uint64_t pins, void* user_data);
 static uint64_t _bombjack_tick_soundboard(int num, uint64_t pins, void* user_data);
@@ -281,6 +301,8 @@ void bombjack_init(bombjack_t* sys, const bombjack_desc_t* desc) {
     sys->dbg.draw_foreground_layer = true;
     sys->dbg.draw_sprite_layer = true;
     sys->dbg.clear_background_layer = true;
+    sys->bg_layer_image = -1;
+    memset(sys->fg_cache, 0xFF, sizeof(sys->fg_cache));
 
     /* copy over ROM images */
     CHIPS_ASSERT(desc->rom_main_0000_1FFF && (desc->rom_main_0000_1FFF_size == sizeof(sys->rom_main[0])));
@@ -402,8 +424,10 @@ void bombjack_init(bombjack_t* sys, const bombjack_desc_t* desc) {
     sys->audio.num_samples = _bombjack_def(desc->audio_num_samples, BOMBJACK_DEFAULT_AUDIO_SAMPLES);
     sys->audio.volume = _bombjack_def(desc->audio_volume, 1.0f);
     sys->user_data = desc->user_data;
-    CHIPS_ASSERT((0 == desc->pixel_buffer) || (desc->pixel_buffer && (desc->pixel_buffer_size >= _BOMBJACK_DISPLAY_SIZE)));
+    CHIPS_ASSERT((0 == desc->pixel_buffer) || (desc->pixel_buffer && (desc->pixel_buffer_size >= (desc->indexed_pixels ? _BOMBJACK_DISPLAY_SIZE/4 : _BOMBJACK_DISPLAY_SIZE))));
     sys->pixel_buffer = (uint32_t*) desc->pixel_buffer;
+    sys->indexed_pixels = desc->indexed_pixels;
+    sys->mainboard.palette[_BOMBJACK_COLOR_BLACK] = 0xFF000000;
 }
 
 void bombjack_discard(bombjack_t* sys) {
@@ -431,6 +455,20 @@ int bombjack_display_height(bombjack_t* sys) {
     return _BOMBJACK_DISPLAY_HEIGHT;
 }
 
+int bombjack_palette(bombjack_t* sys, uint32_t* rgba8, int max_colors) {
+    CHIPS_ASSERT(sys && sys->valid && rgba8);
+    int num = (max_colors < _BOMBJACK_NUM_COLORS) ? max_colors : _BOMBJACK_NUM_COLORS;
+    for (int i = 0; i < num; i++) {
+        rgba8[i] = sys->mainboard.palette[i];
+    }
+    return num;
+}
+
+int bombjack_dirty_rows(bombjack_t* sys, uint32_t* bits, int max_rows) {
+    CHIPS_ASSERT(sys && sys->valid && bits);
+    return mem_take_dirty_rows(sys->dirty_rows, _BOMBJACK_DISPLAY_HEIGHT, bits, max_rows);
+}
+
 void bombjack_reset(bombjack_t* sys) {
     CHIPS_ASSERT(sys && sys->valid);
     z80_reset(&sys->mainboard.cpu);
@@ -812,7 +850,13 @@ static uint64_t _bombjack_tick_soundboard(int num_ticks, uint64_t pins, void* us
 
 static void _bombjack_decode_background(bombjack_t* sys) {
     CHIPS_ASSERT(sys && sys->pixel_buffer);
-    uint32_t* ptr = sys->pixel_buffer;
+    /* the background only depends on the image selection, so it's only decoded when that changes */
+    const int bg_image = sys->mainboard.bg_image & 0x17;
+    if (bg_image == sys->bg_layer_image) {
+        return;
+    }
+    sys->bg_layer_image = bg_image;
+    uint8_t* ptr = sys->bg_layer;
     int img_base_addr = (sys->mainboard.bg_image & 7) * 0x0200;
     bool img_valid = (sys->mainboard.bg_image & 0x10) != 0;
     for (int y = 0; y < 16; y++) {
@@ -838,7 +882,7 @@ static void _bombjack_decode_background(bombjack_t* sys) {
                 }
                 for (int xx = 15; xx >= 0; xx--) {
                     uint8_t pen = ((bm2>>xx)&1) | (((bm1>>xx)&1)<<1) | (((bm0>>xx)&1)<<2);
-                    *ptr++ = sys->mainboard.palette[color_block | pen];
+                    *ptr++ = color_block | pen;
                 }
                 ptr += flip_y ? -272 : 240;
             }
@@ -851,7 +895,7 @@ static void _bombjack_decode_background(bombjack_t* sys) {
         }
         ptr += (15 * 256);
     }
-    CHIPS_ASSERT(ptr == sys->pixel_buffer+256*256);
+    CHIPS_ASSERT(ptr == sys->bg_layer+256*256);
 }
 
 /* render foreground tiles
@@ -871,10 +915,13 @@ static void _bombjack_decode_background(bombjack_t* sys) {
 
     Only 7 foreground colors are possible, since 0 defines a transparent
     pixel.
+
+    The tiles are decoded into the foreground layer, and only those
+    tiles whose char or color code changed since the last frame are
+    decoded again.
 */
 static void _bombjack_decode_foreground(bombjack_t* sys) {
     CHIPS_ASSERT(sys && sys->pixel_buffer);
-    uint32_t* ptr = sys->pixel_buffer;
     /* 32x32 tiles, each 8x8 */
     for (int y = 0; y < 32; y++) {
         for (int x = 0; x < 32; x++) {
@@ -882,6 +929,12 @@ static void _bombjack_decode_foreground(bombjack_t* sys) {
             /* char codes are at 0x9000, color codes at 0x9400, RAM starts at 0x8000 */
             uint8_t chr = sys->main_ram[(0x9000-0x8000) + addr];
             uint8_t clr = sys->main_ram[(0x9400-0x8000) + addr];
+            uint16_t code = ((clr & 0x1F)<<8) | chr;
+            if (sys->fg_cache[addr] == code) {
+                continue;
+            }
+            sys->fg_cache[addr] = code;
+            uint8_t* ptr = &sys->fg_layer[y*8*256 + x*8];
             /* 512 foreground tiles, take 9th bit from color code */
             int tile_code = chr | ((clr & 0x10)<<4);
             /* 16 color blocks a 8 colors */
@@ -898,18 +951,12 @@ static void _bombjack_decode_foreground(bombjack_t* sys) {
                 off++;
                 for (int xx = 7; xx >= 0; xx--) {
                     uint8_t pen = ((bm2>>xx)&1) | (((bm1>>xx)&1)<<1) | (((bm0>>xx)&1)<<2);
-                    if (pen) {
-                        *ptr = sys->mainboard.palette[color_block | pen];
-                    }
-                    ptr++;
+                    *ptr++ = pen ? (color_block | pen) : 0;
                 }
                 ptr += 248;
             }
-            ptr -= (8 * 256) - 8;
         }
-        ptr += (7 * 256);
     }
-    CHIPS_ASSERT(ptr == sys->pixel_buffer+256*256);
 }
 
 /*  render sprites
@@ -937,7 +984,7 @@ static void _bombjack_decode_foreground(bombjack_t* sys) {
 
 static void _bombjack_decode_sprites(bombjack_t* sys) {
     CHIPS_ASSERT(sys && sys->pixel_buffer);
-    uint32_t* dst = sys->pixel_buffer;
+    uint8_t* dst = _BOMBJACK_FRAME(sys);
     /* 24 hardware sprites, sprite 0 has highest priority */
     for (int sprite_nr = 23; sprite_nr >= 0; sprite_nr--) {
         /* sprite RAM starts at 0x9820, RAM starts at 0x8000 */
@@ -954,7 +1001,7 @@ static void _bombjack_decode_sprites(bombjack_t* sys) {
         if (b0 & 0x80) {
             /* 32x32 'large' sprites (no flip-x/y needed) */
             int py = 225 - b2;
-            uint32_t* ptr = dst + py*256 + px;
+            uint8_t* ptr = dst + py*256 + px;
             /* offset into sprite ROM to gather sprite bitmap pixels */
             int off = sprite_code * 128;
             for (int y = 0; y < 32; y++) {
@@ -971,7 +1018,7 @@ static void _bombjack_decode_sprites(bombjack_t* sys) {
                 for (int x = 31; x >= 0; x--) {
                     uint8_t pen = ((bm2>>x)&1) | (((bm1>>x)&1)<<1) | (((bm0>>x)&1)<<2);
                     if (0 != pen) {
-                        *ptr = sys->mainboard.palette[color_block | pen];
+                        *ptr = color_block | pen;
                     }
                     ptr++;
                 }
@@ -981,7 +1028,7 @@ static void _bombjack_decode_sprites(bombjack_t* sys) {
         else {
             /* 16*16 sprites are decoded like 16x16 background tiles */
             int py = 241 - b2;
-            uint32_t* ptr = dst + py*256 + px;
+            uint8_t* ptr = dst + py*256 + px;
             bool flip_x = (b1 & 0x80) != 0;
             bool flip_y = (b1 & 0x40) != 0;
             if (flip_x) {
@@ -1001,7 +1048,7 @@ static void _bombjack_decode_sprites(bombjack_t* sys) {
                     for (int x=0; x<=15; x++) {
                         uint8_t pen = ((bm2>>x)&1) | (((bm1>>x)&1)<<1) | (((bm0>>x)&1)<<2);
                         if (0 != pen) {
-                            *ptr = sys->mainboard.palette[color_block | pen];
+                            *ptr = color_block | pen;
                         }
                         ptr++;
                     }
@@ -1010,7 +1057,7 @@ static void _bombjack_decode_sprites(bombjack_t* sys) {
                     for (int x=15; x>=0; x--) {
                         uint8_t pen = ((bm2>>x)&1) | (((bm1>>x)&1)<<1) | (((bm0>>x)&1)<<2);
                         if (0 != pen) {
-                            *ptr = sys->mainboard.palette[color_block | pen];
+                            *ptr = color_block | pen;
                         }
                         ptr++;
                     }
@@ -1023,22 +1070,56 @@ static void _bombjack_decode_sprites(bombjack_t* sys) {
 
 void bombjack_decode_video(bombjack_t* sys) {
     if (sys->pixel_buffer) {
+        /* the layers are decoded as palette indices into the frame buffer */
+        uint8_t* frame = _BOMBJACK_FRAME(sys);
         if (sys->dbg.draw_background_layer) {
             _bombjack_decode_background(sys);
+            memcpy(frame, sys->bg_layer, sizeof(sys->bg_layer));
         }
         else {
             if (sys->dbg.clear_background_layer) {
-                for (int i = 0; i < _BOMBJACK_DISPLAY_WIDTH*_BOMBJACK_DISPLAY_HEIGHT; i++) {
-                    sys->pixel_buffer[i] = 0xFF000000;
-                }
+                memset(frame, _BOMBJACK_COLOR_BLACK, _BOMBJACK_DISPLAY_WIDTH*_BOMBJACK_DISPLAY_HEIGHT);
             }
         }
         if (sys->dbg.draw_foreground_layer) {
             _bombjack_decode_foreground(sys);
+            const uint8_t* fg = sys->fg_layer;
+            for (int i = 0; i < _BOMBJACK_DISPLAY_WIDTH*_BOMBJACK_DISPLAY_HEIGHT; i++) {
+                if (fg[i]) {
+                    frame[i] = fg[i];
+                }
+            }
         }
         if (sys->dbg.draw_sprite_layer) {
             _bombjack_decode_sprites(sys);
         }
+        /* ...and then the changed lines are copied or converted to RGBA8 */
+        const uint32_t* pal = sys->mainboard.palette;
+        for (int y = 0; y < _BOMBJACK_DISPLAY_HEIGHT; y++) {
+            const uint8_t* src = &frame[y * _BOMBJACK_DISPLAY_WIDTH];
+            bool changed;
+            if (sys->indexed_pixels) {
+                uint8_t* dst = &((uint8_t*)sys->pixel_buffer)[y * _BOMBJACK_DISPLAY_WIDTH];
+                changed = 0 != memcmp(dst, src, _BOMBJACK_DISPLAY_WIDTH);
+                if (changed) {
+                    memcpy(dst, src, _BOMBJACK_DISPLAY_WIDTH);
+                }
+            }
+            else {
+                uint32_t row[_BOMBJACK_DISPLAY_WIDTH];
+                for (int x = 0; x < _BOMBJACK_DISPLAY_WIDTH; x++) {
+                    row[x] = pal[src[x]];
+                }
+                uint32_t* dst = &sys->pixel_buffer[y * _BOMBJACK_DISPLAY_WIDTH];
+                changed = 0 != memcmp(dst, row, sizeof(row));
+                if (changed) {
+                    memcpy(dst, row, sizeof(row));
+                }
+            }
+            if (changed) {
+                mem_dirty_row(sys->dirty_rows, y);
+            }
+        }
     }
 }
 
@@ -28,6 +28,7 @@
     - chips/kbd.h
     - chips/mem.h
     - chips/clk.h
+    - chips/movie.h
 
     ## The Commodore C64
 
@@ -249,6 +250,7 @@ extern "C" {
 #define C64_FREQUENCY (985248)              /* clock frequency in Hz */
 #define C64_MAX_AUDIO_SAMPLES (1024)        /* max number of audio samples in internal sample buffer */
 #define C64_DEFAULT_AUDIO_SAMPLES (128)     /* default number of samples in internal sample buffer */ 
+#define C64_DEFAULT_WARP_FRAMES (16)        /* default max number of frames per c64_exec() in auto-warp mode */
 #define C64_MAX_TAPE_SIZE (512*1024)        /* max size of cassette tape image */
 
 /* C64 joystick types */
@@ -284,6 +286,7 @@ typedef struct {
     void* pixel_buffer;         /* pointer to a linear RGBA8 pixel buffer, 
                                    at least 512*312*4 bytes, or ask via c64_max_display_size() */
     int pixel_buffer_size;      /* size of the pixel buffer in bytes */
+    bool indexed_pixels;        /* pixel_buffer receives 8-bit color indices (see c64_palette()) */
 
     /* optional user-data for callback functions */
     void* user_data;
@@ -296,6 +299,13 @@ typedef struct {
     float audio_beeper_volume;      /* audio volume of the tape-beeper (0.0 .. 1.0), default is 0.1 */
     bool audio_tape_sound;          /* if true, tape loading is audible */
 
+    /* intercept the KERNAL LOAD routine to instantly load standard-encoded tape files */
+    bool tape_load_trap;
+
+    /* auto-warp: run faster without video decoding and audio output while the tape motor is on */
+    bool auto_warp;
+    int warp_frames;                /* max frames per c64_exec() while warping, default is C64_DEFAULT_WARP_FRAMES */
+
     /* ROM images */
     const void* rom_char;           /* 4 KByte character ROM dump */
     const void* rom_basic;          /* 8 KByte BASIC dump */
@@ -349,7 +359,15 @@ typedef struct {
     int tape_size;      /* tape_size > 0: a tape is inserted */
     int tape_pos;
     int tape_tick_count;
+    bool tape_load_trap;    /* true if KERNAL LOAD trap is enabled */
+    bool tape_t64;          /* true if inserted tape is a T64 image (only loadable via trap) */
     uint8_t tape_buf[C64_MAX_TAPE_SIZE];
+
+    bool auto_warp;     /* auto-warp while loading enabled */
+    bool warping;       /* true while c64_exec() is warping */
+    int warp_frames;
+
+    movie_t* movie;     /* optional input recorder/player */
 } c64_t;
 
 /* initialize a new C64 instance */
@@ -364,6 +382,10 @@ int c64_max_display_size(void);
 /* get the current framebuffer width and height in pixels */
 int c64_display_width(c64_t* sys);
 int c64_display_height(c64_t* sys);
+/* get the RGBA8 colors for an indexed pixel buffer, returns number of colors */
+int c64_palette(c64_t* sys, uint32_t* rgba8, int max_colors);
+/* get and clear the bitmap of display lines changed since the last call (1 bit per line), returns number of lines */
+int c64_dirty_rows(c64_t* sys, uint32_t* bits, int max_rows);
 /* reset a C64 instance */
 void c64_reset(c64_t* sys);
 /* tick C64 instance for a given number of microseconds, also updates keyboard state */
@@ -380,7 +402,7 @@ void c64_set_joystick_type(c64_t* sys, c64_joystick_type_t type);
 c64_joystick_type_t c64_joystick_type(c64_t* sys);
 /* set joystick mask (combination of C64_JOYSTICK_*) */
 void c64_joystick(c64_t* sys, uint8_t joy1_mask, uint8_t joy2_mask);
-/* insert a tape file */
+/* insert a tape file (.tap, or .t64 if the tape load trap is enabled) */
 bool c64_insert_tape(c64_t* sys, const uint8_t* ptr, int num_bytes);
 /* remove tape file */
 void c64_remove_tape(c64_t* sys);
@@ -390,6 +412,12 @@ void c64_start_tape(c64_t* sys);
 void c64_stop_tape(c64_t* sys);
 /* quickload a .bin file (only tested with wlorenz tests) */
 bool c64_quickload(c64_t* sys, const uint8_t* ptr, int num_bytes);
+/* return true while loading from tape is in progress (tape motor on) */
+bool c64_loading(c64_t* sys);
+/* enable/disable auto-warp while loading */
+void c64_set_auto_warp(c64_t* sys, bool enabled);
+/* attach a movie recorder or player (or detach with a null pointer) */
+void c64_attach_movie(c64_t* sys, movie_t* movie);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -410,6 +438,13 @@ bool c64_quickload(c64_t* sys, const uint8_t* ptr, int num_bytes);
 #define _C64_DISPLAY_SIZE (_C64_DBG_DISPLAY_WIDTH*_C64_DBG_DISPLAY_HEIGHT*4)
 #define _C64_DISPLAY_X (64)
 #define _C64_DISPLAY_Y (24)
+#define _C64_KERNAL_LOAD (0xF4A5)
+#define _C64_TAP_SHORT (1)
+#define _C64_TAP_MEDIUM (2)
+#define _C64_TAP_LONG (3)
+#define _C64_TAP_HEADER_SIZE (192)
+#define _C64_T64_HEADER_SIZE (64)
+#define _C64_T64_ENTRY_SIZE (32)
 
 static uint64_t _c64_tick(c64_t* sys, uint64_t pins);
 static uint8_t _c64_cpu_port_in(void* user_data);
@@ -423,18 +458,22 @@ static void _c64_update_memory_map(c64_t* sys);
 static void _c64_init_key_map(c64_t* sys);
 static void _c64_init_memory_map(c64_t* sys);
 static bool _c64_tape_tick(c64_t* sys);
+static uint64_t _c64_tape_load(c64_t* sys, uint64_t pins);
+static void _c64_key_down(c64_t* sys, int key_code);
+static void _c64_key_up(c64_t* sys, int key_code);
 
 #define _C64_DEFAULT(val,def) (((val) != 0) ? (val) : (def));
 #define _C64_CLEAR(val) memset(&val, 0, sizeof(val))
 
 void c64_init(c64_t* sys, const c64_desc_t* desc) {
     CHIPS_ASSERT(sys && desc);
-    CHIPS_ASSERT(!desc->pixel_buffer || (desc->pixel_buffer_size >= _C64_DISPLAY_SIZE));
+    CHIPS_ASSERT(!desc->pixel_buffer || (desc->pixel_buffer_size >= (desc->indexed_pixels ? _C64_DISPLAY_SIZE/4 : _C64_DISPLAY_SIZE)));
 
     memset(sys, 0, sizeof(c64_t));
     sys->valid = true;
     sys->joystick_type = desc->joystick_type;
     sys->tape_sound = desc->audio_tape_sound;
+    sys->tape_load_trap = desc->tape_load_trap;
     CHIPS_ASSERT(desc->rom_char && (desc->rom_char_size == sizeof(sys->rom_char)));
     CHIPS_ASSERT(desc->rom_basic && (desc->rom_basic_size == sizeof(sys->rom_basic)));
     CHIPS_ASSERT(desc->rom_kernal && (desc->rom_kernal_size == sizeof(sys->rom_kernal)));
@@ -445,6 +484,8 @@ void c64_init(c64_t* sys, const c64_desc_t* desc) {
     sys->audio_cb = desc->audio_cb;
     sys->num_samples = _C64_DEFAULT(desc->audio_num_samples, C64_DEFAULT_AUDIO_SAMPLES);
     CHIPS_ASSERT(sys->num_samples <= C64_MAX_AUDIO_SAMPLES);
+    sys->auto_warp = desc->auto_warp;
+    sys->warp_frames = _C64_DEFAULT(desc->warp_frames, C64_DEFAULT_WARP_FRAMES);
 
     /* initialize the hardware */
     sys->cpu_port = 0xF7;       /* for initial memory mapping */
@@ -472,8 +513,14 @@ void c64_init(c64_t* sys, const c64_desc_t* desc) {
     m6569_desc_t vic_desc;
     _C64_CLEAR(vic_desc);
     vic_desc.fetch_cb = _c64_vic_fetch;
-    vic_desc.rgba8_buffer = (uint32_t*) desc->pixel_buffer;
-    vic_desc.rgba8_buffer_size = desc->pixel_buffer_size;
+    if (desc->indexed_pixels) {
+        vic_desc.index8_buffer = (uint8_t*) desc->pixel_buffer;
+        vic_desc.index8_buffer_size = desc->pixel_buffer_size;
+    }
+    else {
+        vic_desc.rgba8_buffer = (uint32_t*) desc->pixel_buffer;
+        vic_desc.rgba8_buffer_size = desc->pixel_buffer_size;
+    }
     vic_desc.vis_x = _C64_DISPLAY_X;
     vic_desc.vis_y = _C64_DISPLAY_Y;
     vic_desc.vis_w = _C64_STD_DISPLAY_WIDTH;
@@ -524,6 +571,16 @@ int c64_display_height(c64_t* sys) {
     return m6569_display_height(&sys->vic);
 }
 
+int c64_palette(c64_t* sys, uint32_t* rgba8, int max_colors) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return m6569_palette(&sys->vic, rgba8, max_colors);
+}
+
+int c64_dirty_rows(c64_t* sys, uint32_t* bits, int max_rows) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return m6569_dirty_rows(&sys->vic, bits, max_rows);
+}
+
 void c64_reset(c64_t* sys) {
     CHIPS_ASSERT(sys && sys->valid);
     sys->cpu_port = 0xF7;
@@ -548,19 +605,128 @@ void c64_tick(c64_t* sys) {
     sys->pins = _c64_tick(sys, sys->pins);
 }
 
+static uint32_t _c64_frame_hash(c64_t* sys) {
+    uint32_t hash = movie_hash(MOVIE_HASH_SEED, sys->ram, sizeof(sys->ram));
+    return movie_hash(hash, sys->color_ram, sizeof(sys->color_ram));
+}
+
+/* apply input events from a movie at the current tick position */
+static void _c64_movie_pull(c64_t* sys) {
+    movie_event_t ev;
+    while (movie_pull(sys->movie, &ev)) {
+        switch (ev.type) {
+            case MOVIE_EVENT_FRAME:     kbd_update(&sys->kbd); break;
+            case MOVIE_EVENT_HASH:      movie_check_hash(sys->movie, &ev, _c64_frame_hash(sys)); break;
+            case MOVIE_EVENT_KEY_DOWN:  _c64_key_down(sys, (int)ev.data); break;
+            case MOVIE_EVENT_KEY_UP:    _c64_key_up(sys, (int)ev.data); break;
+            case MOVIE_EVENT_JOYSTICK:
+                sys->joy_joy1_mask = (uint8_t)ev.data;
+                sys->joy_joy2_mask = (uint8_t)(ev.data>>8);
+                break;
+            default: break;
+        }
+    }
+}
+
+/* run a number of ticks, with an attached movie, split execution at event positions */
+static void _c64_exec_ticks(c64_t* sys, uint32_t num_ticks) {
+    movie_t* movie = sys->movie;
+    uint64_t pins = sys->pins;
+    if (movie) {
+        while (num_ticks > 0) {
+            _c64_movie_pull(sys);
+            uint32_t ticks_to_run = movie_ticks_to_run(movie, num_ticks);
+            for (uint32_t ticks = 0; ticks < ticks_to_run; ticks++) {
+                pins = _c64_tick(sys, pins);
+            }
+            movie_ticks_executed(movie, ticks_to_run);
+            num_ticks -= ticks_to_run;
+        }
+    }
+    else {
+        for (uint32_t ticks = 0; ticks < num_ticks; ticks++) {
+            pins = _c64_tick(sys, pins);
+        }
+    }
+    sys->pins = pins;
+}
+
+/* per-frame keyboard and movie update, called once per emulated frame */
+static void _c64_frame_end(c64_t* sys) {
+    /* during movie playback, frame boundaries come from the movie */
+    if (sys->movie) {
+        if (!movie_playing(sys->movie)) {
+            kbd_update(&sys->kbd);
+            if (movie_frame(sys->movie)) {
+                movie_record_hash(sys->movie, _c64_frame_hash(sys));
+            }
+        }
+    }
+    else {
+        kbd_update(&sys->kbd);
+    }
+}
+
+/* run up to warp_frames frames while the tape motor is on, without video decoding and audio output */
+static void _c64_exec_warp(c64_t* sys, uint32_t num_ticks) {
+    uint32_t* rgba8_buffer = sys->vic.crt.rgba8_buffer;
+    uint8_t* index8_buffer = sys->vic.crt.index8_buffer;
+    sys->vic.crt.rgba8_buffer = 0;
+    sys->vic.crt.index8_buffer = 0;
+    sys->warping = true;
+    for (int i = 0; (i < sys->warp_frames) && c64_loading(sys); i++) {
+        _c64_exec_ticks(sys, num_ticks);
+        _c64_frame_end(sys);
+    }
+    sys->warping = false;
+    sys->vic.crt.rgba8_buffer = rgba8_buffer;
+    sys->vic.crt.index8_buffer = index8_buffer;
+}
+
 void c64_exec(c64_t* sys, uint32_t micro_seconds) {
     CHIPS_ASSERT(sys && sys->valid);
     uint32_t num_ticks = clk_us_to_ticks(C64_FREQUENCY, micro_seconds);
-    uint64_t pins = sys->pins;
-    for (uint32_t ticks = 0; ticks < num_ticks; ticks++) {
-        pins = _c64_tick(sys, pins);
+    if (sys->auto_warp && c64_loading(sys)) {
+        _c64_exec_warp(sys, num_ticks);
     }
-    sys->pins = pins;
-    kbd_update(&sys->kbd);
+    else {
+        _c64_exec_ticks(sys, num_ticks);
+        _c64_frame_end(sys);
+    }
+}
+
+bool c64_loading(c64_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return sys->tape_motor && (sys->tape_size > 0) && (sys->tape_pos < sys->tape_size) && !sys->tape_t64;
+}
+
+void c64_set_auto_warp(c64_t* sys, bool enabled) {
+    CHIPS_ASSERT(sys && sys->valid);
+    sys->auto_warp = enabled;
+}
+
+void c64_attach_movie(c64_t* sys, movie_t* movie) {
+    CHIPS_ASSERT(sys && sys->valid);
+    sys->movie = movie;
 }
 
 void c64_key_down(c64_t* sys, int key_code) {
     CHIPS_ASSERT(sys && sys->valid);
+    if (sys->movie && !movie_input(sys->movie, MOVIE_EVENT_KEY_DOWN, (uint32_t)key_code)) {
+        return;
+    }
+    _c64_key_down(sys, key_code);
+}
+
+void c64_key_up(c64_t* sys, int key_code) {
+    CHIPS_ASSERT(sys && sys->valid);
+    if (sys->movie && !movie_input(sys->movie, MOVIE_EVENT_KEY_UP, (uint32_t)key_code)) {
+        return;
+    }
+    _c64_key_up(sys, key_code);
+}
+
+static void _c64_key_down(c64_t* sys, int key_code) {
     if (sys->joystick_type == C64_JOYSTICKTYPE_NONE) {
         kbd_key_down(&sys->kbd, key_code);
     }
@@ -592,8 +758,7 @@ void c64_key_down(c64_t* sys, int key_code) {
     }
 }
 
-void c64_key_up(c64_t* sys, int key_code) {
-    CHIPS_ASSERT(sys && sys->valid);
+static void _c64_key_up(c64_t* sys, int key_code) {
     if (sys->joystick_type == C64_JOYSTICKTYPE_NONE) {
         kbd_key_up(&sys->kbd, key_code);
     }
@@ -637,6 +802,9 @@ c64_joystick_type_t c64_joystick_type(c64_t* sys) {
 
 void c64_joystick(c64_t* sys, uint8_t joy1_mask, uint8_t joy2_mask) {
     CHIPS_ASSERT(sys && sys->valid);
+    if (sys->movie && !movie_input(sys->movie, MOVIE_EVENT_JOYSTICK, joy1_mask | (joy2_mask<<8))) {
+        return;
+    }
     sys->joy_joy1_mask = joy1_mask;
     sys->joy_joy2_mask = joy2_mask;
 }
@@ -669,7 +837,7 @@ static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
         }
         sys->sample_buffer[sys->sample_pos++] = sample;
         if (sys->sample_pos == sys->num_samples) {
-            if (sys->audio_cb) {
+            if (sys->audio_cb && !sys->warping) {
                 sys->audio_cb(sys->sample_buffer, sys->num_samples, sys->user_data);
             }
             sys->sample_pos = 0;
@@ -770,6 +938,15 @@ static uint64_t _c64_tick(c64_t* sys, uint64_t pins) {
             }
         }
     }
+
+    /* check if the KERNAL LOAD routine was hit to implement instant tape loading */
+    if (sys->tape_load_trap && (sys->tape_size > 0)) {
+        const uint64_t trap_mask = M6502_SYNC|0xFFFF;
+        const uint64_t trap_val  = M6502_SYNC|_C64_KERNAL_LOAD;
+        if (((pins & trap_mask) == trap_val) && (sys->cpu_port & C64_CPUPORT_HIRAM)) {
+            pins = _c64_tape_load(sys, pins);
+        }
+    }
     return pins;
 }
 
@@ -1055,6 +1232,16 @@ bool c64_insert_tape(c64_t* sys, const uint8_t* ptr, int num_bytes) {
     if (num_bytes <= (int) sizeof(_c64_tap_header)) {
         return false;
     }
+    /* T64 images can only be loaded through the KERNAL LOAD trap */
+    if ((0 == memcmp(ptr, "C64", 3)) && (0 != memcmp(ptr, "C64-TAPE-RAW", 12))) {
+        if (!sys->tape_load_trap || (num_bytes < _C64_T64_HEADER_SIZE) || (num_bytes > (int)sizeof(sys->tape_buf))) {
+            return false;
+        }
+        memcpy(sys->tape_buf, ptr, num_bytes);
+        sys->tape_size = num_bytes;
+        sys->tape_t64 = true;
+        return true;
+    }
     const _c64_tap_header* hdr = (const _c64_tap_header*) ptr;
     ptr += sizeof(_c64_tap_header);
     const uint8_t sig[12] = { 'C','6','4','-','T','A','P','E','-','R','A','W'};
@@ -1086,6 +1273,7 @@ void c64_remove_tape(c64_t* sys) {
     sys->tape_size = 0;
     sys->tape_pos = 0;
     sys->tape_tick_count = 0;
+    sys->tape_t64 = false;
 }
 
 void c64_start_tape(c64_t* sys) {
@@ -1101,7 +1289,7 @@ void c64_stop_tape(c64_t* sys) {
 }
 
 static bool _c64_tape_tick(c64_t* sys) {
-    if (sys->tape_motor && (sys->tape_size > 0) && (sys->tape_pos <= sys->tape_size)) {
+    if (sys->tape_motor && (sys->tape_size > 0) && (sys->tape_pos <= sys->tape_size) && !sys->tape_t64) {
         if (sys->tape_tick_count == 0) {
             if (sys->tape_sound) {
                 beeper_toggle(&sys->beeper);
@@ -1140,4 +1328,286 @@ bool c64_quickload(c64_t* sys, const uint8_t* ptr, int num_bytes) {
     }
     return true;
 }
+/*=== KERNAL LOAD TRAP =======================================================*/
+
+/*  The optional tape-load trap intercepts the KERNAL LOAD routine (the
+    default target of the ILOAD vector at 0x0330) when loading from
+    device 1, decodes the standard KERNAL tape encoding directly from the
+    TAP pulse data (or copies the file from a T64 image), and returns to
+    the caller as if the KERNAL had loaded the file.
+
+    If the requested file can't be found or decoded (for instance because
+    it's recorded with a turbo loader), the trap does nothing and the
+    KERNAL routine loads from the datasette in real time. After a
+    successful load, the tape position is behind the loaded file, so that
+    a loader in the loaded program continues with real tape playback.
+
+    Standard encoding: each byte starts with a (long, medium) pulse pair,
+    followed by 8 data bits (LSB first) and an odd-parity bit, where a 0-bit
+    is a (short, medium) and a 1-bit a (medium, short) pulse pair. A
+    (long, short) pulse pair marks the end of a block. Each block starts
+    with the countdown 0x89..0x81 (or 0x09..0x01 in the repeated copy),
+    followed by the data bytes and an XOR checksum byte.
+*/
+/* read the next pulse and classify as short, medium or long (0 if none of those, -1 at end of tape) */
+static int _c64_tap_pulse(c64_t* sys, int* pos) {
+    if (*pos >= sys->tape_size) {
+        return -1;
+    }
+    int len = sys->tape_buf[(*pos)++];
+    if (len == 0) {
+        if ((*pos + 3) > sys->tape_size) {
+            return -1;
+        }
+        const uint8_t* p = &sys->tape_buf[*pos];
+        len = ((p[2]<<16) | (p[1]<<8) | p[0]) / 8;
+        *pos += 3;
+    }
+    if ((len >= 0x24) && (len < 0x39)) {
+        return _C64_TAP_SHORT;
+    }
+    else if ((len >= 0x39) && (len < 0x4C)) {
+        return _C64_TAP_MEDIUM;
+    }
+    else if ((len >= 0x4C) && (len < 0x64)) {
+        return _C64_TAP_LONG;
+    }
+    else {
+        return 0;
+    }
+}
+
+/* decode one byte following a byte marker, return -1 on error */
+static int _c64_tap_byte(c64_t* sys, int* pos) {
+    int val = 0;
+    int parity = 1;
+    for (int i = 0; i < 9; i++) {
+        const int p0 = _c64_tap_pulse(sys, pos);
+        const int p1 = _c64_tap_pulse(sys, pos);
+        int bit;
+        if ((p0 == _C64_TAP_SHORT) && (p1 == _C64_TAP_MEDIUM)) {
+            bit = 0;
+        }
+        else if ((p0 == _C64_TAP_MEDIUM) && (p1 == _C64_TAP_SHORT)) {
+            bit = 1;
+        }
+        else {
+            return -1;
+        }
+        if (i < 8) {
+            val |= bit<<i;
+        }
+        parity ^= bit;
+    }
+    return (parity == 0) ? val : -1;
+}
+
+/* decode the next valid block starting at *pos into dst (may be null),
+   returns the number of data bytes (without countdown and checksum),
+   or -1 if no more valid blocks are on the tape, blocks with errors
+   are skipped
+*/
+static int _c64_tap_read_block(c64_t* sys, int* pos, uint8_t* dst, int max_bytes, bool* out_repeat) {
+    int prev_pulse = 0;
+    int pulse;
+    while ((pulse = _c64_tap_pulse(sys, pos)) >= 0) {
+        if ((prev_pulse != _C64_TAP_LONG) || (pulse != _C64_TAP_MEDIUM)) {
+            prev_pulse = pulse;
+            continue;
+        }
+        /* found the byte marker of the first byte in a block */
+        prev_pulse = 0;
+        const int block_pos = *pos;
+        int num_bytes = 0;
+        int num_data = 0;
+        int last = -1;
+        uint8_t checksum = 0;
+        bool repeat = false;
+        bool valid = true;
+        for (;;) {
+            const int val = _c64_tap_byte(sys, pos);
+            if (val < 0) {
+                valid = false;
+                break;
+            }
+            if (num_bytes < 9) {
+                /* countdown sequence */
+                if (num_bytes == 0) {
+                    repeat = 0 == (val & 0x80);
+                }
+                if (val != ((repeat ? 0x09 : 0x89) - num_bytes)) {
+                    valid = false;
+                    break;
+                }
+            }
+            else {
+                /* the last byte is the checksum, so data bytes are committed one byte late */
+                if (last >= 0) {
+                    if (dst && (num_data < max_bytes)) {
+                        dst[num_data] = (uint8_t) last;
+                    }
+                    checksum ^= (uint8_t) last;
+                    num_data++;
+                }
+                last = val;
+            }
+            num_bytes++;
+            /* next byte marker, or end-of-block marker */
+            const int p0 = _c64_tap_pulse(sys, pos);
+            const int p1 = _c64_tap_pulse(sys, pos);
+            if ((p0 != _C64_TAP_LONG) || (p1 != _C64_TAP_MEDIUM)) {
+                break;
+            }
+        }
+        if (valid && (last >= 0) && (checksum == (uint8_t)last)) {
+            *out_repeat = repeat;
+            return num_data;
+        }
+        /* not a valid block, continue searching behind the block start */
+        *pos = block_pos;
+    }
+    return -1;
+}
+
+/* compare the filename requested by the LOAD call with a tape filename (PETSCII, 16 chars) */
+static bool _c64_tape_match_name(c64_t* sys, const uint8_t* name) {
+    int len = mem_rd(&sys->mem_cpu, 0xB7);
+    const uint16_t addr = mem_rd(&sys->mem_cpu, 0xBB) | (mem_rd(&sys->mem_cpu, 0xBC)<<8);
+    if (len > 16) {
+        len = 16;
+    }
+    for (int i = 0; i < len; i++) {
+        if (mem_rd(&sys->mem_cpu, (addr + i) & 0xFFFF) != name[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* load the requested file from a TAP image, return load end address, or -1 on failure */
+static int _c64_tap_load(c64_t* sys, uint16_t reloc_addr, bool reloc) {
+    int pos = sys->tape_pos;
+    uint8_t hdr[_C64_TAP_HEADER_SIZE];
+    bool repeat;
+    for (;;) {
+        const int num_bytes = _c64_tap_read_block(sys, &pos, hdr, sizeof(hdr), &repeat);
+        if ((num_bytes < 0) || ((num_bytes == _C64_TAP_HEADER_SIZE) && (hdr[0] == 5))) {
+            /* end of tape */
+            return -1;
+        }
+        if ((num_bytes != _C64_TAP_HEADER_SIZE) || ((hdr[0] != 1) && (hdr[0] != 3))) {
+            continue;
+        }
+        if (!_c64_tape_match_name(sys, &hdr[5])) {
+            continue;
+        }
+        const uint16_t start_addr = hdr[1] | (hdr[2]<<8);
+        const uint16_t end_addr = hdr[3] | (hdr[4]<<8);
+        if (end_addr <= start_addr) {
+            return -1;
+        }
+        const int len = end_addr - start_addr;
+        /* skip the repeated header */
+        int p = pos;
+        if ((_c64_tap_read_block(sys, &p, 0, 0, &repeat) == _C64_TAP_HEADER_SIZE) && repeat) {
+            pos = p;
+        }
+        /* the data block, first check, then copy into RAM */
+        const uint16_t addr = ((hdr[0] == 1) && reloc) ? reloc_addr : start_addr;
+        if ((addr + len) > 0x10000) {
+            return -1;
+        }
+        p = pos;
+        if (_c64_tap_read_block(sys, &p, 0, 0, &repeat) < len) {
+            return -1;
+        }
+        _c64_tap_read_block(sys, &pos, &sys->ram[addr], len, &repeat);
+        /* skip the repeated data block */
+        if (!repeat) {
+            p = pos;
+            if ((_c64_tap_read_block(sys, &p, 0, 0, &repeat) >= 0) && repeat) {
+                pos = p;
+            }
+        }
+        sys->tape_pos = pos;
+        return addr + len;
+    }
+}
+
+/* load the requested file from a T64 image, return load end address, or -1 on failure */
+static int _c64_t64_load(c64_t* sys, uint16_t reloc_addr, bool reloc) {
+    const uint8_t* buf = sys->tape_buf;
+    const int num_entries = buf[0x22] | (buf[0x23]<<8);
+    if (num_entries == 0) {
+        return -1;
+    }
+    /* T64 files are random access, search starts behind the last loaded file */
+    for (int i = 0; i < num_entries; i++) {
+        const int entry_index = (sys->tape_pos + i) % num_entries;
+        const int entry_pos = _C64_T64_HEADER_SIZE + entry_index * _C64_T64_ENTRY_SIZE;
+        if ((entry_pos + _C64_T64_ENTRY_SIZE) > sys->tape_size) {
+            continue;
+        }
+        const uint8_t* entry = &buf[entry_pos];
+        if ((entry[0] != 1) || !_c64_tape_match_name(sys, &entry[16])) {
+            continue;
+        }
+        const uint16_t start_addr = entry[2] | (entry[3]<<8);
+        const uint16_t end_addr = entry[4] | (entry[5]<<8);
+        const int offset = entry[8] | (entry[9]<<8) | (entry[10]<<16) | (entry[11]<<24);
+        if ((end_addr <= start_addr) || (offset < 0) || (offset >= sys->tape_size)) {
+            return -1;
+        }
+        int len = end_addr - start_addr;
+        /* many T64 files have a bogus end address, clamp to the file size */
+        if ((offset + len) > sys->tape_size) {
+            len = sys->tape_size - offset;
+        }
+        const uint16_t addr = reloc ? reloc_addr : start_addr;
+        if ((addr + len) > 0x10000) {
+            return -1;
+        }
+        memcpy(&sys->ram[addr], &buf[offset], len);
+        sys->tape_pos = entry_index + 1;
+        return addr + len;
+    }
+    return -1;
+}
+
+/* the trapped KERNAL LOAD routine, returns unmodified pins if the file wasn't loaded */
+static uint64_t _c64_tape_load(c64_t* sys, uint64_t pins) {
+    /* only for device 1 (datasette), no verify, and a standard KERNAL */
+    const uint8_t* rom = &sys->rom_kernal[_C64_KERNAL_LOAD - 0xE000];
+    if ((rom[0] != 0x85) || (rom[1] != 0x93)) {
+        return pins;
+    }
+    if ((mem_rd(&sys->mem_cpu, 0xBA) != 1) || (m6502_a(&sys->cpu) != 0)) {
+        return pins;
+    }
+    /* secondary address 0 means: load to the address in 0xC3/0xC4 */
+    const bool reloc = 0 == mem_rd(&sys->mem_cpu, 0xB9);
+    const uint16_t reloc_addr = mem_rd(&sys->mem_cpu, 0xC3) | (mem_rd(&sys->mem_cpu, 0xC4)<<8);
+    const int end_addr = sys->tape_t64 ? _c64_t64_load(sys, reloc_addr, reloc) : _c64_tap_load(sys, reloc_addr, reloc);
+    if (end_addr < 0) {
+        /* fallback to real-time loading */
+        return pins;
+    }
+    /* return to the caller of LOAD like the KERNAL would: end address in X/Y and 0xAE/0xAF, carry clear */
+    mem_wr(&sys->mem_cpu, 0x90, 0);
+    mem_wr(&sys->mem_cpu, 0xAE, end_addr & 0xFF);
+    mem_wr(&sys->mem_cpu, 0xAF, (end_addr>>8) & 0xFF);
+    m6502_set_x(&sys->cpu, end_addr & 0xFF);
+    m6502_set_y(&sys->cpu, (end_addr>>8) & 0xFF);
+    m6502_set_p(&sys->cpu, m6502_p(&sys->cpu) & ~M6502_CF);
+    /* simulate an RTS */
+    uint8_t s = m6502_s(&sys->cpu);
+    const uint8_t l = mem_rd(&sys->mem_cpu, 0x0100 | (uint8_t)(s+1));
+    const uint8_t h = mem_rd(&sys->mem_cpu, 0x0100 | (uint8_t)(s+2));
+    m6502_set_s(&sys->cpu, s+2);
+    const uint16_t ret_addr = ((h<<8) | l) + 1;
+    M6502_SET_ADDR(pins, ret_addr);
+    M6502_SET_DATA(pins, mem_rd(&sys->mem_cpu, ret_addr));
+    m6502_set_pc(&sys->cpu, ret_addr);
+    return pins;
+}
 #endif /* CHIPS_IMPL */
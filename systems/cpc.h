@@ -76,6 +76,7 @@ extern "C" {
 
 #define CPC_MAX_AUDIO_SAMPLES (1024)        /* max number of audio samples in internal sample buffer */
 #define CPC_DEFAULT_AUDIO_SAMPLES (128)     /* default number of samples in internal sample buffer */
+#define CPC_DEFAULT_WARP_FRAMES (16)        /* default max number of frames per cpc_exec() in auto-warp mode */
 #define CPC_MAX_TAPE_SIZE (128*1024)        /* max size of tape file in bytes */
 
 /* CPC model types */
@@ -111,6 +112,7 @@ typedef struct {
     /* video output config */
     void* pixel_buffer;         /* pointer to a linear RGBA8 pixel buffer, at least 1024*312*4 bytes */
     int pixel_buffer_size;      /* size of the pixel buffer in bytes */
+    bool indexed_pixels;        /* pixel_buffer receives 8-bit color indices (see cpc_palette()) */
 
     /* optional user-data for audio- and video-debugging callbacks */
     void* user_data;
@@ -121,6 +123,10 @@ typedef struct {
     int audio_sample_rate;          /* playback sample rate, default is 44100 */
     float audio_volume;             /* audio volume: 0.0..1.0, default is 0.25 */
 
+    /* auto-warp: run faster without video decoding and audio output while the floppy motor is on */
+    bool auto_warp;
+    int warp_frames;                /* max frames per cpc_exec() while warping, default is CPC_DEFAULT_WARP_FRAMES */
+
     /* ROM images */
     const void* rom_464_os;
     const void* rom_464_basic;
@@ -173,6 +179,10 @@ typedef struct {
     uint8_t tape_buf[CPC_MAX_TAPE_SIZE];
     /* floppy disc drive */
     fdd_t fdd;
+    /* auto-warp while loading */
+    bool auto_warp;
+    bool warping;       /* true while cpc_exec() is warping */
+    int warp_frames;
 } cpc_t;
 
 /* initialize a new CPC instance */
@@ -187,6 +197,10 @@ int cpc_max_display_size(void);
 /* get the current framebuffer width and height in pixels */
 int cpc_display_width(cpc_t* sys);
 int cpc_display_height(cpc_t* sys);
+/* get the RGBA8 colors for an indexed pixel buffer, returns number of colors */
+int cpc_palette(cpc_t* sys, uint32_t* rgba8, int max_colors);
+/* get and clear the bitmap of display lines changed since the last call (1 bit per line), returns number of lines */
+int cpc_dirty_rows(cpc_t* sys, uint32_t* bits, int max_rows);
 /* reset a CPC instance */
 void cpc_reset(cpc_t* cpc);
 /* run CPC instance for given amount of micro_seconds */
@@ -211,6 +225,10 @@ void cpc_remove_tape(cpc_t* cpc);
 bool cpc_insert_disc(cpc_t* cpc, const uint8_t* ptr, int num_bytes);
 /* remove current disc */
 void cpc_remove_disc(cpc_t* cpc);
+/* return true while loading from disc is in progress (floppy motor on, or FDC busy) */
+bool cpc_loading(cpc_t* cpc);
+/* enable/disable auto-warp while loading */
+void cpc_set_auto_warp(cpc_t* cpc, bool enabled);
 /* if enabled, start calling the video-debugging-callback */
 void cpc_enable_video_debugging(cpc_t* cpc, bool enabled);
 /* get current display debug visualization enabled/disabled state */
@@ -251,7 +269,7 @@ static void _cpc_fdc_driveinfo(int drive, void* user_data, upd765_driveinfo_t* o
 
 void cpc_init(cpc_t* sys, const cpc_desc_t* desc) {
     CHIPS_ASSERT(sys && desc);
-    CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= cpc_max_display_size()));
+    CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= (desc->indexed_pixels ? cpc_max_display_size()/4 : cpc_max_display_size())));
 
     memset(sys, 0, sizeof(cpc_t));
     sys->valid = true;
@@ -281,6 +299,8 @@ void cpc_init(cpc_t* sys, const cpc_desc_t* desc) {
     sys->audio_cb = desc->audio_cb;
     sys->num_samples = _CPC_DEFAULT(desc->audio_num_samples, CPC_DEFAULT_AUDIO_SAMPLES);
     CHIPS_ASSERT(sys->num_samples <= CPC_MAX_AUDIO_SAMPLES);
+    sys->auto_warp = desc->auto_warp;
+    sys->warp_frames = _CPC_DEFAULT(desc->warp_frames, CPC_DEFAULT_WARP_FRAMES);
 
     /* initialize the hardware */
     clk_init(&sys->clk, _CPC_FREQUENCY);
@@ -319,8 +339,14 @@ void cpc_init(cpc_t* sys, const cpc_desc_t* desc) {
     ga_desc.cclk_cb = _cpc_cclk;
     ga_desc.ram = &sys->ram[0][0];
     ga_desc.ram_size = sizeof(sys->ram);
-    ga_desc.rgba8_buffer = (uint32_t*) desc->pixel_buffer;
-    ga_desc.rgba8_buffer_size = desc->pixel_buffer_size;
+    if (desc->indexed_pixels) {
+        ga_desc.index8_buffer = (uint8_t*) desc->pixel_buffer;
+        ga_desc.index8_buffer_size = desc->pixel_buffer_size;
+    }
+    else {
+        ga_desc.rgba8_buffer = (uint32_t*) desc->pixel_buffer;
+        ga_desc.rgba8_buffer_size = desc->pixel_buffer_size;
+    }
     ga_desc.user_data = sys;
     am40010_init(&sys->ga, &ga_desc);
 
@@ -380,6 +406,16 @@ int cpc_display_height(cpc_t* sys) {
     return sys->ga.dbg_vis ? AM40010_DBG_DISPLAY_HEIGHT : AM40010_DISPLAY_HEIGHT;
 }
 
+int cpc_palette(cpc_t* sys, uint32_t* rgba8, int max_colors) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return am40010_palette(&sys->ga, rgba8, max_colors);
+}
+
+int cpc_dirty_rows(cpc_t* sys, uint32_t* bits, int max_rows) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return am40010_dirty_rows(&sys->ga, bits, max_rows);
+}
+
 void cpc_reset(cpc_t* sys) {
     CHIPS_ASSERT(sys && sys->valid);
     mem_unmap_all(&sys->mem);
@@ -393,8 +429,7 @@ void cpc_reset(cpc_t* sys) {
     sys->joy_joymask = 0;
 }
 
-void cpc_exec(cpc_t* sys, uint32_t micro_seconds) {
-    CHIPS_ASSERT(sys && sys->valid);
+static void _cpc_exec_frame(cpc_t* sys, uint32_t micro_seconds) {
     uint32_t ticks_to_run = clk_ticks_to_run(&sys->clk, micro_seconds);
     uint32_t ticks_executed = 0;
     int trap_id = 0;
@@ -416,7 +451,40 @@ void cpc_exec(cpc_t* sys, uint32_t micro_seconds) {
         }
     }
     clk_ticks_executed(&sys->clk, ticks_executed);
-    kbd_update(&sys->kbd);
+}
+
+void cpc_exec(cpc_t* sys, uint32_t micro_seconds) {
+    CHIPS_ASSERT(sys && sys->valid);
+    if (sys->auto_warp && cpc_loading(sys)) {
+        /* run up to warp_frames frames without video decoding and audio output */
+        uint32_t* rgba8_buffer = sys->ga.rgba8_buffer;
+        uint8_t* index8_buffer = sys->ga.index8_buffer;
+        sys->ga.rgba8_buffer = 0;
+        sys->ga.index8_buffer = 0;
+        sys->warping = true;
+        for (int i = 0; (i < sys->warp_frames) && cpc_loading(sys); i++) {
+            _cpc_exec_frame(sys, micro_seconds);
+            /* key presses and releases happen in emulated time */
+            kbd_update(&sys->kbd);
+        }
+        sys->warping = false;
+        sys->ga.rgba8_buffer = rgba8_buffer;
+        sys->ga.index8_buffer = index8_buffer;
+    }
+    else {
+        _cpc_exec_frame(sys, micro_seconds);
+        kbd_update(&sys->kbd);
+    }
+}
+
+bool cpc_loading(cpc_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    return (sys->fdd.has_disc && sys->fdd.motor_on) || (sys->fdc.phase != UPD765_PHASE_IDLE);
+}
+
+void cpc_set_auto_warp(cpc_t* sys, bool enabled) {
+    CHIPS_ASSERT(sys && sys->valid);
+    sys->auto_warp = enabled;
 }
 
 void cpc_key_down(cpc_t* sys, int key_code) {
@@ -512,7 +580,7 @@ static uint64_t _cpc_tick(int num_ticks, uint64_t pins, void* user_data) {
 static inline void _cpc_sample_ready(cpc_t* sys) {
     sys->sample_buffer[sys->sample_pos++] = sys->psg.sample;
     if (sys->sample_pos == sys->num_samples) {
-        if (sys->audio_cb) {
+        if (sys->audio_cb && !sys->warping) {
             /* new sample packet is ready */
             sys->audio_cb(sys->sample_buffer, sys->num_samples, sys->user_data);
         }
@@ -792,7 +860,7 @@ static void _cpc_init_keymap(cpc_t* sys) {
 }
 
 /* CPC6128 RAM block indices */
-static int _cpc_ram_config[8][4] = {
+static const int _cpc_ram_config[8][4] = {
     { 0, 1, 2, 3 },
     { 0, 1, 2, 7 },
     { 4, 5, 6, 7 },
@@ -886,7 +954,7 @@ static bool _cpc_is_valid_sna(const uint8_t* ptr, int num_bytes) {
         return false;
     }
     const _cpc_sna_header* hdr = (const _cpc_sna_header*) ptr;
-    static uint8_t magic[8] = { 'M', 'V', 0x20, '-', 0x20, 'S', 'N', 'A' };
+    static const uint8_t magic[8] = { 'M', 'V', 0x20, '-', 0x20, 'S', 'N', 'A' };
     for (int i = 0; i < 8; i++) {
         if (magic[i] != hdr->magic[i]) {
             return false;
@@ -260,6 +260,9 @@ extern "C" {
 #define KC85_MAX_AUDIO_SAMPLES (1024)       /* max number of audio samples in internal sample buffer */
 #define KC85_DEFAULT_AUDIO_SAMPLES (128)    /* default number of samples in internal sample buffer */ 
 #define KC85_MAX_TAPE_SIZE (64 * 1024)      /* max size of a snapshot file in bytes */
+#define KC85_SCREEN_TEXT_COLS (40)  /* text screen size in character cells */
+#define KC85_SCREEN_TEXT_ROWS (32)
+#define KC85_SCREEN_TEXT_SIZE (KC85_SCREEN_TEXT_ROWS*(KC85_SCREEN_TEXT_COLS+1)+1) /* buffer size for kc85_screen_text() */
 #define KC85_NUM_SLOTS (2)                  /* 2 expansion slots in main unit, each needs one mem_t layer! */
 #define KC85_EXP_BUFSIZE (KC85_NUM_SLOTS*64*1024) /* expansion system buffer size (64 KB per slot) */
 
@@ -307,6 +310,7 @@ typedef struct {
     /* video output config (if you don't need display decoding, set pixel_buffer to 0) */
     void* pixel_buffer;         /* pointer to a linear RGBA8 pixel buffer, at least 320*256*4 bytes */
     int pixel_buffer_size;      /* size of the pixel buffer in bytes */
+    bool indexed_pixels;        /* pixel_buffer receives 8-bit color indices (see kc85_palette()) */
 
     /* optional user-data for callback functions */
     void* user_data;
@@ -397,6 +401,10 @@ typedef struct {
     kc85_exp_t exp;         /* expansion module system */
 
     uint32_t* pixel_buffer;
+    bool indexed_pixels;
+    uint32_t colors[28];    /* foreground, background and HICOLOR colors as RGBA8 or color indices */
+    uint32_t dirty_rows[8]; /* one bit per display line which changed */
+    uint32_t pixel_cache[256*40];   /* pixel/color inputs of each decoded 8-pixel group (0xFFFFFFFF: invalid) */
     void* user_data;
     kc85_audio_callback_t audio_cb;
     int num_samples;
@@ -409,6 +417,9 @@ typedef struct {
     uint8_t rom_caos_c[0x1000];         /* 4 KByte CAOS ROM at 0xC000 (KC85/4 only) */
     uint8_t rom_caos_e[0x2000];         /* 8 KByte CAOS ROM at 0xE000 */
     uint8_t exp_buf[KC85_EXP_BUFSIZE];  /* expansion system RAM/ROM */
+    /* text screen change detection */
+    uint32_t screen_hash;
+    uint32_t screen_changes;
 } kc85_t;
 
 /* initialize a new KC85 instance */
@@ -423,6 +434,10 @@ int kc85_max_display_size(void);
 /* get the current framebuffer width and height in pixels */
 int kc85_display_width(kc85_t* sys);
 int kc85_display_height(kc85_t* sys);
+/* get the RGBA8 colors for an indexed pixel buffer, returns number of colors */
+int kc85_palette(kc85_t* sys, uint32_t* rgba8, int max_colors);
+/* get and clear the bitmap of display lines changed since the last call (1 bit per line), returns number of lines */
+int kc85_dirty_rows(kc85_t* sys, uint32_t* bits, int max_rows);
 /* reset a KC85 instance */
 void kc85_reset(kc85_t* sys);
 /* run KC85 emulation for a given number of microseconds */
@@ -455,6 +470,8 @@ const char* kc85_slot_mod_name(kc85_t* sys, uint8_t slot_addr);
 uint8_t kc85_slot_ctrl(kc85_t* sys, uint8_t slot_addr);
 /* load a .KCC or .TAP snapshot file into the emulator */
 bool kc85_quickload(kc85_t* sys, const uint8_t* ptr, int num_bytes);
+/* decode the text screen into buf (rows terminated by '\n'), returns a counter which increments when the text changes */
+uint32_t kc85_screen_text(kc85_t* sys, char* buf, int buf_size);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -482,6 +499,7 @@ static void _kc85_pio_out(int port_id, uint8_t data, void* user_data);
 static void _kc85_update_memory_map(kc85_t* sys);
 static void _kc85_init_memory_map(kc85_t* sys);
 static void _kc85_handle_keyboard(kc85_t* sys);
+static void _kc85_init_colors(kc85_t* sys);
 
 /* expansion module private functions */
 static void _kc85_exp_init(kc85_t* sys);
@@ -545,8 +563,11 @@ void kc85_init(kc85_t* sys, const kc85_desc_t* desc) {
     }
 
     /* video- and audio-output */
-    CHIPS_ASSERT((0 == desc->pixel_buffer) || (desc->pixel_buffer && (desc->pixel_buffer_size >= _KC85_DISPLAY_SIZE)));
+    CHIPS_ASSERT((0 == desc->pixel_buffer) || (desc->pixel_buffer && (desc->pixel_buffer_size >= (desc->indexed_pixels ? _KC85_DISPLAY_SIZE/4 : _KC85_DISPLAY_SIZE))));
     sys->pixel_buffer = (uint32_t*) desc->pixel_buffer;
+    sys->indexed_pixels = desc->indexed_pixels;
+    memset(sys->pixel_cache, 0xFF, sizeof(sys->pixel_cache));
+    _kc85_init_colors(sys);
     sys->audio_cb = desc->audio_cb;
     sys->patch_cb = desc->patch_cb;
     sys->user_data = desc->user_data;
@@ -659,7 +680,7 @@ void kc85_key_up(kc85_t* sys, int key_code) {
 }
 
 /* hardwired foreground colors */
-static uint32_t _kc85_fg_pal[16] = {
+static const uint32_t _kc85_fg_pal[16] = {
     0xFF000000,     /* black */
     0xFFFF0000,     /* blue */
     0xFF0000FF,     /* red */
@@ -679,7 +700,7 @@ static uint32_t _kc85_fg_pal[16] = {
 };
 
 /* background colors */
-static uint32_t _kc85_bg_pal[8] = {
+static const uint32_t _kc85_bg_pal[8] = {
     0xFF000000,      /* black */
     0xFFA00000,      /* dark-blue */
     0xFF0000A0,      /* dark-red */
@@ -691,14 +712,70 @@ static uint32_t _kc85_bg_pal[8] = {
 };
 
 /* the KC85/4 HICOLOR palette */
-static uint32_t _kc85_hicolor[4] = {
+static const uint32_t _kc85_hicolor[4] = {
     0xFF000000,     /* black */
     0xFF0000FF,     /* red */
     0xFFFFFF00,     /* cyan */
     0xFFFFFFFF,     /* white */
 };
 
-static inline void _kc85_decode_8pixels(uint32_t* ptr, uint8_t pixels, uint8_t colors, bool force_bg) {
+/* color indices 0..15 are foreground, 16..23 background and 24..27 HICOLOR colors */
+#define _KC85_COLOR_BG (16)
+#define _KC85_COLOR_HICOLOR (24)
+#define _KC85_NUM_COLORS (28)
+
+static uint32_t _kc85_palette_color(int i) {
+    if (i < _KC85_COLOR_BG) {
+        return _kc85_fg_pal[i];
+    }
+    else if (i < _KC85_COLOR_HICOLOR) {
+        return _kc85_bg_pal[i - _KC85_COLOR_BG];
+    }
+    else {
+        return _kc85_hicolor[i - _KC85_COLOR_HICOLOR];
+    }
+}
+
+static void _kc85_init_colors(kc85_t* sys) {
+    for (int i = 0; i < _KC85_NUM_COLORS; i++) {
+        sys->colors[i] = sys->indexed_pixels ? (uint32_t)i : _kc85_palette_color(i);
+    }
+}
+
+int kc85_palette(kc85_t* sys, uint32_t* rgba8, int max_colors) {
+    CHIPS_ASSERT(sys && sys->valid && rgba8);
+    int num = (max_colors < _KC85_NUM_COLORS) ? max_colors : _KC85_NUM_COLORS;
+    for (int i = 0; i < num; i++) {
+        rgba8[i] = _kc85_palette_color(i);
+    }
+    return num;
+}
+
+int kc85_dirty_rows(kc85_t* sys, uint32_t* bits, int max_rows) {
+    CHIPS_ASSERT(sys && sys->valid && bits);
+    return mem_take_dirty_rows(sys->dirty_rows, _KC85_DISPLAY_HEIGHT, bits, max_rows);
+}
+
+/* 8-pixel groups are decoded into a temporary buffer, and then written to the
+   pixel buffer (narrowed to 8 bits in indexed mode), changed lines are flagged as dirty
+*/
+static inline void _kc85_store_pixels(kc85_t* sys, const uint32_t* tmp, uint32_t x, uint32_t y) {
+    mem_store_pixels(sys->dirty_rows, (int)y, sys->pixel_buffer, sys->indexed_pixels, (int)(y*_KC85_DISPLAY_WIDTH + x*8), tmp, 8);
+}
+
+/* compare the inputs of an 8-pixel group with the last decoded frame,
+   returns true if the group must be decoded again
+*/
+static inline bool _kc85_pixels_changed(kc85_t* sys, uint32_t x, uint32_t y, uint32_t key) {
+    uint32_t* cached = &sys->pixel_cache[y*40 + x];
+    if (*cached != key) {
+        *cached = key;
+        return true;
+    }
+    return false;
+}
+
+static inline void _kc85_decode_8pixels(const uint32_t* pal, uint32_t* ptr, uint8_t pixels, uint8_t colors, bool force_bg) {
     /*
         select foreground- and background color:
         bit 7: blinking
@@ -709,8 +786,8 @@ static inline void _kc85_decode_8pixels(uint32_t* ptr, uint8_t pixels, uint8_t c
     */
     const uint8_t bg_index = colors & 0x7;
     const uint8_t fg_index = (colors>>3)&0xF;
-    const unsigned int bg = _kc85_bg_pal[bg_index];
-    const unsigned int fg = force_bg ? bg : _kc85_fg_pal[fg_index];
+    const unsigned int bg = pal[_KC85_COLOR_BG + bg_index];
+    const unsigned int fg = force_bg ? bg : pal[fg_index];
     ptr[0] = pixels & 0x80 ? fg : bg;
     ptr[1] = pixels & 0x40 ? fg : bg;
     ptr[2] = pixels & 0x20 ? fg : bg;
@@ -743,7 +820,6 @@ static uint64_t _kc85_video_kc85_2_3(kc85_t* sys, int num_cpu_ticks, uint64_t cp
             uint32_t x = sys->h_tick>>1;
             uint32_t y = sys->v_count;
             if (sys->pixel_buffer && (y < 256) && (x < 40)) {
-                uint32_t* dst_ptr = &(sys->pixel_buffer[y*_KC85_DISPLAY_WIDTH + x*8]);
                 uint32_t pixel_offset, color_offset;
                 if (x < 0x20) {
                     /* left 256x256 area */
@@ -760,7 +836,11 @@ static uint64_t _kc85_video_kc85_2_3(kc85_t* sys, int num_cpu_ticks, uint64_t cp
                 uint8_t pixel_bits = pixel_ram[pixel_offset];
                 uint8_t color_bits = color_ram[color_offset];
                 bool force_bg = (blink_bg && (color_bits & 0x80)) | cpu_access;
-                _kc85_decode_8pixels(dst_ptr, pixel_bits, color_bits, force_bg);
+                if (_kc85_pixels_changed(sys, x, y, pixel_bits | ((color_bits & 0x7F)<<8) | (force_bg<<15))) {
+                    uint32_t tmp[8];
+                    _kc85_decode_8pixels(sys->colors, tmp, pixel_bits, color_bits, force_bg);
+                    _kc85_store_pixels(sys, tmp, x, y);
+                }
                 cpu_access = false;
             }
         }
@@ -785,26 +865,31 @@ static uint64_t _kc85_video_kc85_4_hicolor(kc85_t* sys, int num_cpu_ticks, uint6
             uint32_t x = sys->h_tick>>1;
             uint32_t y = sys->v_count;
             if (sys->pixel_buffer && (y < 256) && (x < 40)) {
-                uint32_t* dst = &(sys->pixel_buffer[y*_KC85_DISPLAY_WIDTH + x*8]);
+                const uint32_t* hicolor = &sys->colors[_KC85_COLOR_HICOLOR];
                 uint32_t irm_index = (sys->io84 & 1) * 2;
                 const uint8_t* pixel_ram = sys->ram[_KC85_IRM0_PAGE + irm_index];
                 const uint8_t* color_ram = sys->ram[_KC85_IRM0_PAGE + irm_index + 1];
                 uint32_t offset = (x<<8) | y;
                 uint8_t p0 = pixel_ram[offset];
                 uint8_t p1 = color_ram[offset];
-                /*
-                    Decode 8 pixels for the "HICOLOR" mode with 2-bits per-pixel color.
-                    p0 and p1 are the two bitplanes (taken from the pixel and color RAM
-                    bank). The color palette is hardwired.
-                */
-                dst[0] = _kc85_hicolor[((p0>>7)&1)|((p1>>6)&2)];
-                dst[1] = _kc85_hicolor[((p0>>6)&1)|((p1>>5)&2)];
-                dst[2] = _kc85_hicolor[((p0>>5)&1)|((p1>>4)&2)];
-                dst[3] = _kc85_hicolor[((p0>>4)&1)|((p1>>3)&2)];
-                dst[4] = _kc85_hicolor[((p0>>3)&1)|((p1>>2)&2)];
-                dst[5] = _kc85_hicolor[((p0>>2)&1)|((p1>>1)&2)];
-                dst[6] = _kc85_hicolor[((p0>>1)&1)|((p1>>0)&2)];
-                dst[7] = _kc85_hicolor[((p0>>0)&1)|((p1<<1)&2)];
+                if (_kc85_pixels_changed(sys, x, y, p0 | (p1<<8) | (1<<16))) {
+                    uint32_t tmp[8];
+                    uint32_t* dst = tmp;
+                    /*
+                        Decode 8 pixels for the "HICOLOR" mode with 2-bits per-pixel color.
+                        p0 and p1 are the two bitplanes (taken from the pixel and color RAM
+                        bank). The color palette is hardwired.
+                    */
+                    dst[0] = hicolor[((p0>>7)&1)|((p1>>6)&2)];
+                    dst[1] = hicolor[((p0>>6)&1)|((p1>>5)&2)];
+                    dst[2] = hicolor[((p0>>5)&1)|((p1>>4)&2)];
+                    dst[3] = hicolor[((p0>>4)&1)|((p1>>3)&2)];
+                    dst[4] = hicolor[((p0>>3)&1)|((p1>>2)&2)];
+                    dst[5] = hicolor[((p0>>2)&1)|((p1>>1)&2)];
+                    dst[6] = hicolor[((p0>>1)&1)|((p1>>0)&2)];
+                    dst[7] = hicolor[((p0>>0)&1)|((p1<<1)&2)];
+                    _kc85_store_pixels(sys, tmp, x, y);
+                }
             }
         }
         sys->h_tick++;
@@ -827,7 +912,6 @@ static uint64_t _kc85_video_kc85_4_std(kc85_t* sys, int num_cpu_ticks, uint64_t
             uint32_t x = sys->h_tick>>1;
             uint32_t y = sys->v_count;
             if (sys->pixel_buffer && (y < 256) && (x < 40)) {
-                uint32_t* dst_ptr = &(sys->pixel_buffer[y*_KC85_DISPLAY_WIDTH + x*8]);
                 uint32_t irm_index = (sys->io84 & 1) * 2;
                 const uint8_t* pixel_ram = sys->ram[_KC85_IRM0_PAGE + irm_index];
                 const uint8_t* color_ram = sys->ram[_KC85_IRM0_PAGE + irm_index + 1];
@@ -835,7 +919,11 @@ static uint64_t _kc85_video_kc85_4_std(kc85_t* sys, int num_cpu_ticks, uint64_t
                 uint8_t pixel_bits = pixel_ram[offset];
                 uint8_t color_bits = color_ram[offset];
                 bool force_bg = blink_bg && (color_bits & 0x80); /* no bus contention on KC85/4 */
-                _kc85_decode_8pixels(dst_ptr, pixel_bits, color_bits, force_bg);
+                if (_kc85_pixels_changed(sys, x, y, pixel_bits | ((color_bits & 0x7F)<<8) | (force_bg<<15))) {
+                    uint32_t tmp[8];
+                    _kc85_decode_8pixels(sys->colors, tmp, pixel_bits, color_bits, force_bg);
+                    _kc85_store_pixels(sys, tmp, x, y);
+                }
             }
         }
         sys->h_tick++;
@@ -1495,6 +1583,16 @@ static void _kc85_exp_update_memory_mapping(kc85_t* sys) {
     }
 }
 
+uint32_t kc85_screen_text(kc85_t* sys, char* buf, int buf_size) {
+    CHIPS_ASSERT(sys && sys->valid && buf && (buf_size > 0));
+    /*  the KC85 has no character video memory, but the CAOS operating
+        system keeps an ASCII copy of the 40x32 text screen at 0xB200
+        (this is always in the first IRM bank)
+    */
+    return mem_screen_text(sys->ram[_KC85_IRM0_PAGE] + 0x3200, KC85_SCREEN_TEXT_COLS, KC85_SCREEN_TEXT_ROWS, mem_screen_char,
+        buf, buf_size, &sys->screen_hash, &sys->screen_changes);
+}
+
 /*=== FILE LOADING ===========================================================*/
 
 /* common start function for all snapshot file formats */
@@ -1602,7 +1700,7 @@ static bool _kc85_is_valid_kctap(const uint8_t* ptr, int num_bytes) {
         return false;
     }
     const _kc85_kctap_header* hdr = (const _kc85_kctap_header*) ptr;
-    static uint8_t sig[16] = { 0xC3,'K','C','-','T','A','P','E',0x20,'b','y',0x20,'A','F','.',0x20 };
+    static const uint8_t sig[16] = { 0xC3,'K','C','-','T','A','P','E',0x20,'b','y',0x20,'A','F','.',0x20 };
     for (int i = 0; i < 16; i++) {
         if (sig[i] != hdr->sig[i]) {
             return false;
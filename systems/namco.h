@@ -33,6 +33,7 @@
     - chips/z80.h
     - chips/clk.h
     - chips/mem.h
+    - chips/movie.h
 
     For an example implementation, see:
 
@@ -91,6 +92,7 @@ typedef struct {
     /* video output config */
     void* pixel_buffer;         /* pointer to a linear RGBA8 pixel buffer, at least 224*256*4 bytes */
     int pixel_buffer_size;      /* size of the pixel buffer in bytes */
+    bool indexed_pixels;        /* pixel_buffer receives 8-bit color indices (see namco_palette()) */
 
     /* optional user-data for audio callback */
     void* user_data;
@@ -179,7 +181,17 @@ typedef struct {
     uint8_t sprite_coords[16];      /* 8 sprites, uint8_t x, uint8_t y */
     mem_t mem;
     uint32_t* pixel_buffer;
+    bool indexed_pixels;
     uint32_t palette_cache[512];    /* precomputed RGBA values, Pacman: 256 entries , Pengo: 512 entries*/
+    uint8_t palette_index[512];     /* same as palette_cache, but as hardware color index */
+    uint32_t hw_colors[32];         /* the hardware colors as RGBA8 */
+    uint8_t frame[288*224];         /* the decoded frame as color indices */
+    uint8_t tile_atlas[2][256][8*8];    /* pre-decoded 8x8 tiles, 2-bit color per byte (Pengo has 2 banks) */
+    uint8_t sprite_atlas[2][64][16*16]; /* pre-decoded 16x16 sprites, 2-bit color per byte */
+    uint8_t char_layer[288*224];    /* the background tiles as color indices */
+    uint16_t char_cache[36*28];     /* color and char code each background tile was drawn with */
+    uint32_t char_cache_key;        /* tile bank and palette selection of the background tiles */
+    uint32_t dirty_rows[7];         /* one bit per display line which changed */
     void* user_data;
     namco_sound_t sound;
     uint8_t video_ram[0x0400];
@@ -188,6 +200,8 @@ typedef struct {
     uint8_t rom_cpu[0x8000];        /* program ROM: Pacman: 16 KB, Pengo: 32 KB */
     uint8_t rom_gfx[0x4000];        /* tile ROM: Pacman: 8 KB, Pengo: 16 KB*/
     uint8_t rom_prom[0x0420];       /* palette and color lookup ROM */
+
+    movie_t* movie;                 /* optional input recorder/player */
 } namco_t;
 
 /* initialize a new namco_t instance */
@@ -204,6 +218,8 @@ void namco_decode_video(namco_t* sys);
 void namco_input_set(namco_t* sys, uint32_t mask);
 /* clear input bits */
 void namco_input_clear(namco_t* sys, uint32_t mask);
+/* attach a movie recorder or player (or detach with a null pointer) */
+void namco_attach_movie(namco_t* sys, movie_t* movie);
 /* get the standard framebuffer width and height in pixels */
 int namco_std_display_width(void);
 int namco_std_display_height(void);
@@ -212,6 +228,10 @@ int namco_max_display_size(void);
 /* get the current framebuffer width and height in pixels */
 int namco_display_width(namco_t* sys);
 int namco_display_height(namco_t* sys);
+/* get the RGBA8 colors for an indexed pixel buffer, returns number of colors */
+int namco_palette(namco_t* sys, uint32_t* rgba8, int max_colors);
+/* get and clear the bitmap of display lines changed since the last call (1 bit per line), returns number of lines */
+int namco_dirty_rows(namco_t* sys, uint32_t* bits, int max_rows);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -399,6 +419,9 @@ static uint64_t _namco_tick(int num, uint64_t pins, void* user_data);
 static void _namco_sound_init(namco_t* sys, const namco_desc_t* desc);
 static void _namco_sound_wr(namco_t* sys, uint16_t addr, uint8_t data);
 static void _namco_sound_tick(namco_t* sys, int num_ticks);
+static void _namco_input_set(namco_t* sys, uint32_t mask);
+static void _namco_input_clear(namco_t* sys, uint32_t mask);
+static void _namco_init_atlas(namco_t* sys);
 
 #define _namco_def(val, def) (val == 0 ? def : val)
 
@@ -412,8 +435,9 @@ void namco_init(namco_t* sys, const namco_desc_t* desc) {
     /* audio and video output */
     sys->user_data = desc->user_data;
     _namco_sound_init(sys, desc);
-    CHIPS_ASSERT((0 == desc->pixel_buffer) || (desc->pixel_buffer && (desc->pixel_buffer_size >= NAMCO_DISPLAY_SIZE)));
+    CHIPS_ASSERT((0 == desc->pixel_buffer) || (desc->pixel_buffer && (desc->pixel_buffer_size >= (desc->indexed_pixels ? NAMCO_DISPLAY_SIZE/4 : NAMCO_DISPLAY_SIZE))));
     sys->pixel_buffer = (uint32_t*) desc->pixel_buffer;
+    sys->indexed_pixels = desc->indexed_pixels;
     
     /* copy over ROM images */
     CHIPS_ASSERT(desc->rom_cpu_0000_0FFF && (desc->rom_cpu_0000_0FFF_size == 0x1000));
@@ -541,7 +565,7 @@ void namco_init(namco_t* sys, const namco_desc_t* desc) {
     #endif
 
     /* setup an RGBA palette from the 8-bit RGB values in PROM */
-    uint32_t hw_colors[32];
+    uint32_t* hw_colors = sys->hw_colors;
     for (int i = 0; i < 32; i++) {
         /*
            Each color ROM entry describes an RGB color in 1 byte:
@@ -561,7 +585,13 @@ void namco_init(namco_t* sys, const namco_desc_t* desc) {
         uint8_t pal_index = sys->rom_prom[i + 0x20] & 0xF;
         sys->palette_cache[i] = hw_colors[pal_index];
         sys->palette_cache[256 + i] = hw_colors[0x10 | pal_index];
+        sys->palette_index[i] = pal_index;
+        sys->palette_index[256 + i] = 0x10 | pal_index;
     }
+
+    /* pre-decode tiles and sprites, and force a redraw of all background tiles */
+    _namco_init_atlas(sys);
+    sys->char_cache_key = 0xFFFFFFFF;
 }
 
 void namco_discard(namco_t* sys) {
@@ -574,13 +604,62 @@ void namco_reset(namco_t* sys) {
     z80_reset(&sys->cpu);
 }
 
+static uint32_t _namco_frame_hash(namco_t* sys) {
+    uint32_t hash = movie_hash(MOVIE_HASH_SEED, sys->main_ram, sizeof(sys->main_ram));
+    hash = movie_hash(hash, sys->video_ram, sizeof(sys->video_ram));
+    return movie_hash(hash, sys->color_ram, sizeof(sys->color_ram));
+}
+
+/* apply input events from a movie at the current tick position */
+static void _namco_movie_pull(namco_t* sys) {
+    movie_event_t ev;
+    while (movie_pull(sys->movie, &ev)) {
+        switch (ev.type) {
+            case MOVIE_EVENT_HASH:          movie_check_hash(sys->movie, &ev, _namco_frame_hash(sys)); break;
+            case MOVIE_EVENT_INPUT_SET:     _namco_input_set(sys, ev.data); break;
+            case MOVIE_EVENT_INPUT_CLEAR:   _namco_input_clear(sys, ev.data); break;
+            default: break;
+        }
+    }
+}
+
+/* exec path with an attached movie, split execution at event positions,
+   since z80_exec() only stops at instruction boundaries, the recorded
+   event positions are always instruction boundaries too
+*/
+static uint32_t _namco_exec_movie(namco_t* sys, uint32_t ticks_to_run) {
+    movie_t* movie = sys->movie;
+    uint32_t ticks_executed = 0;
+    while (ticks_executed < ticks_to_run) {
+        _namco_movie_pull(sys);
+        uint32_t ticks = z80_exec(&sys->cpu, movie_ticks_to_run(movie, ticks_to_run - ticks_executed));
+        movie_ticks_executed(movie, ticks);
+        ticks_executed += ticks;
+    }
+    if (!movie_playing(movie) && movie_frame(movie)) {
+        movie_record_hash(movie, _namco_frame_hash(sys));
+    }
+    return ticks_executed;
+}
+
 void namco_exec(namco_t* sys, uint32_t micro_seconds) {
     CHIPS_ASSERT(sys && sys->valid);
     uint32_t ticks_to_run = clk_ticks_to_run(&sys->clk, micro_seconds);
-    uint32_t ticks_executed = z80_exec(&sys->cpu, ticks_to_run);
+    uint32_t ticks_executed;
+    if (sys->movie) {
+        ticks_executed = _namco_exec_movie(sys, ticks_to_run);
+    }
+    else {
+        ticks_executed = z80_exec(&sys->cpu, ticks_to_run);
+    }
     clk_ticks_executed(&sys->clk, ticks_executed);
 }
 
+void namco_attach_movie(namco_t* sys, movie_t* movie) {
+    CHIPS_ASSERT(sys && sys->valid);
+    sys->movie = movie;
+}
+
 static uint64_t _namco_tick(int num_ticks, uint64_t pins, void* user_data) {
     namco_t* sys = (namco_t*) user_data;
 
@@ -698,67 +777,79 @@ static uint16_t _namco_video_offset(uint32_t x, uint32_t y) {
     return offset;
 }
 
-/* 8x4 video tile decoder (used both for background tiles and sprites) */
-static inline void _namco_8x4(
-    uint32_t* pixel_base,
-    uint8_t* tile_base,
-    uint32_t* palette_base,
-    uint32_t tile_stride,
-    uint32_t tile_offset,
-    uint32_t px,
-    uint32_t py,
-    uint8_t char_code,
-    uint8_t color_code,
-    bool opaque,
-    bool flip_x,
-    bool flip_y)
-{
-    uint32_t xor_x = flip_x ? 3 : 0;
-    uint32_t xor_y = flip_y ? 7 : 0;
-    int tile_index = char_code*tile_stride + tile_offset;
-    for (uint32_t yy = 0; yy < 8; yy++, tile_index++) {
-        uint32_t y = py + (yy ^ xor_y);
-        if (y >= NAMCO_DISPLAY_HEIGHT) {
-            continue;
-        }
-        int tile_index = char_code*tile_stride + tile_offset + yy;
-        for (uint32_t xx = 0; xx < 4; xx++) {
-            uint32_t x = px + (xx ^ xor_x);
-            if (x >= NAMCO_DISPLAY_WIDTH) {
-                continue;
+/* get the 2-bit color of pixel x (0..3) in an 8x4 pixel strip byte */
+static inline uint8_t _namco_2bpp(uint8_t bits, int x) {
+    return (((bits>>(7-x)) & 1)<<1) | ((bits>>(3-x)) & 1);
+}
+
+/* Pre-decode the tile and sprite ROM into 1 byte per pixel. Tiles and
+    sprites are made of 8x4 pixel strips with 1 byte per strip line:
+    a tile has the left strip at offset 8 and the right strip at offset 0,
+    and a sprite is 4x2 strips at the offsets in sprite_strips. Flipped
+    sprites read the same atlas entry backwards.
+*/
+static void _namco_init_atlas(namco_t* sys) {
+    static const uint8_t sprite_strips[2][4] = { { 8, 16, 24, 0 }, { 40, 48, 56, 32 } };
+    #if defined(NAMCO_PACMAN)
+    const int num_banks = 1;
+    #else
+    const int num_banks = 2;
+    #endif
+    for (int bank = 0; bank < num_banks; bank++) {
+        const uint8_t* tile_rom = &sys->rom_gfx[bank * 0x2000];
+        const uint8_t* sprite_rom = tile_rom + 0x1000;
+        for (int code = 0; code < 256; code++) {
+            for (int y = 0; y < 8; y++) {
+                for (int x = 0; x < 8; x++) {
+                    uint8_t bits = tile_rom[code*16 + ((x < 4) ? 8 : 0) + y];
+                    sys->tile_atlas[bank][code][y*8 + x] = _namco_2bpp(bits, x & 3);
+                }
             }
-            uint8_t p2_hi = (tile_base[tile_index]>>(7-xx)) & 1;
-            uint8_t p2_lo = (tile_base[tile_index]>>(3-xx)) & 1;
-            uint8_t p2 = (p2_hi<<1)|p2_lo;
-            uint32_t rgba = palette_base[(color_code<<2)|p2];
-            if (opaque || (rgba != 0xFF000000)) {
-                uint32_t* dst = &pixel_base[y*NAMCO_DISPLAY_WIDTH + x];
-                *dst = rgba;
+        }
+        for (int code = 0; code < 64; code++) {
+            for (int y = 0; y < 16; y++) {
+                for (int x = 0; x < 16; x++) {
+                    uint8_t bits = sprite_rom[code*64 + sprite_strips[y>>3][x>>2] + (y & 7)];
+                    sys->sprite_atlas[bank][code][y*16 + x] = _namco_2bpp(bits, x & 3);
+                }
             }
         }
     }
 }
 
-/* decode background tiles */
+/* decode background tiles into the char layer, only tiles with changed char or color code are redrawn */
 static void _namco_decode_chars(namco_t* sys) {
-    uint32_t* pixel_base = sys->pixel_buffer;
-    uint32_t* pal_base = &sys->palette_cache[(sys->pal_select<<8)|(sys->clut_select<<7)];
-    uint8_t* tile_base = &sys->rom_gfx[0x0000] + (sys->tile_select * 0x2000);
+    const uint32_t key = (sys->tile_select<<16) | (sys->pal_select<<8) | sys->clut_select;
+    if (key != sys->char_cache_key) {
+        sys->char_cache_key = key;
+        memset(sys->char_cache, 0xFF, sizeof(sys->char_cache));
+    }
+    const uint8_t* index_base = &sys->palette_index[(sys->pal_select<<8)|(sys->clut_select<<7)];
     for (uint32_t y = 0; y < 28; y++) {
         for (uint32_t x = 0; x < 36; x++) {
             uint16_t offset = _namco_video_offset(x, y);
             uint8_t char_code = sys->video_ram[offset];
             uint8_t color_code = sys->color_ram[offset] & 0x1F;
-            _namco_8x4(pixel_base, tile_base, pal_base, 16, 8, x*8, y*8, char_code, color_code, true, false, false);
-            _namco_8x4(pixel_base, tile_base, pal_base, 16, 0, x*8+4, y*8, char_code, color_code, true, false, false);
+            uint16_t code = (color_code<<8) | char_code;
+            if (sys->char_cache[y*36 + x] == code) {
+                continue;
+            }
+            sys->char_cache[y*36 + x] = code;
+            const uint8_t* src = sys->tile_atlas[sys->tile_select][char_code];
+            const uint8_t* colors = &index_base[color_code<<2];
+            uint8_t* dst = &sys->char_layer[y*8*NAMCO_DISPLAY_WIDTH + x*8];
+            for (int yy = 0; yy < 8; yy++, src += 8, dst += NAMCO_DISPLAY_WIDTH) {
+                for (int xx = 0; xx < 8; xx++) {
+                    dst[xx] = colors[src[xx]];
+                }
+            }
         }
     }
 }
 
-static void _namco_decode_sprites(namco_t* sys) {
-    uint32_t* pixel_base = sys->pixel_buffer;
-    uint32_t* pal_base = &sys->palette_cache[(sys->pal_select<<8)|(sys->clut_select<<7)];
-    uint8_t* tile_base = &sys->rom_gfx[0x1000] + (sys->tile_select * 0x2000);
+static void _namco_decode_sprites(namco_t* sys, uint8_t* pixel_base) {
+    const uint32_t* pal_base = &sys->palette_cache[(sys->pal_select<<8)|(sys->clut_select<<7)];
+    const uint8_t* index_base = &sys->palette_index[(sys->pal_select<<8)|(sys->clut_select<<7)];
     #if defined(NAMCO_PACMAN)
     const int max_sprite = 6;
     const int min_sprite = 1;
@@ -772,35 +863,90 @@ static void _namco_decode_sprites(namco_t* sys) {
         uint8_t shape = sys->main_ram[NAMCO_ADDR_SPRITES_ATTR + sprite_index*2 + 0];
         uint8_t char_code = shape>>2;
         uint8_t color_code = sys->main_ram[NAMCO_ADDR_SPRITES_ATTR + sprite_index*2 + 1];
-        bool flip_x = shape & 1;
-        bool flip_y = shape & 2;
-        uint32_t fy0 = flip_y ? 8 : 0;
-        uint32_t fy1 = flip_y ? 0 : 8;
-        uint32_t fx0 = flip_x ? 12: 0;
-        uint32_t fx1 = flip_x ? 8 : 4;
-        uint32_t fx2 = flip_x ? 4 : 8;
-        uint32_t fx3 = flip_x ? 0 :12;
-        _namco_8x4(pixel_base, tile_base, pal_base, 64, 8,  px+fx0, py+fy0, char_code, color_code, false, flip_x, flip_y);
-        _namco_8x4(pixel_base, tile_base, pal_base, 64, 16, px+fx1, py+fy0, char_code, color_code, false, flip_x, flip_y);
-        _namco_8x4(pixel_base, tile_base, pal_base, 64, 24, px+fx2, py+fy0, char_code, color_code, false, flip_x, flip_y);
-        _namco_8x4(pixel_base, tile_base, pal_base, 64, 0,  px+fx3, py+fy0, char_code, color_code, false, flip_x, flip_y);
-        _namco_8x4(pixel_base, tile_base, pal_base, 64, 40, px+fx0, py+fy1, char_code, color_code, false, flip_x, flip_y);
-        _namco_8x4(pixel_base, tile_base, pal_base, 64, 48, px+fx1, py+fy1, char_code, color_code, false, flip_x, flip_y);
-        _namco_8x4(pixel_base, tile_base, pal_base, 64, 56, px+fx2, py+fy1, char_code, color_code, false, flip_x, flip_y);
-        _namco_8x4(pixel_base, tile_base, pal_base, 64, 32, px+fx3, py+fy1, char_code, color_code, false, flip_x, flip_y);
+        uint32_t xor_x = (shape & 1) ? 15 : 0;
+        uint32_t xor_y = (shape & 2) ? 15 : 0;
+        /* color index and transparency for each 2-bit sprite color */
+        uint8_t colors[4];
+        bool opaque[4];
+        for (int i = 0; i < 4; i++) {
+            uint32_t ci = (color_code<<2)|i;
+            colors[i] = index_base[ci];
+            opaque[i] = pal_base[ci] != 0xFF000000;
+        }
+        const uint8_t* src = sys->sprite_atlas[sys->tile_select][char_code];
+        for (uint32_t yy = 0; yy < 16; yy++) {
+            uint32_t y = py + yy;
+            if (y >= NAMCO_DISPLAY_HEIGHT) {
+                continue;
+            }
+            const uint8_t* src_row = &src[(yy ^ xor_y) * 16];
+            uint8_t* dst = &pixel_base[y * NAMCO_DISPLAY_WIDTH];
+            for (uint32_t xx = 0; xx < 16; xx++) {
+                uint32_t x = px + xx;
+                if (x >= NAMCO_DISPLAY_WIDTH) {
+                    continue;
+                }
+                uint8_t p = src_row[xx ^ xor_x];
+                if (opaque[p]) {
+                    dst[x] = colors[p];
+                }
+            }
+        }
     }
 }
 
 void namco_decode_video(namco_t* sys) {
     CHIPS_ASSERT(sys && sys->valid);
     if (sys->pixel_buffer) {
+        /* decode color indices, and copy (or expand to RGBA8) the lines which changed */
         _namco_decode_chars(sys);
-        _namco_decode_sprites(sys);
+        memcpy(sys->frame, sys->char_layer, sizeof(sys->frame));
+        _namco_decode_sprites(sys, sys->frame);
+        for (int y = 0; y < NAMCO_DISPLAY_HEIGHT; y++) {
+            const uint8_t* src = &sys->frame[y * NAMCO_DISPLAY_WIDTH];
+            bool changed;
+            if (sys->indexed_pixels) {
+                uint8_t* dst = &((uint8_t*)sys->pixel_buffer)[y * NAMCO_DISPLAY_WIDTH];
+                changed = 0 != memcmp(dst, src, NAMCO_DISPLAY_WIDTH);
+                if (changed) {
+                    memcpy(dst, src, NAMCO_DISPLAY_WIDTH);
+                }
+            }
+            else {
+                uint32_t row[NAMCO_DISPLAY_WIDTH];
+                for (int x = 0; x < NAMCO_DISPLAY_WIDTH; x++) {
+                    row[x] = sys->hw_colors[src[x]];
+                }
+                uint32_t* dst = &sys->pixel_buffer[y * NAMCO_DISPLAY_WIDTH];
+                changed = 0 != memcmp(dst, row, sizeof(row));
+                if (changed) {
+                    memcpy(dst, row, sizeof(row));
+                }
+            }
+            if (changed) {
+                mem_dirty_row(sys->dirty_rows, y);
+            }
+        }
     }
 }
 
 void namco_input_set(namco_t* sys, uint32_t mask) {
     CHIPS_ASSERT(sys && sys->valid);
+    if (sys->movie && !movie_input(sys->movie, MOVIE_EVENT_INPUT_SET, mask)) {
+        return;
+    }
+    _namco_input_set(sys, mask);
+}
+
+void namco_input_clear(namco_t* sys, uint32_t mask) {
+    CHIPS_ASSERT(sys && sys->valid);
+    if (sys->movie && !movie_input(sys->movie, MOVIE_EVENT_INPUT_CLEAR, mask)) {
+        return;
+    }
+    _namco_input_clear(sys, mask);
+}
+
+static void _namco_input_set(namco_t* sys, uint32_t mask) {
     if (mask & NAMCO_INPUT_P1_UP) {
         sys->in0 |= NAMCO_IN0_UP;
     }
@@ -849,8 +995,7 @@ void namco_input_set(namco_t* sys, uint32_t mask) {
     }
 }
 
-void namco_input_clear(namco_t* sys, uint32_t mask) {
-    CHIPS_ASSERT(sys && sys->valid);
+static void _namco_input_clear(namco_t* sys, uint32_t mask) {
     if (mask & NAMCO_INPUT_P1_UP) {
         sys->in0 &= ~NAMCO_IN0_UP;
     }
@@ -919,6 +1064,20 @@ int namco_display_height(namco_t* sys) {
     return NAMCO_DISPLAY_HEIGHT;
 }
 
+int namco_palette(namco_t* sys, uint32_t* rgba8, int max_colors) {
+    CHIPS_ASSERT(sys && sys->valid && rgba8);
+    int num = (max_colors < 32) ? max_colors : 32;
+    for (int i = 0; i < num; i++) {
+        rgba8[i] = sys->hw_colors[i];
+    }
+    return num;
+}
+
+int namco_dirty_rows(namco_t* sys, uint32_t* bits, int max_rows) {
+    CHIPS_ASSERT(sys && sys->valid && bits);
+    return mem_take_dirty_rows(sys->dirty_rows, NAMCO_DISPLAY_HEIGHT, bits, max_rows);
+}
+
 static void _namco_sound_init(namco_t* sys, const namco_desc_t* desc) {
     CHIPS_ASSERT(desc->audio_num_samples <= NAMCO_MAX_AUDIO_SAMPLES);
     /* assume zero-initialized */
@@ -69,6 +69,10 @@
 extern "C" {
 #endif
 
+#define Z1013_SCREEN_TEXT_COLS (32) /* text screen size in character cells */
+#define Z1013_SCREEN_TEXT_ROWS (32)
+#define Z1013_SCREEN_TEXT_SIZE (Z1013_SCREEN_TEXT_ROWS*(Z1013_SCREEN_TEXT_COLS+1)+1) /* buffer size for z1013_screen_text() */
+
 /* Z1013 model types */
 typedef enum {
     Z1013_TYPE_64,      /* Z1013.64 (default, latest model with 2 MHz and 64 KB RAM, new ROM) */
@@ -83,6 +87,7 @@ typedef struct {
     /* video output config */
     void* pixel_buffer;         /* pointer to a linear RGBA8 pixel buffer, at least 256*256*4 bytes */
     int pixel_buffer_size;      /* size of the pixel buffer in bytes */
+    bool indexed_pixels;        /* pixel_buffer receives 8-bit color indices (see z1013_palette()) */
 
     /* ROM images */
     const void* rom_mon202;
@@ -102,12 +107,20 @@ typedef struct {
     uint8_t kbd_request_column;
     bool kbd_request_line_hilo;
     uint32_t* pixel_buffer;
+    bool indexed_pixels;
+    uint32_t dirty_rows[8];     /* one bit per display line which changed */
+    uint16_t cell_cache[32*32]; /* character codes of the last decoded frame (0xFFFF: invalid) */
+    uint16_t glyph_key[256];    /* character code of each glyph cache slot (0xFFFF: empty) */
+    uint32_t glyphs[256][64];   /* lazily decoded 8x8 character pixels */
     clk_t clk;
     mem_t mem;
     kbd_t kbd;
     uint8_t ram[1<<16];
     uint8_t rom_os[2048];
     uint8_t rom_font[2048];
+    /* text screen change detection */
+    uint32_t screen_hash;
+    uint32_t screen_changes;
 } z1013_t;
 
 /* initialize a new Z1013 instance */
@@ -122,6 +135,10 @@ int z1013_max_display_size(void);
 /* get the current framebuffer width and height in pixels */
 int z1013_display_width(z1013_t* sys);
 int z1013_display_height(z1013_t* sys);
+/* get the RGBA8 colors for an indexed pixel buffer, returns number of colors */
+int z1013_palette(z1013_t* sys, uint32_t* rgba8, int max_colors);
+/* get and clear the bitmap of display lines changed since the last call (1 bit per line), returns number of lines */
+int z1013_dirty_rows(z1013_t* sys, uint32_t* bits, int max_rows);
 /* reset Z1013 instance */
 void z1013_reset(z1013_t* sys);
 /* run the Z1013 instance for a given number of microseconds */
@@ -132,6 +149,8 @@ void z1013_key_down(z1013_t* sys, int key_code);
 void z1013_key_up(z1013_t* sys, int key_code);
 /* load a "KC .z80" file into the emulator */
 bool z1013_quickload(z1013_t* sys, const uint8_t* ptr, int num_bytes);
+/* decode the text screen into buf (rows terminated by '\n'), returns a counter which increments when the text changes */
+uint32_t z1013_screen_text(z1013_t* sys, char* buf, int buf_size);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -149,6 +168,9 @@ bool z1013_quickload(z1013_t* sys, const uint8_t* ptr, int num_bytes);
 #define _Z1013_DISPLAY_HEIGHT (256)
 #define _Z1013_DISPLAY_SIZE (_Z1013_DISPLAY_WIDTH*_Z1013_DISPLAY_HEIGHT*4)
 
+/* background and foreground color */
+static const uint32_t _z1013_palette[2] = { 0xFF000000, 0xFFFFFFFF };
+
 static uint64_t _z1013_tick(int num, uint64_t pins, void* user_data);
 static uint8_t _z1013_pio_in(int port_id, void* user_data);
 static void _z1013_pio_out(int port_id, uint8_t data, void* user_data);
@@ -158,7 +180,7 @@ static void _z1013_decode_vidmem(z1013_t* sys);
 
 void z1013_init(z1013_t* sys, const z1013_desc_t* desc) {
     CHIPS_ASSERT(sys && desc);
-    CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= _Z1013_DISPLAY_SIZE));
+    CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= (desc->indexed_pixels ? _Z1013_DISPLAY_SIZE/4 : _Z1013_DISPLAY_SIZE)));
     CHIPS_ASSERT(desc->rom_font && (desc->rom_font_size == sizeof(sys->rom_font)));
     if (desc->type == Z1013_TYPE_01) {
         CHIPS_ASSERT(desc->rom_mon202 && (desc->rom_mon202_size == sizeof(sys->rom_os)));
@@ -171,6 +193,9 @@ void z1013_init(z1013_t* sys, const z1013_desc_t* desc) {
     sys->valid = true;
     sys->type = desc->type;
     sys->pixel_buffer = (uint32_t*) desc->pixel_buffer;
+    sys->indexed_pixels = desc->indexed_pixels;
+    memset(sys->cell_cache, 0xFF, sizeof(sys->cell_cache));
+    memset(sys->glyph_key, 0xFF, sizeof(sys->glyph_key));
     memcpy(sys->rom_font, desc->rom_font, sizeof(sys->rom_font));
     if (desc->type == Z1013_TYPE_01) {
         memcpy(sys->rom_os, desc->rom_mon202, sizeof(sys->rom_os));
@@ -315,6 +340,20 @@ int z1013_display_height(z1013_t* sys) {
     return _Z1013_DISPLAY_HEIGHT;
 }
 
+int z1013_palette(z1013_t* sys, uint32_t* rgba8, int max_colors) {
+    CHIPS_ASSERT(sys && sys->valid && rgba8);
+    int num = (max_colors < 2) ? max_colors : 2;
+    for (int i = 0; i < num; i++) {
+        rgba8[i] = _z1013_palette[i];
+    }
+    return num;
+}
+
+int z1013_dirty_rows(z1013_t* sys, uint32_t* bits, int max_rows) {
+    CHIPS_ASSERT(sys && sys->valid && bits);
+    return mem_take_dirty_rows(sys->dirty_rows, _Z1013_DISPLAY_HEIGHT, bits, max_rows);
+}
+
 void z1013_reset(z1013_t* sys) {
     CHIPS_ASSERT(sys && sys->valid);
     z80_reset(&sys->cpu);
@@ -439,26 +478,58 @@ static void _z1013_pio_out(int port_id, uint8_t data, void* user_data) {
     }
 }
 
+/* get the decoded 8x8 pixels of a character, decoding it on first use */
+static const uint32_t* _z1013_glyph(z1013_t* sys, uint8_t chr) {
+    uint32_t* glyph = sys->glyphs[chr];
+    if (sys->glyph_key[chr] != chr) {
+        sys->glyph_key[chr] = chr;
+        /* in indexed mode, the color index is simply the pixel bit */
+        static const uint32_t indices[2] = { 0, 1 };
+        const uint32_t* pal = sys->indexed_pixels ? indices : _z1013_palette;
+        uint32_t* dst = glyph;
+        for (int py = 0; py < 8; py++) {
+            uint8_t bits = sys->rom_font[(chr<<3)|py];
+            for (int px = 7; px >= 0; px--) {
+                *dst++ = pal[(bits>>px) & 1];
+            }
+        }
+    }
+    return glyph;
+}
+
+/* write a character cell to the pixel buffer, changed lines are flagged as dirty */
+static void _z1013_store_cell(z1013_t* sys, int x, int y, const uint32_t* glyph) {
+    for (int py = 0; py < 8; py++, glyph += 8) {
+        const int line = (y<<3) | py;
+        mem_store_pixels(sys->dirty_rows, line, sys->pixel_buffer, sys->indexed_pixels, line * _Z1013_DISPLAY_WIDTH + (x<<3), glyph, 8);
+    }
+}
+
 /* since the Z1013 didn't have any sort of programmable video output, 
-    we're cheating a bit and decode the entire frame in one go
+    we're cheating a bit and decode the entire frame in one go, only
+    the character cells which changed since the last frame are decoded
 */
 static void _z1013_decode_vidmem(z1013_t* sys) {
-    uint32_t* dst = sys->pixel_buffer;
     const uint8_t* src = &sys->ram[0xEC00];   /* the 32x32 framebuffer starts at EC00 */
-    const uint8_t* font = sys->rom_font;
     for (int y = 0; y < 32; y++) {
-        for (int py = 0; py < 8; py++) {
-            for (int x = 0; x < 32; x++) {
-                uint8_t chr = src[(y<<5) + x];
-                uint8_t bits = font[(chr<<3)|py];
-                for (int px = 7; px >=0; px--) {
-                    *dst++ = bits & (1<<px) ? 0xFFFFFFFF : 0xFF000000;
-                }
+        for (int x = 0; x < 32; x++) {
+            const int i = (y<<5) + x;
+            const uint8_t chr = src[i];
+            if (sys->cell_cache[i] != chr) {
+                sys->cell_cache[i] = chr;
+                _z1013_store_cell(sys, x, y, _z1013_glyph(sys, chr));
             }
         }
     }
 }
 
+uint32_t z1013_screen_text(z1013_t* sys, char* buf, int buf_size) {
+    CHIPS_ASSERT(sys && sys->valid && buf && (buf_size > 0));
+    /* the 32x32 ASCII framebuffer starts at EC00 */
+    return mem_screen_text(&sys->ram[0xEC00], Z1013_SCREEN_TEXT_COLS, Z1013_SCREEN_TEXT_ROWS, mem_screen_char,
+        buf, buf_size, &sys->screen_hash, &sys->screen_changes);
+}
+
 /*=== FILE LOADING ===========================================================*/
 
 typedef struct {
@@ -86,6 +86,9 @@ extern "C" {
 
 #define Z9001_MAX_AUDIO_SAMPLES (1024)      /* max number of audio samples in internal sample buffer */
 #define Z9001_DEFAULT_AUDIO_SAMPLES (128)   /* default number of samples in internal sample buffer */ 
+#define Z9001_SCREEN_TEXT_COLS (40)     /* text screen size in character cells */
+#define Z9001_SCREEN_TEXT_ROWS (24)
+#define Z9001_SCREEN_TEXT_SIZE (Z9001_SCREEN_TEXT_ROWS*(Z9001_SCREEN_TEXT_COLS+1)+1) /* buffer size for z9001_screen_text() */
 
 /* Z9001/KC87 model types */
 typedef enum {
@@ -103,6 +106,7 @@ typedef struct {
     /* video output config */
     void* pixel_buffer;         /* pointer to a linear RGBA8 pixel buffer, at least 320*192*4 bytes */
     int pixel_buffer_size;      /* size of the pixel buffer in bytes */
+    bool indexed_pixels;        /* pixel_buffer receives 8-bit color indices (see z9001_palette()) */
 
     /* optional user data for call back functions */
     void* user_data;
@@ -152,6 +156,12 @@ typedef struct {
     mem_t mem;
     kbd_t kbd;
     uint32_t* pixel_buffer;
+    bool indexed_pixels;
+    uint32_t colors[8];         /* RGBA8 colors, or color indices if indexed_pixels */
+    uint32_t dirty_rows[6];     /* one bit per display line which changed */
+    uint16_t cell_cache[24*40]; /* character code and color attribute of the last decoded frame (0xFFFF: invalid) */
+    uint16_t glyph_key[256];    /* character code and color attribute of each glyph cache slot (0xFFFF: empty) */
+    uint32_t glyphs[256][64];   /* lazily decoded 8x8 character pixels */
     void* user_data;
     z9001_audio_callback_t audio_cb;
     int num_samples;
@@ -160,6 +170,9 @@ typedef struct {
     uint8_t ram[1<<16];
     uint8_t rom[0x4000];
     uint8_t rom_font[0x0800];   /* 2 KB font ROM (not mapped into CPU address space) */
+    /* text screen change detection */
+    uint32_t screen_hash;
+    uint32_t screen_changes;
 } z9001_t;
 
 /* initialize a new Z9001 instance */
@@ -174,6 +187,10 @@ int z9001_max_display_size(void);
 /* get the current framebuffer width and height in pixels */
 int z9001_display_width(z9001_t* sys);
 int z9001_display_height(z9001_t* sys);
+/* get the RGBA8 colors for an indexed pixel buffer, returns number of colors */
+int z9001_palette(z9001_t* sys, uint32_t* rgba8, int max_colors);
+/* get and clear the bitmap of display lines changed since the last call (1 bit per line), returns number of lines */
+int z9001_dirty_rows(z9001_t* sys, uint32_t* bits, int max_rows);
 /* reset Z9001 instance */
 void z9001_reset(z9001_t* sys);
 /* run Z9001 instance for a given number of microseconds */
@@ -184,6 +201,8 @@ void z9001_key_down(z9001_t* sys, int key_code);
 void z9001_key_up(z9001_t* sys, int key_code);
 /* load a KC TAP or KCC file into the emulator */
 bool z9001_quickload(z9001_t* sys, const uint8_t* ptr, int num_bytes);
+/* decode the text screen into buf (rows terminated by '\n'), returns a counter which increments when the text changes */
+uint32_t z9001_screen_text(z9001_t* sys, char* buf, int buf_size);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -202,6 +221,18 @@ bool z9001_quickload(z9001_t* sys, const uint8_t* ptr, int num_bytes);
 #define _Z9001_DISPLAY_SIZE (_Z9001_DISPLAY_WIDTH*_Z9001_DISPLAY_HEIGHT*4)
 #define _Z9001_FREQUENCY (2457600)
 
+/* the KC87 color module palette, the monochrome Z9001 only uses black and white */
+static const uint32_t _z9001_palette[8] = {
+    0xFF000000,     /* black */
+    0xFF0000FF,     /* red */
+    0xFF00FF00,     /* green */
+    0xFF00FFFF,     /* yellow */
+    0xFFFF0000,     /* blue */
+    0xFFFF00FF,     /* purple */
+    0xFFFFFF00,     /* cyan */
+    0xFFFFFFFF,     /* white */
+};
+
 static uint64_t _z9001_tick(int num, uint64_t pins, void* user_data);
 static uint8_t _z9001_pio1_in(int port_id, void* user_data);
 static void _z9001_pio1_out(int port_id, uint8_t data, void* user_data);
@@ -247,8 +278,14 @@ void z9001_init(z9001_t* sys, const z9001_desc_t* desc) {
         CHIPS_ASSERT(desc->rom_kc87_os && (desc->rom_kc87_os_size == 0x2000));
         memcpy(&sys->rom[0x2000], desc->rom_kc87_os, 0x2000);
     }
-    CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= _Z9001_DISPLAY_SIZE));
+    CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= (desc->indexed_pixels ? _Z9001_DISPLAY_SIZE/4 : _Z9001_DISPLAY_SIZE)));
     sys->pixel_buffer = (uint32_t*) desc->pixel_buffer;
+    sys->indexed_pixels = desc->indexed_pixels;
+    memset(sys->cell_cache, 0xFF, sizeof(sys->cell_cache));
+    memset(sys->glyph_key, 0xFF, sizeof(sys->glyph_key));
+    for (int i = 0; i < 8; i++) {
+        sys->colors[i] = sys->indexed_pixels ? (uint32_t)i : _z9001_palette[i];
+    }
     sys->audio_cb = desc->audio_cb;
     sys->user_data = desc->user_data;
     sys->num_samples = _Z9001_DEFAULT(desc->audio_num_samples, Z9001_DEFAULT_AUDIO_SAMPLES);
@@ -404,6 +441,20 @@ int z9001_display_height(z9001_t* sys) {
     return _Z9001_DISPLAY_HEIGHT;
 }
 
+int z9001_palette(z9001_t* sys, uint32_t* rgba8, int max_colors) {
+    CHIPS_ASSERT(sys && sys->valid && rgba8);
+    int num = (max_colors < 8) ? max_colors : 8;
+    for (int i = 0; i < num; i++) {
+        rgba8[i] = _z9001_palette[i];
+    }
+    return num;
+}
+
+int z9001_dirty_rows(z9001_t* sys, uint32_t* bits, int max_rows) {
+    CHIPS_ASSERT(sys && sys->valid && bits);
+    return mem_take_dirty_rows(sys->dirty_rows, _Z9001_DISPLAY_HEIGHT, bits, max_rows);
+}
+
 void z9001_reset(z9001_t* sys) {
     CHIPS_ASSERT(sys && sys->valid);
     z80_reset(&sys->cpu);
@@ -587,68 +638,83 @@ void _z9001_pio2_out(int port_id, uint8_t data, void* user_data) {
     }
 }
 
-/* decode the KC87 40x24 framebuffer to a linear 320x192 RGBA8 buffer */
-static const uint32_t _z9001_palette[8] = {
-    0xFF000000,     /* black */
-    0xFF0000FF,     /* red */
-    0xFF00FF00,     /* green */
-    0xFF00FFFF,     /* yellow */
-    0xFFFF0000,     /* blue */
-    0xFFFF00FF,     /* purple */
-    0xFFFFFF00,     /* cyan */
-    0xFFFFFFFF,     /* white */
-};
+/* get the decoded 8x8 pixels of a character code and color attribute
+   (bits 0..2: foreground, bits 3..5: background color), the glyph cache
+   is direct-mapped and decodes glyphs on first use
+*/
+static const uint32_t* _z9001_glyph(z9001_t* sys, uint8_t chr, uint8_t attr) {
+    const uint16_t key = (attr<<8) | chr;
+    const int slot = (chr ^ (attr * 0x25)) & 0xFF;
+    uint32_t* glyph = sys->glyphs[slot];
+    if (sys->glyph_key[slot] != key) {
+        sys->glyph_key[slot] = key;
+        const uint32_t fg = sys->colors[attr & 7];
+        const uint32_t bg = sys->colors[(attr>>3) & 7];
+        uint32_t* dst = glyph;
+        for (int py = 0; py < 8; py++) {
+            uint8_t pixels = sys->rom_font[(chr<<3)|py];
+            for (int px = 7; px >= 0; px--) {
+                *dst++ = pixels & (1<<px) ? fg : bg;
+            }
+        }
+    }
+    return glyph;
+}
+
+/* write a character cell to the pixel buffer (narrowed to 8 bits in
+   indexed mode), changed lines are flagged as dirty
+*/
+static void _z9001_store_cell(z9001_t* sys, int x, int y, const uint32_t* glyph) {
+    for (int py = 0; py < 8; py++, glyph += 8) {
+        const int line = (y<<3) | py;
+        mem_store_pixels(sys->dirty_rows, line, sys->pixel_buffer, sys->indexed_pixels, line * _Z9001_DISPLAY_WIDTH + (x<<3), glyph, 8);
+    }
+}
+
+/* decode the KC87 40x24 framebuffer to a linear 320x192 RGBA8 (or color index) buffer,
+   only the character cells which changed since the last frame are decoded
+*/
 static void _z9001_decode_vidmem(z9001_t* sys) {
     /* FIXME: there's also a 40x20 video mode */
-    uint32_t* dst = sys->pixel_buffer;
     const uint8_t* vidmem = &sys->ram[0xEC00];     /* 1 KB ASCII buffer at EC00 */
     const uint8_t* colmem = &sys->ram[0xE800];     /* 1 KB color buffer at E800 */
-    int offset = 0;
-    if (Z9001_TYPE_KC87 == sys->type) {
-        /* KC87 with color module */
-        const uint8_t* font = sys->rom_font;
-        uint32_t fg, bg;
-        for (int y = 0; y < 24; y++) {
-            for (int py = 0; py < 8; py++) {
-                for (int x = 0; x < 40; x++) {
-                    uint8_t chr = vidmem[offset+x];
-                    uint8_t pixels = font[(chr<<3)|py];
-                    uint8_t color = colmem[offset+x];
-                    if ((color & 0x80) && sys->blink_flip_flop) {
-                        /* blinking: swap back- and foreground color */
-                        fg = _z9001_palette[color&7];
-                        bg = _z9001_palette[(color>>4)&7];
-                    }
-                    else {
-                        fg = _z9001_palette[(color>>4)&7];
-                        bg = _z9001_palette[color&7];
-                    }
-                    for (int px = 7; px >= 0; px--) {
-                        *dst++ = pixels & (1<<px) ? fg:bg;
-                    }
+    const bool has_color = Z9001_TYPE_KC87 == sys->type;
+    for (int y = 0; y < 24; y++) {
+        for (int x = 0; x < 40; x++) {
+            const int i = y*40 + x;
+            const uint8_t chr = vidmem[i];
+            uint8_t attr;
+            if (has_color) {
+                /* KC87 with color module */
+                const uint8_t color = colmem[i];
+                if ((color & 0x80) && sys->blink_flip_flop) {
+                    /* blinking: swap back- and foreground color */
+                    attr = (color & 7) | (((color>>4) & 7)<<3);
                 }
-            }
-            offset += 40;
-        }
-    }
-    else {
-        /* Z9001 monochrome display */
-        const uint8_t* font = sys->rom_font;
-        for (int y = 0; y < 24; y++) {
-            for (int py = 0; py < 8; py++) {
-                for (int x = 0; x < 40; x++) {
-                    uint8_t chr = vidmem[offset + x];
-                    uint8_t pixels = font[(chr<<3)|py];
-                    for (int px = 7; px >=0; px--) {
-                        *dst++ = pixels & (1<<px) ? 0xFFFFFFFF : 0xFF000000;
-                    }
+                else {
+                    attr = ((color>>4) & 7) | ((color & 7)<<3);
                 }
             }
-            offset += 40;
+            else {
+                /* Z9001 monochrome display */
+                attr = 7;
+            }
+            const uint16_t cell = (attr<<8) | chr;
+            if (sys->cell_cache[i] != cell) {
+                sys->cell_cache[i] = cell;
+                _z9001_store_cell(sys, x, y, _z9001_glyph(sys, chr, attr));
+            }
         }
     }
 }
 
+uint32_t z9001_screen_text(z9001_t* sys, char* buf, int buf_size) {
+    CHIPS_ASSERT(sys && sys->valid && buf && (buf_size > 0));
+    /* 1 KB ASCII buffer at EC00, only the 40x24 video mode is supported */
+    return mem_screen_text(&sys->ram[0xEC00], Z9001_SCREEN_TEXT_COLS, Z9001_SCREEN_TEXT_ROWS, mem_screen_char,
+        buf, buf_size, &sys->screen_hash, &sys->screen_changes);
+}
+
 /*=== FILE LOADING ===========================================================*/
 
 /* common start function for file loading routines */
@@ -731,7 +797,7 @@ static bool _z9001_is_valid_kctap(const uint8_t* ptr, int num_bytes) {
         return false;
     }
     const _z9001_kctap_header* hdr = (const _z9001_kctap_header*) ptr;
-    static uint8_t sig[16] = { 0xC3,'K','C','-','T','A','P','E',0x20,'b','y',0x20,'A','F','.',0x20 };
+    static const uint8_t sig[16] = { 0xC3,'K','C','-','T','A','P','E',0x20,'b','y',0x20,'A','F','.',0x20 };
     for (int i = 0; i < 16; i++) {
         if (sig[i] != hdr->sig[i]) {
             return false;
@@ -67,6 +67,9 @@ extern "C" {
 
 #define ZX_MAX_AUDIO_SAMPLES (1024)      /* max number of audio samples in internal sample buffer */
 #define ZX_DEFAULT_AUDIO_SAMPLES (128)   /* default number of samples in internal sample buffer */ 
+#define ZX_SCREEN_TEXT_COLS (32) /* text screen size in character cells */
+#define ZX_SCREEN_TEXT_ROWS (24)
+#define ZX_SCREEN_TEXT_SIZE (ZX_SCREEN_TEXT_ROWS*(ZX_SCREEN_TEXT_COLS+1)+1) /* buffer size for zx_screen_text() */
 
 /* ZX Spectrum models */
 typedef enum {
@@ -100,6 +103,7 @@ typedef struct {
     /* video output config */
     void* pixel_buffer;         /* pointer to a linear RGBA8 pixel buffer, at least 320*256*4 bytes */
     int pixel_buffer_size;      /* size of the pixel buffer in bytes */
+    bool indexed_pixels;        /* pixel_buffer receives 8-bit color indices (see zx_palette()) */
 
     /* optional user-data for callback functions */
     void* user_data;
@@ -144,10 +148,17 @@ typedef struct {
     int scanline_y;
     uint32_t display_ram_bank;
     uint32_t border_color;
+    uint32_t colors[16];            /* normal and bright colors as RGBA8, or color indices */
+    bool indexed_pixels;
     clk_t clk;
     kbd_t kbd;
     mem_t mem;
     uint32_t* pixel_buffer;
+    uint32_t dirty_rows[8];         /* one bit per display line which changed */
+    /* display lines are only decoded again when their inputs changed */
+    uint8_t row_state[256];         /* _ZX_ROW_* flags of the last decode */
+    uint32_t row_border[256];       /* border color a line was last decoded with */
+    uint8_t row_vidmem[192][64];    /* pixel and attribute bytes a line was last decoded from */
     void* user_data;
     zx_audio_callback_t audio_cb;
     int num_samples;
@@ -156,6 +167,9 @@ typedef struct {
     uint8_t ram[8][0x4000];
     uint8_t rom[2][0x4000];
     uint8_t junk[0x4000];
+    /* text screen change detection */
+    uint32_t screen_hash;
+    uint32_t screen_changes;
 } zx_t;
 
 /* initialize a new ZX Spectrum instance */
@@ -170,6 +184,10 @@ int zx_max_display_size(void);
 /* get the current framebuffer width and height in pixels */
 int zx_display_width(zx_t* sys);
 int zx_display_height(zx_t* sys);
+/* get the RGBA8 colors for an indexed pixel buffer, returns number of colors */
+int zx_palette(zx_t* sys, uint32_t* rgba8, int max_colors);
+/* get and clear the bitmap of display lines changed since the last call (1 bit per line), returns number of lines */
+int zx_dirty_rows(zx_t* sys, uint32_t* bits, int max_rows);
 /* reset a ZX Spectrum instance */
 void zx_reset(zx_t* sys);
 /* run ZX Spectrum instance for a given number of microseconds */
@@ -186,6 +204,8 @@ zx_joystick_type_t zx_joystick_type(zx_t* sys);
 void zx_joystick(zx_t* sys, uint8_t mask);
 /* load a ZX Z80 file into the emulator */
 bool zx_quickload(zx_t* sys, const uint8_t* ptr, int num_bytes); 
+/* decode the text screen into buf (rows terminated by '\n'), returns a counter which increments when the text changes */
+uint32_t zx_screen_text(zx_t* sys, char* buf, int buf_size);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -213,22 +233,52 @@ static bool _zx_decode_scanline(zx_t* sys);
 #define _ZX_DEFAULT(val,def) (((val) != 0) ? (val) : (def));
 #define _ZX_CLEAR(val) memset(&val, 0, sizeof(val))
 
+/* row_state flags */
+#define _ZX_ROW_VALID (1<<0)    /* line was decoded, and row_border/row_vidmem are valid */
+#define _ZX_ROW_FLASH (1<<1)    /* line contains flashing attributes */
+#define _ZX_ROW_BLINK (1<<2)    /* ...and was decoded in the inverted flash phase */
+
+static const uint32_t _zx_palette[8] = {
+    0xFF000000,     // black
+    0xFFFF0000,     // blue
+    0xFF0000FF,     // red
+    0xFFFF00FF,     // magenta
+    0xFF00FF00,     // green
+    0xFFFFFF00,     // cyan
+    0xFF00FFFF,     // yellow
+    0xFFFFFFFF,     // white
+};
+
+/* colors 0..7 are standard brightness, 8..15 are bright */
+static void _zx_init_colors(zx_t* sys) {
+    for (int i = 0; i < 16; i++) {
+        if (sys->indexed_pixels) {
+            sys->colors[i] = i;
+        }
+        else {
+            sys->colors[i] = (i < 8) ? (_zx_palette[i] & 0xFFD7D7D7) : _zx_palette[i & 7];
+        }
+    }
+}
+
 void zx_init(zx_t* sys, const zx_desc_t* desc) {
     CHIPS_ASSERT(sys && desc);
-    CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= _ZX_DISPLAY_SIZE));
+    CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= (desc->indexed_pixels ? _ZX_DISPLAY_SIZE/4 : _ZX_DISPLAY_SIZE)));
 
     memset(sys, 0, sizeof(zx_t));
     sys->valid = true;
     sys->type = desc->type;
     sys->joystick_type = desc->joystick_type;
     sys->pixel_buffer = (uint32_t*) desc->pixel_buffer;
+    sys->indexed_pixels = desc->indexed_pixels;
     sys->user_data = desc->user_data;
     sys->audio_cb = desc->audio_cb;
     sys->num_samples = _ZX_DEFAULT(desc->audio_num_samples, ZX_DEFAULT_AUDIO_SAMPLES);
     CHIPS_ASSERT(sys->num_samples <= ZX_MAX_AUDIO_SAMPLES);
 
     /* initalize the hardware */
-    sys->border_color = 0xFF000000;
+    _zx_init_colors(sys);
+    sys->border_color = sys->colors[0];
     if (ZX_TYPE_128 == sys->type) {
         CHIPS_ASSERT(desc->rom_zx128_0 && (desc->rom_zx128_0_size == 0x4000));
         CHIPS_ASSERT(desc->rom_zx128_1 && (desc->rom_zx128_1_size == 0x4000));
@@ -301,6 +351,24 @@ int zx_display_height(zx_t* sys) {
     return _ZX_DISPLAY_HEIGHT;
 }
 
+int zx_palette(zx_t* sys, uint32_t* rgba8, int max_colors) {
+    CHIPS_ASSERT(sys && sys->valid && rgba8);
+    int num = (max_colors < 16) ? max_colors : 16;
+    for (int i = 0; i < num; i++) {
+        rgba8[i] = _zx_palette[i & 7];
+        if (i < 8) {
+            /* standard brightness */
+            rgba8[i] &= 0xFFD7D7D7;
+        }
+    }
+    return num;
+}
+
+int zx_dirty_rows(zx_t* sys, uint32_t* bits, int max_rows) {
+    CHIPS_ASSERT(sys && sys->valid && bits);
+    return mem_take_dirty_rows(sys->dirty_rows, _ZX_DISPLAY_HEIGHT, bits, max_rows);
+}
+
 void zx_reset(zx_t* sys) {
     CHIPS_ASSERT(sys && sys->valid);
     z80_reset(&sys->cpu);
@@ -321,6 +389,7 @@ void zx_reset(zx_t* sys) {
     else {
         sys->display_ram_bank = 5;
     }
+    _ZX_CLEAR(sys->row_state);
     _zx_init_memory_map(sys);
     z80_set_pc(&sys->cpu, 0x0000);
 }
@@ -458,17 +527,6 @@ void zx_joystick(zx_t* sys, uint8_t mask) {
     }
 }
 
-static uint32_t _zx_palette[8] = {
-    0xFF000000,     // black
-    0xFFFF0000,     // blue
-    0xFF0000FF,     // red
-    0xFFFF00FF,     // magenta
-    0xFF00FF00,     // green
-    0xFFFFFF00,     // cyan
-    0xFF00FFFF,     // yellow
-    0xFFFFFFFF,     // white
-};
-
 static uint64_t _zx_tick(int num_ticks, uint64_t pins, void* user_data) {
     zx_t* sys = (zx_t*) user_data;
     /* video decoding and vblank interrupt */
@@ -564,7 +622,7 @@ static uint64_t _zx_tick(int num_ticks, uint64_t pins, void* user_data) {
                     FIXME:
                         bit 3: MIC output (CAS SAVE, 0=On, 1=Off)
                 */
-                sys->border_color = _zx_palette[data & 7] & 0xFFD7D7D7;
+                sys->border_color = sys->colors[data & 7];
                 sys->last_fe_out = data;
                 beeper_set(&sys->beeper, 0 != (data & (1<<4)));
             }
@@ -576,7 +634,11 @@ static uint64_t _zx_tick(int num_ticks, uint64_t pins, void* user_data) {
                     if (!sys->memory_paging_disabled) {
                         sys->last_mem_config = data;
                         /* bit 3 defines the video scanout memory bank (5 or 7) */
-                        sys->display_ram_bank = (data & (1<<3)) ? 7 : 5;
+                        const uint32_t display_ram_bank = (data & (1<<3)) ? 7 : 5;
+                        if (display_ram_bank != sys->display_ram_bank) {
+                            sys->display_ram_bank = display_ram_bank;
+                            _ZX_CLEAR(sys->row_state);
+                        }
                         /* only last memory bank is mappable */
                         mem_map_ram(&sys->mem, 0, 0xC000, 0x4000, sys->ram[data & 0x7]);
 
@@ -612,6 +674,46 @@ static uint64_t _zx_tick(int num_ticks, uint64_t pins, void* user_data) {
     return pins;
 }
 
+/* compute the video memory offsets of a line's pixel and attribute bytes (yy: 0..191)
+
+    this is how the 16-bit video memory address is computed
+    from X and Y coordinates:
+    | 0| 1| 0|Y7|Y6|Y2|Y1|Y0|Y5|Y4|Y3|X4|X3|X2|X1|X0|
+*/
+static inline uint16_t _zx_pix_offset(int yy) {
+    return ((yy & 0xC0)<<5) | ((yy & 0x07)<<8) | ((yy & 0x38)<<2);
+}
+static inline uint16_t _zx_clr_offset(int yy) {
+    return 0x1800 + ((yy & ~0x7)<<2);
+}
+
+/* check if a display line would decode to the same pixels as last time,
+   the video memory bytes are compared with the ones the line was decoded
+   from, so this doesn't depend on how video memory was modified
+*/
+static inline bool _zx_row_unchanged(zx_t* sys, int y) {
+    const uint8_t state = sys->row_state[y];
+    if ((0 == (state & _ZX_ROW_VALID)) || (sys->row_border[y] != sys->border_color)) {
+        return false;
+    }
+    if (state & _ZX_ROW_FLASH) {
+        const bool blink = 0 != (sys->blink_counter & 0x10);
+        if (blink != (0 != (state & _ZX_ROW_BLINK))) {
+            return false;
+        }
+    }
+    if ((y >= 32) && (y < 224)) {
+        const uint8_t* vidmem_bank = sys->ram[sys->display_ram_bank];
+        const uint8_t* cached = sys->row_vidmem[y - 32];
+        if ((0 != memcmp(cached, &vidmem_bank[_zx_pix_offset(y - 32)], 32)) ||
+            (0 != memcmp(cached + 32, &vidmem_bank[_zx_clr_offset(y - 32)], 32)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 static bool _zx_decode_scanline(zx_t* sys) {
     /* this is called by the timer callback for every PAL line, controlling
         the vidmem decoding and vblank interrupt
@@ -630,14 +732,24 @@ static bool _zx_decode_scanline(zx_t* sys) {
         63 or 64 lines top border
         56 border lines bottom border
         48 pixels on each side horizontal border
+
+        lines are skipped if neither their video memory bytes, nor the border
+        color or (for lines with flashing attributes) the flash phase changed
+        since the line was last decoded, the border color is still sampled
+        once per line, so border effects are unaffected
     */
     const int top_decode_line = sys->top_border_scanlines - 32;
     const int btm_decode_line = sys->top_border_scanlines + 192 + 32;
-    if ((sys->scanline_y >= top_decode_line) && (sys->scanline_y < btm_decode_line)) {
+    if ((sys->scanline_y >= top_decode_line) && (sys->scanline_y < btm_decode_line) &&
+        !_zx_row_unchanged(sys, sys->scanline_y - top_decode_line))
+    {
         const uint16_t y = sys->scanline_y - top_decode_line;
-        uint32_t* dst = &sys->pixel_buffer[y * _ZX_DISPLAY_WIDTH];
+        /* decode into a temporary row, which is then compared with the pixel buffer */
+        uint32_t row[_ZX_DISPLAY_WIDTH];
+        uint32_t* dst = row;
         const uint8_t* vidmem_bank = sys->ram[sys->display_ram_bank];
         const bool blink = 0 != (sys->blink_counter & 0x10);
+        uint8_t flash = 0;
         uint32_t fg, bg;
         if ((y < 32) || (y >= 224)) {
             /* upper/lower border */
@@ -646,13 +758,12 @@ static bool _zx_decode_scanline(zx_t* sys) {
             }
         }
         else {
-            /* compute video memory Y offset (inside 256x192 area)
-                this is how the 16-bit video memory address is computed
-                from X and Y coordinates:
-                | 0| 1| 0|Y7|Y6|Y2|Y1|Y0|Y5|Y4|Y3|X4|X3|X2|X1|X0|
-            */
+            /* compute video memory Y offsets (inside 256x192 area) */
             const uint16_t yy = y-32;
-            const uint16_t y_offset = ((yy & 0xC0)<<5) | ((yy & 0x07)<<8) | ((yy & 0x38)<<2);
+            const uint16_t y_offset = _zx_pix_offset(yy);
+            const uint16_t c_offset = _zx_clr_offset(yy);
+            memcpy(sys->row_vidmem[yy], &vidmem_bank[y_offset], 32);
+            memcpy(sys->row_vidmem[yy] + 32, &vidmem_bank[c_offset], 32);
 
             /* left border */
             for (int x = 0; x < (4*8); x++) {
@@ -662,25 +773,22 @@ static bool _zx_decode_scanline(zx_t* sys) {
             /* valid 256x192 vidmem area */
             for (uint16_t x = 0; x < 32; x++) {
                 const uint16_t pix_offset = y_offset | x;
-                const uint16_t clr_offset = 0x1800 + (((yy & ~0x7)<<2) | x);
+                const uint16_t clr_offset = c_offset | x;
 
                 /* pixel mask and color attribute bytes */
                 const uint8_t pix = vidmem_bank[pix_offset];
                 const uint8_t clr = vidmem_bank[clr_offset];
 
-                /* foreground and background color */
+                /* foreground and background color, bit 6 selects bright colors */
+                const int bright = (clr>>3) & 8;
+                flash |= clr & (1<<7);
                 if ((clr & (1<<7)) && blink) {
-                    fg = _zx_palette[(clr>>3) & 7];
-                    bg = _zx_palette[clr & 7];
+                    fg = sys->colors[bright | ((clr>>3) & 7)];
+                    bg = sys->colors[bright | (clr & 7)];
                 }
                 else {
-                    fg = _zx_palette[clr & 7];
-                    bg = _zx_palette[(clr>>3) & 7];
-                }
-                if (0 == (clr & (1<<6))) {
-                    // standard brightness
-                    fg &= 0xFFD7D7D7;
-                    bg &= 0xFFD7D7D7;
+                    fg = sys->colors[bright | (clr & 7)];
+                    bg = sys->colors[bright | ((clr>>3) & 7)];
                 }
                 for (int px = 7; px >=0; px--) {
                     *dst++ = pix & (1<<px) ? fg : bg;
@@ -692,6 +800,9 @@ static bool _zx_decode_scanline(zx_t* sys) {
                 *dst++ = sys->border_color;
             }
         }
+        mem_store_pixels(sys->dirty_rows, y, sys->pixel_buffer, sys->indexed_pixels, y * _ZX_DISPLAY_WIDTH, row, _ZX_DISPLAY_WIDTH);
+        sys->row_state[y] = _ZX_ROW_VALID | (flash ? (_ZX_ROW_FLASH | (blink ? _ZX_ROW_BLINK : 0)) : 0);
+        sys->row_border[y] = sys->border_color;
     }
 
     if (sys->scanline_y++ >= sys->frame_scan_lines) {
@@ -782,6 +893,46 @@ static void _zx_init_keyboard_matrix(zx_t* sys) {
     kbd_register_key(&sys->kbd, 0x0D, 6, 0, 0); /* Enter */
 }
 
+/*  the ZX Spectrum has no character video memory, instead each 8x8 pixel
+    cell is matched against the ROM font (character codes 0x20..0x7E at 0x3D00
+    in the 48K BASIC ROM), inverted cells are matched against the inverted
+    font, cells which don't match any character become '?'
+*/
+uint32_t zx_screen_text(zx_t* sys, char* buf, int buf_size) {
+    CHIPS_ASSERT(sys && sys->valid && buf && (buf_size > 0));
+    const uint8_t* font = (ZX_TYPE_128 == sys->type) ? &sys->rom[1][0x3D00] : &sys->rom[0][0x3D00];
+    uint64_t glyphs[95];     /* skip the copyright sign at 0x7F */
+    for (int i = 0; i < 95; i++) {
+        uint64_t g = 0;
+        for (int py = 0; py < 8; py++) {
+            g = (g<<8) | font[(i<<3) + py];
+        }
+        glyphs[i] = g;
+    }
+    const uint8_t* vidmem = sys->ram[sys->display_ram_bank];
+    uint8_t cells[ZX_SCREEN_TEXT_ROWS * ZX_SCREEN_TEXT_COLS];
+    for (int y = 0; y < ZX_SCREEN_TEXT_ROWS; y++) {
+        for (int x = 0; x < ZX_SCREEN_TEXT_COLS; x++) {
+            /* gather the cell's 8 pixel rows, which are 256 bytes apart */
+            const uint8_t* src = vidmem + (((y & 0x18)<<8) | ((y & 7)<<5) | x);
+            uint64_t bits = 0;
+            for (int py = 0; py < 8; py++) {
+                bits = (bits<<8) | src[py<<8];
+            }
+            uint8_t c = '?';
+            for (int i = 0; i < 95; i++) {
+                if ((bits == glyphs[i]) || (bits == ~glyphs[i])) {
+                    c = (uint8_t) (0x20 + i);
+                    break;
+                }
+            }
+            cells[y*ZX_SCREEN_TEXT_COLS + x] = c;
+        }
+    }
+    return mem_screen_text(cells, ZX_SCREEN_TEXT_COLS, ZX_SCREEN_TEXT_ROWS, 0,
+        buf, buf_size, &sys->screen_hash, &sys->screen_changes);
+}
+
 /*=== FILE LOADING ===========================================================*/
 
 /* ZX Z80 file format header (http://www.worldofspectrum.org/faq/reference/z80format.htm ) */
@@ -998,7 +1149,8 @@ bool zx_quickload(zx_t* sys, const uint8_t* ptr, int num_bytes) {
     else {
         z80_set_pc(&sys->cpu, hdr->PC_h<<8|hdr->PC_l);
     }
-    sys->border_color = _zx_palette[(hdr->flags0>>1) & 7] & 0xFFD7D7D7;
+    sys->border_color = sys->colors[(hdr->flags0>>1) & 7];
+    _ZX_CLEAR(sys->row_state);
     return true;
 }
 #endif /* CHIPS_IMPL */
@@ -140,7 +140,7 @@ uint16_t m6502dasm_op(uint16_t pc, m6502dasm_input_t in_cb, m6502dasm_output_t o
 #define A_INV    (13)    /* this is an invalid instruction */
 
 /* opcode descriptions */
-static uint8_t _m6502dasm_ops[4][8][8] = {
+static const uint8_t _m6502dasm_ops[4][8][8] = {
 /* cc = 00 */
 {
     //---  BIT   JMP   JMP() STY   LDY   CPY   CPX